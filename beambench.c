@@ -0,0 +1,512 @@
+#include "beamtrace.h"
+#include "cJSON.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_RAYS 4096 // distinct rays cycled through by every case
+#define BENCH_BATCH 64
+
+typedef enum BenchLayout {
+  LAYOUT_UNIFORM,
+  LAYOUT_CLUSTERED,
+  LAYOUT_CORRIDOR,
+} BenchLayout;
+
+typedef enum BenchMode {
+  MODE_BRUTE,
+  MODE_BVH,
+  MODE_GRID,
+  MODE_SIMD,
+  MODE_PACKET,
+  MODE_COUNT,
+} BenchMode;
+
+static const char *layoutNames[] = {"uniform", "clustered", "corridor"};
+static const char *modeNames[] = {"brute", "bvh", "grid", "simd", "packet"};
+static const char *kernelNames[] = {"scalar", "sse2", "avx2"};
+static const int syntheticSizes[] = {32, 1000, 10000, 100000};
+
+typedef struct BenchOptions {
+  double budget; // seconds spent timing each case
+  int maxObstacles;
+  const char *outPath;
+} BenchOptions;
+
+typedef struct BenchResult {
+  long long rays;
+  double seconds;
+  long long segments; // over the counting pass
+  long long counted;  // rays in the counting pass
+  BeamStats stats;
+} BenchResult;
+
+static volatile float sink;
+static unsigned int rngState = 1u;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static float RandomFloat(float lo, float hi) {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return lo + (hi - lo) * (float)(rngState >> 8) / 16777216.0f;
+}
+
+// Roughly normal, from the sum of three uniform samples.
+static float RandomSpread(float sigma) {
+  return (RandomFloat(-1.0f, 1.0f) + RandomFloat(-1.0f, 1.0f) +
+          RandomFloat(-1.0f, 1.0f)) *
+         sigma;
+}
+
+static Vector2 RandomDir(void) {
+  float angle = RandomFloat(-BEAM_PI, BEAM_PI);
+  return (Vector2){cosf(angle), sinf(angle)};
+}
+
+static double Elapsed(double start) { return Now() - start; }
+
+static void AddKernelResult(cJSON *list, const char *name, long long calls,
+                            double seconds, long long hits) {
+  cJSON *item = cJSON_CreateObject();
+  cJSON_AddStringToObject(item, "name", name);
+  cJSON_AddNumberToObject(item, "calls", (double)calls);
+  cJSON_AddNumberToObject(item, "seconds", seconds);
+  cJSON_AddNumberToObject(item, "callsPerSecond", (double)calls / seconds);
+  cJSON_AddNumberToObject(item, "nsPerCall", seconds * 1e9 / (double)calls);
+  cJSON_AddNumberToObject(item, "hitRate", (double)hits / (double)calls);
+  cJSON_AddItemToArray(list, item);
+  printf("  %-20s %8.2f ns/call %9.1f Mcalls/s  hit rate %.2f\n", name,
+         seconds * 1e9 / (double)calls, (double)calls / seconds * 1e-6,
+         (double)hits / (double)calls);
+}
+
+// Each kernel is fed BENCH_RAYS random rays from inside the default field
+// against as many random shapes, so branches see a realistic hit mix.
+static void BenchKernels(const BenchOptions *options, cJSON *out) {
+  static Vector2 pos[BENCH_RAYS];
+  static Vector2 dir[BENCH_RAYS];
+  static Rectangle rects[BENCH_RAYS];
+  static Vector2 centers[BENCH_RAYS];
+  static float radii[BENCH_RAYS];
+  StageData field = {0};
+  ResetStage(&field);
+  Rectangle f = field.field;
+  rngState = 1u;
+  for (int i = 0; i < BENCH_RAYS; i++) {
+    pos[i] = (Vector2){RandomFloat(f.x, f.x + f.width),
+                       RandomFloat(f.y, f.y + f.height)};
+    dir[i] = RandomDir();
+    rects[i] = (Rectangle){RandomFloat(f.x, f.x + f.width),
+                           RandomFloat(f.y, f.y + f.height),
+                           RandomFloat(10.0f, 200.0f),
+                           RandomFloat(10.0f, 200.0f)};
+    centers[i] = (Vector2){RandomFloat(f.x, f.x + f.width),
+                           RandomFloat(f.y, f.y + f.height)};
+    radii[i] = RandomFloat(10.0f, 100.0f);
+  }
+
+  printf("kernels\n");
+  for (int k = 0; k < 3; k++) {
+    long long calls = 0;
+    long long hits = 0;
+    float acc = 0.0f;
+    double start = Now();
+    do {
+      for (int i = 0; i < BENCH_RAYS; i++) {
+        float t = 0.0f;
+        Vector2 n = {0.0f, 0.0f};
+        bool found;
+        if (k == 0)
+          found = RayIntersectRect(pos[i], dir[i], rects[i], &t, &n);
+        else if (k == 1)
+          found = RayIntersectCircle(pos[i], dir[i], centers[i], radii[i], &t,
+                                     &n);
+        else
+          found = RayIntersectWalls(pos[i], dir[i], f.x, f.x + f.width, f.y,
+                                    f.y + f.height, &t, &n);
+        hits += found;
+        acc += t + n.x;
+      }
+      calls += BENCH_RAYS;
+    } while (Elapsed(start) < options->budget);
+    double seconds = Elapsed(start);
+    sink = acc;
+    static const char *names[] = {"RayIntersectRect", "RayIntersectCircle",
+                                  "RayIntersectWalls"};
+    AddKernelResult(out, names[k], calls, seconds, hits);
+  }
+}
+
+static bool StageFree(const StageData *stage, Vector2 p, float clearance) {
+  return fabsf(p.x - stage->start.x) > clearance ||
+         fabsf(p.y - stage->start.y) > clearance;
+}
+
+// Synthetic stages keep the default field and start, with the start left
+// clear so every ray leaves it. Obstacle sizes shrink with count so the
+// covered fraction of the field stays comparable.
+static bool BuildSyntheticStage(StageData *stage, BenchLayout layout,
+                                int count) {
+  ResetStage(stage);
+  rngState = 0x9e3779b9u ^ (unsigned int)(count * 3 + layout);
+  Rectangle f = stage->field;
+  float cell = sqrtf(f.width * f.height / (float)count);
+  int circles = layout == LAYOUT_CORRIDOR ? 0 : count / 2;
+  if (!ReserveStageObstacles(stage, count - circles, circles))
+    return false;
+
+  if (layout == LAYOUT_CORRIDOR) {
+    // Horizontal corridors lined with thin wall pieces and regular gaps.
+    int rows = (int)ceilf(sqrtf((float)count / 8.0f));
+    int perRow = (count + rows - 1) / rows;
+    float spacing = f.height / (float)rows;
+    float piece = f.width / (float)perRow;
+    float thickness = fminf(spacing * 0.2f, 8.0f);
+    for (int i = 0; i < count; i++) {
+      int row = i / perRow;
+      int col = i % perRow;
+      float y = stage->start.y + ((float)row + 0.5f) * spacing;
+      while (y > f.y + f.height)
+        y -= f.height;
+      stage->rects[stage->rectCount++] =
+          (Rectangle){f.x + (float)col * piece, y - thickness * 0.5f,
+                      piece * 0.8f, thickness};
+    }
+  } else {
+    int clusters = layout == LAYOUT_CLUSTERED ? 4 + count / 2000 : 0;
+    Vector2 centers[64];
+    if (clusters > 64)
+      clusters = 64;
+    for (int c = 0; c < clusters; c++)
+      centers[c] = (Vector2){RandomFloat(f.x, f.x + f.width),
+                             RandomFloat(f.y, f.y + f.height)};
+    float size = layout == LAYOUT_CLUSTERED ? cell * 0.15f : cell * 0.4f;
+    if (size > 80.0f)
+      size = 80.0f;
+    for (int i = 0; i < count; i++) {
+      Vector2 p;
+      do {
+        if (clusters > 0) {
+          Vector2 c = centers[i % clusters];
+          p = (Vector2){c.x + RandomSpread(f.width * 0.04f),
+                        c.y + RandomSpread(f.height * 0.04f)};
+        } else {
+          p = (Vector2){RandomFloat(f.x, f.x + f.width),
+                        RandomFloat(f.y, f.y + f.height)};
+        }
+      } while (!StageFree(stage, p, size + 4.0f));
+      float s = size * RandomFloat(0.5f, 1.5f);
+      if (i < count - circles) {
+        stage->rects[stage->rectCount++] =
+            (Rectangle){p.x - s * 0.5f, p.y - s * 0.5f, s, s};
+      } else {
+        stage->circlePos[stage->circleCount] = p;
+        stage->circleRadius[stage->circleCount] = s * 0.5f;
+        stage->circleCount++;
+      }
+    }
+  }
+  PrepareStage(stage);
+  return true;
+}
+
+static void TraceBatch(StageData *stage, BenchMode mode, const Vector2 *dirs,
+                       int first, BeamPath *paths, long long *segments) {
+  for (int i = 0; i < BENCH_BATCH; i += BEAM_PACKET_MAX) {
+    const Vector2 *batch = &dirs[(first + i) % BENCH_RAYS];
+    if (mode == MODE_PACKET) {
+      TraceBeamPacket(stage, stage->start, batch, BEAM_PACKET_MAX,
+                      stage->maxBounces, BEAM_DEFAULT_LENGTH, paths);
+    } else {
+      for (int l = 0; l < BEAM_PACKET_MAX; l++)
+        TraceBeam(stage, stage->start, batch[l], stage->maxBounces,
+                  BEAM_DEFAULT_LENGTH, &paths[l]);
+    }
+    if (segments)
+      for (int l = 0; l < BEAM_PACKET_MAX; l++)
+        *segments += paths[l].segmentCount;
+  }
+}
+
+// Times the mode for the budget, then replays the same rays (at most one
+// pass over them) with stats enabled to count the work per ray.
+static BenchResult BenchTrace(StageData *stage, BenchMode mode,
+                              const Vector2 *dirs,
+                              const BenchOptions *options) {
+  static const StageAccel accels[] = {STAGE_ACCEL_BRUTE, STAGE_ACCEL_BVH,
+                                      STAGE_ACCEL_GRID, STAGE_ACCEL_SIMD,
+                                      STAGE_ACCEL_BVH};
+  stage->accel = accels[mode];
+  BeamPath paths[BEAM_PACKET_MAX] = {0};
+  BenchResult result = {0};
+
+  double start = Now();
+  do {
+    TraceBatch(stage, mode, dirs, (int)(result.rays % BENCH_RAYS), paths,
+               NULL);
+    result.rays += BENCH_BATCH;
+  } while (Elapsed(start) < options->budget);
+  result.seconds = Elapsed(start);
+
+  stage->stats = &result.stats;
+  for (long long r = 0; r < result.rays && r < BENCH_RAYS; r += BENCH_BATCH) {
+    TraceBatch(stage, mode, dirs, (int)r, paths, &result.segments);
+    result.counted += BENCH_BATCH;
+  }
+  stage->stats = NULL;
+  for (int l = 0; l < BEAM_PACKET_MAX; l++)
+    UnloadBeamPath(&paths[l]);
+  return result;
+}
+
+static void BenchStage(StageData *stage, const char *name, const char *layout,
+                       const BenchOptions *options, cJSON *out) {
+  static Vector2 dirs[BENCH_RAYS];
+  rngState = 7u;
+  for (int i = 0; i < BENCH_RAYS; i++)
+    dirs[i] = RandomDir();
+
+  int obstacles = stage->rectCount + stage->circleCount;
+  printf("%s (%s, %d obstacles)\n", name, layout, obstacles);
+  for (int m = 0; m < MODE_COUNT; m++) {
+    BenchResult r = BenchTrace(stage, (BenchMode)m, dirs, options);
+    double perRay = 1.0 / (double)r.counted;
+    double nsPerRay = r.seconds * 1e9 / (double)r.rays;
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "stage", name);
+    cJSON_AddStringToObject(item, "layout", layout);
+    cJSON_AddNumberToObject(item, "obstacles", obstacles);
+    cJSON_AddStringToObject(item, "mode", modeNames[m]);
+    cJSON_AddNumberToObject(item, "rays", (double)r.rays);
+    cJSON_AddNumberToObject(item, "seconds", r.seconds);
+    cJSON_AddNumberToObject(item, "raysPerSecond",
+                            (double)r.rays / r.seconds);
+    cJSON_AddNumberToObject(item, "nsPerRay", nsPerRay);
+    cJSON_AddNumberToObject(item, "segmentsPerRay",
+                            (double)r.segments * perRay);
+    cJSON_AddNumberToObject(item, "obstacleTestsPerRay",
+                            (double)r.stats.obstacleTests * perRay);
+    cJSON_AddNumberToObject(item, "nodeTestsPerRay",
+                            (double)r.stats.nodeTests * perRay);
+    cJSON_AddItemToArray(out, item);
+    printf("  %-7s %11.1f ns/ray %9.3f Mrays/s %10.1f tests/ray %9.1f "
+           "nodes/ray\n",
+           modeNames[m], nsPerRay, (double)r.rays / r.seconds * 1e-6,
+           (double)r.stats.obstacleTests * perRay,
+           (double)r.stats.nodeTests * perRay);
+  }
+}
+
+// Same schema as stages/stage1.json.
+static bool WriteStageFile(const StageData *stage, FILE *file) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON *rects = cJSON_AddArrayToObject(root, "rects");
+  for (int i = 0; i < stage->rectCount; i++) {
+    cJSON *r = cJSON_CreateObject();
+    cJSON_AddNumberToObject(r, "x", stage->rects[i].x);
+    cJSON_AddNumberToObject(r, "y", stage->rects[i].y);
+    cJSON_AddNumberToObject(r, "w", stage->rects[i].width);
+    cJSON_AddNumberToObject(r, "h", stage->rects[i].height);
+    cJSON_AddItemToArray(rects, r);
+  }
+  cJSON *circles = cJSON_AddArrayToObject(root, "circles");
+  for (int i = 0; i < stage->circleCount; i++) {
+    cJSON *o = cJSON_CreateObject();
+    cJSON_AddNumberToObject(o, "x", stage->circlePos[i].x);
+    cJSON_AddNumberToObject(o, "y", stage->circlePos[i].y);
+    cJSON_AddNumberToObject(o, "r", stage->circleRadius[i]);
+    cJSON_AddItemToArray(circles, o);
+  }
+  char *text = cJSON_Print(root);
+  cJSON_Delete(root);
+  bool ok = text && fputs(text, file) >= 0 && fflush(file) == 0;
+  free(text);
+  return ok;
+}
+
+// Writes each synthetic uniform stage to a file and times LoadStage on it,
+// and PrepareStage alone, so parsing is told apart from building the
+// acceleration structures.
+static bool BenchLoad(const BenchOptions *options, cJSON *out) {
+  printf("load\n");
+  StageData stage = {0};
+  StageData loaded = {0};
+  bool ok = true;
+  for (size_t s = 0; s < sizeof(syntheticSizes) / sizeof(syntheticSizes[0]);
+       s++) {
+    int count = syntheticSizes[s];
+    if (count > options->maxObstacles)
+      continue;
+    char path[] = "/tmp/beambench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    bool written = file && BuildSyntheticStage(&stage, LAYOUT_UNIFORM, count) &&
+                   WriteStageFile(&stage, file);
+    long bytes = written ? ftell(file) : 0;
+    if (file)
+      fclose(file);
+    else if (fd >= 0)
+      close(fd);
+
+    long long loads = 0;
+    double seconds = 0.0;
+    if (written) {
+      double start = Now();
+      do {
+        written = LoadStage(path, &loaded);
+        loads++;
+      } while (written && Elapsed(start) < options->budget);
+      seconds = Elapsed(start);
+    }
+    if (fd >= 0)
+      unlink(path);
+    if (!written) {
+      fprintf(stderr, "uniform-%d: failed to write or load stage\n", count);
+      ok = false;
+      continue;
+    }
+
+    long long prepares = 0;
+    double start = Now();
+    do {
+      PrepareStage(&loaded);
+      prepares++;
+    } while (Elapsed(start) < options->budget);
+    double prepareSeconds = Elapsed(start);
+
+    double msPerLoad = seconds * 1e3 / (double)loads;
+    double msPerPrepare = prepareSeconds * 1e3 / (double)prepares;
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(item, "obstacles", count);
+    cJSON_AddNumberToObject(item, "bytes", (double)bytes);
+    cJSON_AddNumberToObject(item, "loads", (double)loads);
+    cJSON_AddNumberToObject(item, "msPerLoad", msPerLoad);
+    cJSON_AddNumberToObject(item, "msPerPrepare", msPerPrepare);
+    cJSON_AddItemToArray(out, item);
+    printf("  uniform-%-7d %9.3f ms/load %9.3f ms of it preparing  %.1f MB\n",
+           count, msPerLoad, msPerPrepare, (double)bytes / 1e6);
+  }
+  UnloadStage(&stage);
+  UnloadStage(&loaded);
+  return ok;
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-t seconds] [-n maxObstacles] [-o out.json] "
+          "[stage.json...]\n"
+          "Times the intersection kernels and loading synthetic stage files, "
+          "then full\n"
+          "traces from the start of each stage\n"
+          "(default stages/stage1.json) and of synthetic stages with 32 to "
+          "100000\n"
+          "obstacles, in every acceleration mode. -t is the time per case "
+          "(default 0.2),\n"
+          "-n skips larger synthetic stages. Results are also written to "
+          "-o as JSON\n"
+          "(default bench.json).\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options = {0.2, 100000, "bench.json"};
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    const char *arg = argv[argi];
+    const char *value = argi + 1 < argc ? argv[argi + 1] : NULL;
+    if (strcmp(arg, "-h") == 0) {
+      Usage(argv[0]);
+      return 0;
+    }
+    if (!value) {
+      Usage(argv[0]);
+      return 2;
+    }
+    if (strcmp(arg, "-t") == 0) {
+      options.budget = atof(value);
+    } else if (strcmp(arg, "-n") == 0) {
+      options.maxObstacles = atoi(value);
+    } else if (strcmp(arg, "-o") == 0) {
+      options.outPath = value;
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+    argi++;
+  }
+  if (!(options.budget > 0.0)) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  StageData stage = {0};
+  SetBeamKernel(BEAM_KERNEL_AVX2);
+
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "time", (double)time(NULL));
+  cJSON_AddStringToObject(root, "simdKernel", kernelNames[GetBeamKernel()]);
+  cJSON_AddNumberToObject(root, "budget", options.budget);
+  cJSON *kernels = cJSON_AddArrayToObject(root, "kernels");
+  cJSON *loads = cJSON_AddArrayToObject(root, "loads");
+  cJSON *traces = cJSON_AddArrayToObject(root, "traces");
+
+  BenchKernels(&options, kernels);
+
+  int status = 0;
+  if (!BenchLoad(&options, loads))
+    status = 2;
+  static const char *defaultStages[] = {"stages/stage1.json"};
+  const char **stagePaths = (const char **)argv + argi;
+  int stageCount = argc - argi;
+  if (stageCount == 0) {
+    stagePaths = defaultStages;
+    stageCount = 1;
+  }
+  for (int i = 0; i < stageCount; i++) {
+    if (!LoadStage(stagePaths[i], &stage)) {
+      fprintf(stderr, "%s: failed to load stage\n", stagePaths[i]);
+      status = 2;
+      continue;
+    }
+    BenchStage(&stage, stagePaths[i], "file", &options, traces);
+  }
+
+  for (int layout = 0; layout < 3; layout++) {
+    for (size_t s = 0; s < sizeof(syntheticSizes) / sizeof(syntheticSizes[0]);
+         s++) {
+      int count = syntheticSizes[s];
+      if (count > options.maxObstacles)
+        continue;
+      char name[64];
+      snprintf(name, sizeof(name), "%s-%d", layoutNames[layout], count);
+      if (!BuildSyntheticStage(&stage, (BenchLayout)layout, count)) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        status = 2;
+        continue;
+      }
+      BenchStage(&stage, name, layoutNames[layout], &options, traces);
+    }
+  }
+  UnloadStage(&stage);
+
+  char *json = cJSON_Print(root);
+  FILE *file = json ? fopen(options.outPath, "w") : NULL;
+  if (!file || fputs(json, file) < 0 || fputc('\n', file) < 0) {
+    fprintf(stderr, "%s: failed to write results\n", options.outPath);
+    status = 2;
+  }
+  if (file && fclose(file) != 0)
+    status = 2;
+  free(json);
+  cJSON_Delete(root);
+  return status;
+}
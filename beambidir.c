@@ -0,0 +1,430 @@
+#include "beamtrace.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BIDIR_CHUNK 4096
+
+// Reverse beams are fired from the goal centre at evenly spaced angles. A
+// route is the sequence of objects (and sides) a reverse beam bounced off
+// before one of its segments passed the start. Where two neighbouring
+// reverse beams take the same route and pass the start on opposite sides,
+// some angle between them passes through it exactly; fired back from the
+// start, that beam retraces the route into the goal. How wide a route is
+// depends on the obstacles, not on the goal radius, so tiny goals cost the
+// reverse sweep nothing extra.
+typedef struct RouteSlot {
+  unsigned long long route; // 0 for an empty slot
+  int sample;               // last reverse beam that took it
+  float offset;             // signed distance of the start from that beam
+} RouteSlot;
+
+typedef struct BidirBracket {
+  unsigned long long route;
+  int segment; // reverse segment passing the start
+  int sample;  // the start lies between this reverse beam and the previous
+} BidirBracket;
+
+typedef struct BracketList {
+  BidirBracket *items;
+  int count;
+  int capacity;
+  bool failed; // a bracket could not be stored
+} BracketList;
+
+typedef struct BidirJob {
+  const StageData *stage;
+  StageData reverse; // the stage without its goal, traced from inside it
+  int maxBounces;
+  float maxLength;
+  int samples;
+  float drift;        // StageSolveDrift of the stage
+  BracketList *lists; // one per pool worker
+  BeamPath *paths;    // two per pool worker
+  long long *rays;    // one per pool worker
+  BidirBracket *brackets;
+  float *solved; // one per bracket, NAN where the join failed
+} BidirJob;
+
+static bool PushBracket(BracketList *list, BidirBracket bracket) {
+  if (list->count == list->capacity) {
+    int capacity = list->capacity ? list->capacity * 2 : 64;
+    BidirBracket *items =
+        realloc(list->items, sizeof(BidirBracket) * (size_t)capacity);
+    if (!items)
+      return false;
+    list->items = items;
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = bracket;
+  return true;
+}
+
+// Which side of a wall or rect was hit; beams off different sides of one
+// object take different routes. Circles have no sides.
+static unsigned int HitFace(const BeamSegment *s) {
+  if (s->hitKind == BEAM_HIT_CIRCLE)
+    return 0;
+  if (s->normal.x > 0.5f)
+    return 1;
+  if (s->normal.x < -0.5f)
+    return 2;
+  return s->normal.y > 0.5f ? 3 : 4;
+}
+
+// Hash of the objects and sides hit at the ends of the first count
+// segments; never 0.
+static unsigned long long RouteHash(const BeamSegment *segments, int count) {
+  unsigned long long hash = 1469598103934665603ULL;
+  for (int i = 0; i < count; i++) {
+    const BeamSegment *s = &segments[i];
+    unsigned int key = (unsigned int)s->hitKind << 28 ^ HitFace(s) << 24 ^
+                       (unsigned int)(s->hitIndex + 1);
+    for (int b = 0; b < 4; b++) {
+      hash ^= (key >> (b * 8)) & 0xffu;
+      hash *= 1099511628211ULL;
+    }
+  }
+  hash ^= (unsigned int)count;
+  hash *= 1099511628211ULL;
+  return hash ? hash : 1;
+}
+
+static float ReverseAngle(const BidirJob *job, int sample) {
+  return (float)(-M_PI + 2.0 * M_PI * ((double)sample + 0.5) /
+                             (double)job->samples);
+}
+
+static void TraceReverse(const BidirJob *job, float angle, BeamPath *path,
+                         int worker) {
+  TraceBeam(&job->reverse, job->stage->goalPos,
+            (Vector2){cosf(angle), sinf(angle)}, job->maxBounces,
+            job->maxLength, path);
+  job->rays[worker]++;
+}
+
+// Signed distance of the start from the segment's line, or NAN when the
+// start does not lie alongside the segment.
+static float StartOffset(const StageData *stage, const BeamSegment *s) {
+  float dx = s->end.x - s->start.x, dy = s->end.y - s->start.y;
+  float len = sqrtf(dx * dx + dy * dy);
+  if (len <= 0.0f)
+    return NAN;
+  float px = stage->start.x - s->start.x, py = stage->start.y - s->start.y;
+  float along = (px * dx + py * dy) / len;
+  if (along <= 0.0f || along >= len)
+    return NAN;
+  return (px * dy - py * dx) / len;
+}
+
+// Open addressing over a power-of-two table; returns the route's slot,
+// which is empty if the route is new.
+static RouteSlot *FindRoute(RouteSlot *table, int size,
+                            unsigned long long route) {
+  unsigned int mask = (unsigned int)size - 1;
+  unsigned int slot = (unsigned int)(route ^ route >> 32) & mask;
+  while (table[slot].route != 0 && table[slot].route != route)
+    slot = (slot + 1) & mask;
+  return &table[slot];
+}
+
+static void ReverseChunk(BidirJob *job, int begin, int end, int worker,
+                         RouteSlot *table, int tableSize) {
+  BeamPath *path = &job->paths[worker * 2];
+  int used = 0;
+  memset(table, 0, sizeof(RouteSlot) * (size_t)tableSize);
+  // The beam before the chunk is traced again so brackets straddling the
+  // chunk boundary are found; beam -1 is the last one, a turn earlier.
+  for (int i = begin - 1; i < end; i++) {
+    TraceReverse(job, ReverseAngle(job, i), path, worker);
+    for (int j = 0; j < path->segmentCount; j++) {
+      float offset = StartOffset(job->stage, &path->segments[j]);
+      if (isnan(offset))
+        continue;
+      unsigned long long route = RouteHash(path->segments, j);
+      RouteSlot *slot = FindRoute(table, tableSize, route);
+      if (slot->route == 0) {
+        // Full enough to slow probing down: start over, losing at most the
+        // brackets ending at this beam.
+        if (++used * 2 > tableSize) {
+          memset(table, 0, sizeof(RouteSlot) * (size_t)tableSize);
+          used = 1;
+          slot = FindRoute(table, tableSize, route);
+        }
+      } else if (slot->sample == i - 1 &&
+                 (slot->offset < 0.0f) != (offset < 0.0f)) {
+        if (!PushBracket(&job->lists[worker], (BidirBracket){route, j, i}))
+          job->lists[worker].failed = true;
+      }
+      *slot = (RouteSlot){route, i, offset};
+    }
+  }
+}
+
+static void ReverseRange(void *ctx, int begin, int end, int worker) {
+  BidirJob *job = ctx;
+  int tableSize = 1024;
+  RouteSlot *table = malloc(sizeof(RouteSlot) * (size_t)tableSize);
+  if (!table) {
+    job->lists[worker].failed = true;
+    return;
+  }
+  for (int i = begin; i < end; i += BIDIR_CHUNK)
+    ReverseChunk(job, i, i + BIDIR_CHUNK < end ? i + BIDIR_CHUNK : end, worker,
+                 table, tableSize);
+  free(table);
+}
+
+// Traces the reverse beam at angle; on the bracket's route, stores the
+// start's offset and the direction back along the passing segment.
+static bool ReverseOnRoute(const BidirJob *job, const BidirBracket *bracket,
+                           float angle, float *offset, Vector2 *back,
+                           int worker) {
+  BeamPath *path = &job->paths[worker * 2];
+  TraceReverse(job, angle, path, worker);
+  if (path->segmentCount <= bracket->segment ||
+      RouteHash(path->segments, bracket->segment) != bracket->route)
+    return false;
+  const BeamSegment *s = &path->segments[bracket->segment];
+  *offset = StartOffset(job->stage, s);
+  *back = (Vector2){s->start.x - s->end.x, s->start.y - s->end.y};
+  return !isnan(*offset);
+}
+
+static bool TraceAim(const BidirJob *job, float angle, BeamPath *path,
+                     int worker) {
+  TraceBeam(job->stage, job->stage->start, (Vector2){cosf(angle), sinf(angle)},
+            job->maxBounces, job->maxLength, path);
+  job->rays[worker]++;
+  return path->hitGoal;
+}
+
+// Bisects the bracket for the reverse beam through the start and joins it
+// with the forward beam fired back along it. Returns the forward angle, or
+// NAN when the route breaks inside the bracket or the forward beam misses.
+static float JoinBracket(const BidirJob *job, const BidirBracket *bracket,
+                         int worker) {
+  float a = ReverseAngle(job, bracket->sample - 1);
+  float b = ReverseAngle(job, bracket->sample);
+  float offsetA, offsetB;
+  Vector2 backA, backB;
+  if (!ReverseOnRoute(job, bracket, a, &offsetA, &backA, worker) ||
+      !ReverseOnRoute(job, bracket, b, &offsetB, &backB, worker))
+    return NAN;
+  for (;;) {
+    float mid = a + (b - a) * 0.5f;
+    if (mid == a || mid == b)
+      break;
+    float offset;
+    Vector2 back;
+    if (!ReverseOnRoute(job, bracket, mid, &offset, &back, worker))
+      return NAN;
+    if ((offset < 0.0f) == (offsetA < 0.0f)) {
+      a = mid;
+      offsetA = offset;
+      backA = back;
+    } else {
+      b = mid;
+      offsetB = offset;
+      backB = back;
+    }
+  }
+  Vector2 back = fabsf(offsetA) < fabsf(offsetB) ? backA : backB;
+  float angle = atan2f(back.y, back.x);
+  return TraceAim(job, angle, &job->paths[worker * 2], worker) ? angle : NAN;
+}
+
+static void JoinRange(void *ctx, int begin, int end, int worker) {
+  BidirJob *job = ctx;
+  for (int i = begin; i < end; i++)
+    job->solved[i] = JoinBracket(job, &job->brackets[i], worker);
+}
+
+// Traces angle into probe; true if it and every beam back to edge, whose
+// path is ref, take ref's route (BeamPathsClose).
+static bool SameAim(const BidirJob *job, float edge, const BeamPath *ref,
+                    float angle, BeamPath *probe) {
+  TraceAim(job, angle, probe, 0);
+  return BeamPathSignature(probe) == BeamPathSignature(ref) &&
+         BeamPathsClose(ref, probe, fabsf(angle - edge), job->drift);
+}
+
+// Walks from a goal-hitting angle towards side until the beam misses,
+// bisecting each change of path down to adjacent floats so the edge is
+// exact to float precision. A probe only extends the walk past the
+// previous edge while its path stays close to the edge's, so the beam
+// cannot sweep across something and back between two probes. Returns NAN
+// if the goal is hit all the way around.
+static float WindowEdge(const BidirJob *job, float angle, float side,
+                        int *bounces) {
+  BeamPath *ref = &job->paths[0];
+  BeamPath *probe = &job->paths[1];
+  float edge = angle;
+  TraceAim(job, edge, ref, 0);
+  for (;;) {
+    if (ref->segmentCount - 1 < *bounces)
+      *bounces = ref->segmentCount - 1;
+    float inside = edge;
+    float step = fmaxf(fabsf(edge), 1.0f) * 1e-7f * side;
+    float outside = edge + step;
+    while (SameAim(job, edge, ref, outside, probe)) {
+      inside = outside;
+      step *= 2.0f;
+      outside = edge + step;
+      if (fabsf(outside - angle) >= 2.0f * BEAM_PI)
+        return NAN;
+    }
+    for (;;) {
+      float mid = inside + (outside - inside) * 0.5f;
+      if (mid == inside || mid == outside)
+        break;
+      if (SameAim(job, edge, ref, mid, probe))
+        inside = mid;
+      else
+        outside = mid;
+    }
+    // The path changes or drifts between inside and outside; the window
+    // goes on if the beam at outside still reaches the goal.
+    if (!TraceAim(job, outside, probe, 0))
+      return inside;
+    edge = outside;
+    BeamPath *swap = ref;
+    ref = probe;
+    probe = swap;
+  }
+}
+
+// Widens a goal-hitting angle into its window.
+static BeamWindow GrowWindow(const BidirJob *job, float angle) {
+  BeamWindow window = {angle, angle, BEAM_MAX_BOUNCES};
+  window.start = WindowEdge(job, angle, -1.0f, &window.bounces);
+  window.end = WindowEdge(job, angle, 1.0f, &window.bounces);
+  if (isnan(window.start) || isnan(window.end))
+    return (BeamWindow){-BEAM_PI, BEAM_PI, window.bounces};
+  if (window.start < -BEAM_PI) {
+    window.start += 2.0f * BEAM_PI;
+    window.end += 2.0f * BEAM_PI;
+  }
+  return window;
+}
+
+static int CompareFloats(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+static bool PushWindow(BeamWindowList *out, BeamWindow window) {
+  if (out->count == out->capacity) {
+    int capacity = out->capacity ? out->capacity * 2 : 16;
+    BeamWindow *windows =
+        realloc(out->windows, sizeof(BeamWindow) * (size_t)capacity);
+    if (!windows)
+      return false;
+    out->windows = windows;
+    out->capacity = capacity;
+  }
+  out->windows[out->count++] = window;
+  return true;
+}
+
+static int CompareWindows(const void *a, const void *b) {
+  return CompareFloats(&((const BeamWindow *)a)->start,
+                       &((const BeamWindow *)b)->start);
+}
+
+static bool InsideWindow(const BeamWindow *w, float angle) {
+  return (angle >= w->start && angle <= w->end) ||
+         angle + 2.0f * BEAM_PI <= w->end;
+}
+
+// Joins every bracket with a forward beam and grows the goal-hitting angles
+// the forward pass has not found into windows. Returns false if out could
+// not hold them.
+static bool JoinBrackets(BidirJob *job, int workers, BeamPool *pool,
+                         BeamWindowList *out) {
+  int count = 0;
+  for (int w = 0; w < workers; w++)
+    count += job->lists[w].count;
+  job->brackets = malloc(sizeof(BidirBracket) * (size_t)(count ? count : 1));
+  job->solved = malloc(sizeof(float) * (size_t)(count ? count : 1));
+  if (!job->brackets || !job->solved)
+    return false;
+  count = 0;
+  for (int w = 0; w < workers; w++) {
+    memcpy(job->brackets + count, job->lists[w].items,
+           sizeof(BidirBracket) * (size_t)job->lists[w].count);
+    count += job->lists[w].count;
+  }
+  if (pool)
+    RunBeamPool(pool, count, 16, JoinRange, job);
+  else
+    JoinRange(job, 0, count, 0);
+
+  // Several brackets can land in one window; grow each window once.
+  int solved = 0;
+  for (int i = 0; i < count; i++)
+    if (!isnan(job->solved[i]))
+      job->solved[solved++] = job->solved[i];
+  qsort(job->solved, (size_t)solved, sizeof(float), CompareFloats);
+  for (int i = 0; i < solved; i++) {
+    float angle = job->solved[i];
+    bool known = false;
+    for (int k = 0; k < out->count && !known; k++)
+      known = InsideWindow(&out->windows[k], angle);
+    if (!known && !PushWindow(out, GrowWindow(job, angle)))
+      return false;
+  }
+  return true;
+}
+
+bool SolveStageBidirectional(const StageData *stage, int maxBounces,
+                             float maxLength, int forwardSamples,
+                             int reverseSamples, BeamPool *pool,
+                             BeamWindowList *out) {
+  if (!SolveStageAdaptive(stage, maxBounces, maxLength, forwardSamples, pool,
+                          out))
+    return false;
+  if (!stage->hasGoal || reverseSamples < 2)
+    return true;
+
+  int workers = pool ? GetBeamPoolThreads(pool) : 1;
+  BidirJob job = {stage,
+                  *stage,
+                  maxBounces,
+                  maxLength,
+                  reverseSamples,
+                  StageSolveDrift(stage),
+                  calloc((size_t)workers, sizeof(BracketList)),
+                  calloc((size_t)workers * 2, sizeof(BeamPath)),
+                  calloc((size_t)workers, sizeof(long long))};
+  job.reverse.hasGoal = false;
+  bool ok = job.lists && job.paths && job.rays;
+  if (ok) {
+    if (pool)
+      RunBeamPool(pool, reverseSamples, BIDIR_CHUNK, ReverseRange, &job);
+    else
+      ReverseRange(&job, 0, reverseSamples, 0);
+    for (int w = 0; w < workers; w++)
+      if (job.lists[w].failed)
+        ok = false;
+    ok = ok && JoinBrackets(&job, workers, pool, out);
+  }
+
+  for (int w = 0; w < workers; w++) {
+    if (job.rays)
+      out->rays += job.rays[w];
+    if (job.lists)
+      free(job.lists[w].items);
+    if (job.paths) {
+      UnloadBeamPath(&job.paths[w * 2]);
+      UnloadBeamPath(&job.paths[w * 2 + 1]);
+    }
+  }
+  free(job.lists);
+  free(job.paths);
+  free(job.rays);
+  free(job.brackets);
+  free(job.solved);
+  qsort(out->windows, (size_t)out->count, sizeof(BeamWindow), CompareWindows);
+  return ok;
+}
@@ -0,0 +1,369 @@
+#include "beamtrace.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+
+typedef struct BvhBuildPrim {
+  float minX, minY, maxX, maxY;
+  float cx, cy;
+  int id;
+} BvhBuildPrim;
+
+// Orders by centroid along one axis, ties by id, so splits are deterministic.
+static bool PrimBefore(const BvhBuildPrim *a, const BvhBuildPrim *b, int axis) {
+  float ka = axis == 0 ? a->cx : a->cy;
+  float kb = axis == 0 ? b->cx : b->cy;
+  if (ka != kb)
+    return ka < kb;
+  return a->id < b->id;
+}
+
+static void SwapPrims(BvhBuildPrim *a, BvhBuildPrim *b) {
+  BvhBuildPrim t = *a;
+  *a = *b;
+  *b = t;
+}
+
+// Partial quickselect: afterwards prims[begin..nth) all order before
+// prims[nth..end). Each build level is then linear instead of a full sort.
+static void SelectNth(BvhBuildPrim *prims, int begin, int end, int nth,
+                      int axis) {
+  while (end - begin > 1) {
+    int m = begin + (end - begin) / 2;
+    if (PrimBefore(&prims[m], &prims[begin], axis))
+      SwapPrims(&prims[m], &prims[begin]);
+    if (PrimBefore(&prims[end - 1], &prims[begin], axis))
+      SwapPrims(&prims[end - 1], &prims[begin]);
+    if (PrimBefore(&prims[end - 1], &prims[m], axis))
+      SwapPrims(&prims[end - 1], &prims[m]);
+    BvhBuildPrim pivot = prims[m];
+    int i = begin, j = end - 1;
+    while (i <= j) {
+      while (PrimBefore(&prims[i], &pivot, axis))
+        i++;
+      while (PrimBefore(&pivot, &prims[j], axis))
+        j--;
+      if (i <= j) {
+        SwapPrims(&prims[i], &prims[j]);
+        i++;
+        j--;
+      }
+    }
+    if (nth <= j)
+      end = j + 1;
+    else if (nth >= i)
+      begin = i;
+    else
+      return;
+  }
+}
+
+static void BuildNode(StageBvh *bvh, BvhBuildPrim *prims, int nodeIndex,
+                      int begin, int end) {
+  StageBvhNode *node = &bvh->nodes[nodeIndex];
+  float cMinX = INFINITY, cMinY = INFINITY;
+  float cMaxX = -INFINITY, cMaxY = -INFINITY;
+  float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+  for (int i = begin; i < end; i++) {
+    const BvhBuildPrim *p = &prims[i];
+    minX = p->minX < minX ? p->minX : minX;
+    minY = p->minY < minY ? p->minY : minY;
+    maxX = p->maxX > maxX ? p->maxX : maxX;
+    maxY = p->maxY > maxY ? p->maxY : maxY;
+    cMinX = p->cx < cMinX ? p->cx : cMinX;
+    cMinY = p->cy < cMinY ? p->cy : cMinY;
+    cMaxX = p->cx > cMaxX ? p->cx : cMaxX;
+    cMaxY = p->cy > cMaxY ? p->cy : cMaxY;
+  }
+  node->minX = minX;
+  node->minY = minY;
+  node->maxX = maxX;
+  node->maxY = maxY;
+
+  if (end - begin <= BVH_LEAF_SIZE) {
+    node->first = begin;
+    node->count = end - begin;
+    return;
+  }
+
+  int mid = begin + (end - begin) / 2;
+  SelectNth(prims, begin, end, mid, cMaxX - cMinX >= cMaxY - cMinY ? 0 : 1);
+  int left = bvh->nodeCount;
+  bvh->nodeCount += 2;
+  node->first = left;
+  node->count = 0;
+  BuildNode(bvh, prims, left, begin, mid);
+  BuildNode(bvh, prims, left + 1, mid, end);
+}
+
+void UnloadStageBvh(StageData *stage) {
+  free(stage->bvh.nodes);
+  free(stage->bvh.prims);
+  stage->bvh = (StageBvh){0};
+}
+
+void BuildStageBvh(StageData *stage) {
+  UnloadStageBvh(stage);
+  int count = stage->rectCount + stage->circleCount;
+  if (count == 0)
+    return;
+
+  BvhBuildPrim *prims = malloc(sizeof(BvhBuildPrim) * (size_t)count);
+  StageBvh bvh = {0};
+  bvh.nodes = malloc(sizeof(StageBvhNode) * (size_t)count * 2);
+  bvh.prims = malloc(sizeof(int) * (size_t)count);
+  if (!prims || !bvh.nodes || !bvh.prims) {
+    free(prims);
+    free(bvh.nodes);
+    free(bvh.prims);
+    return;
+  }
+
+  for (int i = 0; i < stage->rectCount; i++) {
+    Rectangle r = stage->rects[i];
+    prims[i] = (BvhBuildPrim){r.x, r.y, r.x + r.width, r.y + r.height,
+                              r.x + r.width * 0.5f, r.y + r.height * 0.5f, i};
+  }
+  for (int i = 0; i < stage->circleCount; i++) {
+    Vector2 c = stage->circlePos[i];
+    // Pad circle boxes so grazing hits accepted by RayIntersectCircle's
+    // rounding are never culled by the box test.
+    float r = stage->circleRadius[i] * 1.001f + 1.0f;
+    prims[stage->rectCount + i] = (BvhBuildPrim){
+        c.x - r, c.y - r, c.x + r, c.y + r, c.x, c.y, stage->rectCount + i};
+  }
+
+  bvh.nodeCount = 1;
+  BuildNode(&bvh, prims, 0, 0, count);
+  for (int i = 0; i < count; i++)
+    bvh.prims[i] = prims[i].id;
+  bvh.primCount = count;
+  free(prims);
+  stage->bvh = bvh;
+}
+
+// Slab test that is never stricter than RayIntersectRect/RayIntersectCircle.
+// Near-parallel axes follow RayIntersectRect's rule of ignoring that slab, with
+// the box widened by how far the ray can drift sideways within limit.
+static bool RayNodeEntry(Vector2 pos, Vector2 dir, const StageBvhNode *node,
+                         float limit, float *tEntry) {
+  float tmin = 0.0f;
+  float tmax = INFINITY;
+
+  if (fabsf(dir.x) < 0.0001f) {
+    float drift = 0.0001f * limit;
+    if (pos.x < node->minX - drift || pos.x > node->maxX + drift)
+      return false;
+  } else {
+    float tx1 = (node->minX - pos.x) / dir.x;
+    float tx2 = (node->maxX - pos.x) / dir.x;
+    tmin = fmaxf(tmin, fminf(tx1, tx2));
+    tmax = fminf(tmax, fmaxf(tx1, tx2));
+  }
+
+  if (fabsf(dir.y) < 0.0001f) {
+    float drift = 0.0001f * limit;
+    if (pos.y < node->minY - drift || pos.y > node->maxY + drift)
+      return false;
+  } else {
+    float ty1 = (node->minY - pos.y) / dir.y;
+    float ty2 = (node->maxY - pos.y) / dir.y;
+    tmin = fmaxf(tmin, fminf(ty1, ty2));
+    tmax = fminf(tmax, fmaxf(ty1, ty2));
+  }
+
+  if (tmax < tmin || tmin > limit)
+    return false;
+  *tEntry = tmin;
+  return true;
+}
+
+void StageBvhClosestHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                        BeamHit *hit) {
+  const StageBvh *bvh = &stage->bvh;
+  // Scan-order rank of the current best: ties only go to lower ranks, and the
+  // initial limit (rank -2) or a wall (rank -1) is never displaced by a tie.
+  int bestRank = hit->kind == BEAM_HIT_WALL ? -1 : -2;
+  long long nodeTests = 1;
+  long long obstacleTests = 0;
+
+  struct {
+    int node;
+    float t;
+  } stack[BVH_STACK_SIZE];
+  int top = 0;
+  float entry = 0.0f;
+  if (!RayNodeEntry(pos, dir, &bvh->nodes[0], hit->t, &entry)) {
+    if (stage->stats)
+      stage->stats->nodeTests++;
+    return;
+  }
+  stack[top].node = 0;
+  stack[top].t = entry;
+  top++;
+
+  while (top > 0) {
+    top--;
+    if (stack[top].t > hit->t)
+      continue;
+    const StageBvhNode *node = &bvh->nodes[stack[top].node];
+
+    if (node->count > 0) {
+      obstacleTests += node->count;
+      for (int i = node->first; i < node->first + node->count; i++) {
+        int id = bvh->prims[i];
+        float t = 0.0f;
+        Vector2 n = {0.0f, 0.0f};
+        bool found;
+        if (id < stage->rectCount) {
+          found = RayIntersectRect(pos, dir, stage->rects[id], &t, &n);
+        } else {
+          int c = id - stage->rectCount;
+          found = RayIntersectCircle(pos, dir, stage->circlePos[c],
+                                     stage->circleRadius[c], &t, &n);
+        }
+        if (!found || !(t < hit->t || (t == hit->t && id < bestRank)))
+          continue;
+        hit->t = t;
+        hit->normal = n;
+        hit->kind = id < stage->rectCount ? BEAM_HIT_RECT : BEAM_HIT_CIRCLE;
+        hit->index = id < stage->rectCount ? id : id - stage->rectCount;
+        bestRank = id;
+      }
+      continue;
+    }
+
+    float tLeft = 0.0f;
+    float tRight = 0.0f;
+    nodeTests += 2;
+    bool hitLeft = RayNodeEntry(pos, dir, &bvh->nodes[node->first], hit->t,
+                                &tLeft);
+    bool hitRight = RayNodeEntry(pos, dir, &bvh->nodes[node->first + 1],
+                                 hit->t, &tRight);
+    if (hitLeft && hitRight) {
+      // Push the far child first so the near one is visited first.
+      bool leftFirst = tLeft <= tRight;
+      stack[top].node = leftFirst ? node->first + 1 : node->first;
+      stack[top].t = leftFirst ? tRight : tLeft;
+      top++;
+      stack[top].node = leftFirst ? node->first : node->first + 1;
+      stack[top].t = leftFirst ? tLeft : tRight;
+      top++;
+    } else if (hitLeft || hitRight) {
+      stack[top].node = hitLeft ? node->first : node->first + 1;
+      stack[top].t = hitLeft ? tLeft : tRight;
+      top++;
+    }
+  }
+  if (stage->stats) {
+    stage->stats->nodeTests += nodeTests;
+    stage->stats->obstacleTests += obstacleTests;
+  }
+}
+
+bool StageBvhCloserHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                       const BeamHit *hit, int rank) {
+  const StageBvh *bvh = &stage->bvh;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  float entry = 0.0f;
+  if (!RayNodeEntry(pos, dir, &bvh->nodes[0], hit->t, &entry))
+    return false;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const StageBvhNode *node = &bvh->nodes[stack[--top]];
+    if (node->count > 0) {
+      for (int i = node->first; i < node->first + node->count; i++) {
+        int id = bvh->prims[i];
+        float t = 0.0f;
+        bool found;
+        if (id < stage->rectCount) {
+          found = RayIntersectRect(pos, dir, stage->rects[id], &t, NULL);
+        } else {
+          int c = id - stage->rectCount;
+          found = RayIntersectCircle(pos, dir, stage->circlePos[c],
+                                     stage->circleRadius[c], &t, NULL);
+        }
+        if (found && (t < hit->t || (t == hit->t && id < rank)))
+          return true;
+      }
+      continue;
+    }
+    for (int child = node->first; child < node->first + 2; child++)
+      if (RayNodeEntry(pos, dir, &bvh->nodes[child], hit->t, &entry))
+        stack[top++] = child;
+  }
+  return false;
+}
+
+// Whether segment a-b touches the box grown by margin on every side.
+static bool SegmentTouchesBox(Vector2 a, Vector2 b, float minX, float minY,
+                              float maxX, float maxY, float margin) {
+  float tmin = 0.0f;
+  float tmax = 1.0f;
+  float d[2] = {b.x - a.x, b.y - a.y};
+  float p[2] = {a.x, a.y};
+  float lo[2] = {minX - margin, minY - margin};
+  float hi[2] = {maxX + margin, maxY + margin};
+  for (int axis = 0; axis < 2; axis++) {
+    if (fabsf(d[axis]) < 1e-6f) {
+      if (p[axis] < lo[axis] || p[axis] > hi[axis])
+        return false;
+      continue;
+    }
+    float t1 = (lo[axis] - p[axis]) / d[axis];
+    float t2 = (hi[axis] - p[axis]) / d[axis];
+    tmin = fmaxf(tmin, fminf(t1, t2));
+    tmax = fminf(tmax, fmaxf(t1, t2));
+  }
+  return tmin <= tmax;
+}
+
+int StageBvhSegmentQuery(const StageData *stage, Vector2 a, Vector2 b,
+                         float margin, int *ids, int capacity) {
+  const StageBvh *bvh = &stage->bvh;
+  int found = 0;
+  if (bvh->nodeCount == 0)
+    return 0;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const StageBvhNode *node = &bvh->nodes[stack[--top]];
+    if (!SegmentTouchesBox(a, b, node->minX, node->minY, node->maxX,
+                           node->maxY, margin))
+      continue;
+    if (node->count == 0) {
+      stack[top++] = node->first;
+      stack[top++] = node->first + 1;
+      continue;
+    }
+    for (int i = node->first; i < node->first + node->count; i++) {
+      int id = bvh->prims[i];
+      float minX, minY, maxX, maxY;
+      if (id < stage->rectCount) {
+        Rectangle r = stage->rects[id];
+        minX = r.x;
+        minY = r.y;
+        maxX = r.x + r.width;
+        maxY = r.y + r.height;
+      } else {
+        int c = id - stage->rectCount;
+        float r = stage->circleRadius[c] * 1.001f + 1.0f;
+        minX = stage->circlePos[c].x - r;
+        minY = stage->circlePos[c].y - r;
+        maxX = stage->circlePos[c].x + r;
+        maxY = stage->circlePos[c].y + r;
+      }
+      if (!SegmentTouchesBox(a, b, minX, minY, maxX, maxY, margin))
+        continue;
+      if (found == capacity)
+        return capacity + 1;
+      ids[found++] = id;
+    }
+  }
+  return found;
+}
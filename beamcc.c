@@ -0,0 +1,108 @@
+#include "beamtrace.h"
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-S] [-o prefix] stage.json...\n"
+          "Generates <prefix>.c with the stage's closest-obstacle search "
+          "unrolled over\n"
+          "constant coordinates and builds it into <prefix>.so, which solve "
+          "-a plugin\n"
+          "loads. prefix defaults to the stage path; -o only works with one "
+          "stage.\n"
+          "  -S  write the source only\n"
+          "The compiler is $CC, or cc.\n",
+          argv0);
+}
+
+// Runs the compiler directly rather than through a shell, so paths need no
+// quoting.
+static bool BuildPlugin(const char *source, const char *plugin) {
+  const char *cc = getenv("CC");
+  char *args[] = {(char *)(cc && cc[0] ? cc : "cc"),
+                  "-O2",
+                  "-fPIC",
+                  "-shared",
+                  "-ffp-contract=off",
+                  "-o",
+                  (char *)plugin,
+                  (char *)source,
+                  NULL};
+  pid_t pid;
+  int status = 0;
+  if (posix_spawnp(&pid, args[0], NULL, NULL, args, environ) != 0)
+    return false;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+  bool sourceOnly = false;
+  const char *prefix = NULL;
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    const char *arg = argv[argi];
+    if (strcmp(arg, "-h") == 0) {
+      Usage(argv[0]);
+      return 0;
+    }
+    if (strcmp(arg, "-S") == 0) {
+      sourceOnly = true;
+    } else if (strcmp(arg, "-o") == 0 && argi + 1 < argc) {
+      prefix = argv[++argi];
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argi >= argc || (prefix && argc - argi > 1)) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  int status = 0;
+  StageData stage = {0};
+  for (; argi < argc; argi++) {
+    const char *path = argv[argi];
+    if (!LoadStage(path, &stage)) {
+      fprintf(stderr, "%s: failed to load stage\n", path);
+      status = 2;
+      continue;
+    }
+    const char *base = prefix ? prefix : path;
+    size_t length = strlen(base) + 4;
+    char *source = malloc(length);
+    char *plugin = malloc(length);
+    if (!source || !plugin) {
+      fprintf(stderr, "out of memory\n");
+      free(source);
+      free(plugin);
+      status = 2;
+      break;
+    }
+    snprintf(source, length, "%s.c", base);
+    snprintf(plugin, length, "%s.so", base);
+    if (!ExportStageSource(&stage, source)) {
+      fprintf(stderr, "%s: failed to write %s\n", path, source);
+      status = 2;
+    } else if (sourceOnly) {
+      printf("%s: wrote %s\n", path, source);
+    } else if (!BuildPlugin(source, plugin)) {
+      fprintf(stderr, "%s: failed to build %s\n", path, plugin);
+      status = 2;
+    } else {
+      printf("%s: built %s (%d rects, %d circles)\n", path, plugin,
+             stage.rectCount, stage.circleCount);
+    }
+    free(source);
+    free(plugin);
+  }
+  UnloadStage(&stage);
+  return status;
+}
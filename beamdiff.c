@@ -0,0 +1,812 @@
+#include "beamtrace.h"
+#include "cJSON.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIFF_GROUP BEAM_PACKET_MAX // rays fired together from one origin
+#define CHECK_SWEEP_RAYS 1000000    // solve's default sweep
+#define CHECK_SOLVE_SAMPLES 4096    // solve -m adaptive's default
+#define CHECK_REVERSE_SAMPLES 65536 // solve -m bidir's default
+// How far outside a solver window a swept goal ray may lie: edges are exact
+// to float precision, so only rounding at the edge is forgiven.
+#define CHECK_TOLERANCE 1e-6f
+
+typedef enum DiffVariant {
+  VARIANT_BVH,
+  VARIANT_GRID,
+  VARIANT_SIMD,
+  VARIANT_PACKET,
+  VARIANT_RETRACE,
+  VARIANT_COUNT,
+} DiffVariant;
+
+static const char *variantNames[] = {"bvh", "grid", "simd", "packet",
+                                     "retrace"};
+static const char *kernelNames[] = {"scalar", "sse2", "avx2"};
+
+// A stage as plain lists, so obstacles can be dropped while shrinking.
+typedef struct StageSpec {
+  Rectangle *rects;
+  int rectCount;
+  Vector2 *circlePos;
+  float *circleRadius;
+  int circleCount;
+  bool hasGoal;
+  Vector2 goalPos;
+  float goalRadius;
+  int maxBounces;
+  bool stopLoops;
+} StageSpec;
+
+// One group of rays and the variant that disagreed with the reference on
+// dirs[lane]. Packet and retrace results depend on the whole group.
+typedef struct DiffCase {
+  DiffVariant variant;
+  Vector2 origin;
+  Vector2 dirs[DIFF_GROUP];
+  int count;
+  int lane;
+} DiffCase;
+
+typedef struct DiffOptions {
+  int stages;
+  int groups; // ray groups per stage
+  int ulps;
+  unsigned int seed;
+  int threads;
+  const char *outDir;
+} DiffOptions;
+
+typedef struct DiffJob {
+  const DiffOptions *options;
+  unsigned int variants; // bit per DiffVariant
+  BeamKernel kernel;
+  StageData *stages; // one per pool worker
+  BeamPath *paths;   // DIFF_GROUP * 2 per pool worker
+  BeamRetrace *retraces;
+  char **reports; // per stage, NULL when everything agreed
+  long long *rays;
+} DiffJob;
+
+static unsigned int NextRandom(unsigned int *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static float RandomFloat(unsigned int *state, float lo, float hi) {
+  return lo + (hi - lo) * (float)(NextRandom(state) >> 8) / 16777216.0f;
+}
+
+static int RandomInt(unsigned int *state, int n) {
+  return (int)(NextRandom(state) % (unsigned int)n);
+}
+
+static void UnloadStageSpec(StageSpec *spec) {
+  free(spec->rects);
+  free(spec->circlePos);
+  free(spec->circleRadius);
+  *spec = (StageSpec){0};
+}
+
+static bool AllocStageSpec(StageSpec *spec, int rects, int circles) {
+  spec->rects = malloc(sizeof(Rectangle) * (size_t)(rects + 1));
+  spec->circlePos = malloc(sizeof(Vector2) * (size_t)(circles + 1));
+  spec->circleRadius = malloc(sizeof(float) * (size_t)(circles + 1));
+  return spec->rects && spec->circlePos && spec->circleRadius;
+}
+
+// Random stages lean on the cases accelerated paths get wrong: coordinates
+// snapped to a coarse lattice so edges line up and t values tie, duplicated
+// obstacles, slivers, overlaps and rays fired along the axes.
+static bool RandomStageSpec(unsigned int *state, const Rectangle field,
+                            StageSpec *spec) {
+  int rects = RandomInt(state, 48);
+  int circles = RandomInt(state, 48);
+  if (!AllocStageSpec(spec, rects, circles))
+    return false;
+  bool snap = RandomInt(state, 2) == 0;
+  float lattice = snap ? (float)(10 << RandomInt(state, 4)) : 0.0f;
+  for (int i = 0; i < rects; i++) {
+    Rectangle r;
+    if (i > 0 && RandomInt(state, 8) == 0) {
+      r = spec->rects[RandomInt(state, i)];
+    } else {
+      r = (Rectangle){RandomFloat(state, field.x, field.x + field.width),
+                      RandomFloat(state, field.y, field.y + field.height),
+                      RandomFloat(state, 0.5f, 300.0f),
+                      RandomFloat(state, 0.5f, 300.0f)};
+      if (RandomInt(state, 6) == 0)
+        r.width = RandomFloat(state, 0.0f, 2.0f);
+      if (snap) {
+        r.x = roundf(r.x / lattice) * lattice;
+        r.y = roundf(r.y / lattice) * lattice;
+        r.width = fmaxf(roundf(r.width / lattice), 1.0f) * lattice;
+        r.height = fmaxf(roundf(r.height / lattice), 1.0f) * lattice;
+      }
+    }
+    spec->rects[spec->rectCount++] = r;
+  }
+  for (int i = 0; i < circles; i++) {
+    Vector2 p;
+    float radius;
+    if (i > 0 && RandomInt(state, 8) == 0) {
+      int j = RandomInt(state, i);
+      p = spec->circlePos[j];
+      radius = spec->circleRadius[j];
+    } else {
+      p = (Vector2){RandomFloat(state, field.x, field.x + field.width),
+                    RandomFloat(state, field.y, field.y + field.height)};
+      radius = RandomFloat(state, 1.0f, 120.0f);
+      if (snap) {
+        p.x = roundf(p.x / lattice) * lattice;
+        p.y = roundf(p.y / lattice) * lattice;
+        radius = fmaxf(roundf(radius / lattice), 1.0f) * lattice * 0.5f;
+      }
+    }
+    spec->circlePos[spec->circleCount] = p;
+    spec->circleRadius[spec->circleCount] = radius;
+    spec->circleCount++;
+  }
+  spec->hasGoal = RandomInt(state, 4) != 0;
+  spec->goalPos =
+      (Vector2){RandomFloat(state, field.x, field.x + field.width),
+                RandomFloat(state, field.y, field.y + field.height)};
+  spec->goalRadius = RandomFloat(state, 5.0f, 60.0f);
+  spec->maxBounces = RandomInt(state, 8) == 0 ? 2000 : RandomInt(state, 40);
+  spec->stopLoops = RandomInt(state, 2) == 0;
+  return true;
+}
+
+static bool BuildStageFromSpec(const StageSpec *spec, StageData *stage) {
+  ResetStage(stage);
+  if (!ReserveStageObstacles(stage, spec->rectCount, spec->circleCount))
+    return false;
+  memcpy(stage->rects, spec->rects,
+         sizeof(Rectangle) * (size_t)spec->rectCount);
+  memcpy(stage->circlePos, spec->circlePos,
+         sizeof(Vector2) * (size_t)spec->circleCount);
+  memcpy(stage->circleRadius, spec->circleRadius,
+         sizeof(float) * (size_t)spec->circleCount);
+  stage->rectCount = spec->rectCount;
+  stage->circleCount = spec->circleCount;
+  stage->hasGoal = spec->hasGoal;
+  stage->goalPos = spec->goalPos;
+  stage->goalRadius = spec->goalRadius;
+  stage->maxBounces = spec->maxBounces;
+  stage->stopLoops = spec->stopLoops;
+  PrepareStage(stage);
+  return true;
+}
+
+static void RandomGroup(unsigned int *state, const StageData *stage,
+                        DiffCase *c) {
+  const Rectangle f = stage->field;
+  c->origin = RandomInt(state, 4) == 0
+                  ? stage->start
+                  : (Vector2){RandomFloat(state, f.x, f.x + f.width),
+                              RandomFloat(state, f.y, f.y + f.height)};
+  c->count = DIFF_GROUP;
+  // Half the groups sweep a narrow fan, the way packets and retraces are
+  // used; the rest scatter, with the odd exact axis or diagonal direction.
+  bool fan = RandomInt(state, 2) == 0;
+  float base = RandomFloat(state, -BEAM_PI, BEAM_PI);
+  float spread = fan ? RandomFloat(state, 1e-6f, 0.05f) : 0.0f;
+  for (int i = 0; i < c->count; i++) {
+    if (!fan && RandomInt(state, 6) == 0) {
+      static const Vector2 exact[] = {{1, 0}, {0, 1},  {-1, 0},  {0, -1},
+                                      {1, 1}, {-1, 1}, {-1, -1}, {1, -1}};
+      c->dirs[i] = exact[RandomInt(state, 8)];
+      continue;
+    }
+    float angle = fan ? base + spread * (float)i
+                      : RandomFloat(state, -BEAM_PI, BEAM_PI);
+    c->dirs[i] = (Vector2){cosf(angle), sinf(angle)};
+  }
+}
+
+static int UlpDistance(float a, float b) {
+  if (a == b)
+    return 0;
+  if (isnan(a) || isnan(b))
+    return isnan(a) && isnan(b) ? 0 : 1 << 30;
+  int ia, ib;
+  memcpy(&ia, &a, sizeof(ia));
+  memcpy(&ib, &b, sizeof(ib));
+  // Map the sign-magnitude encoding onto a monotonic integer line.
+  if (ia < 0)
+    ia = (int)(0x80000000u - (unsigned int)ia);
+  if (ib < 0)
+    ib = (int)(0x80000000u - (unsigned int)ib);
+  long long d = (long long)ia - (long long)ib;
+  d = d < 0 ? -d : d;
+  return d > (1 << 30) ? 1 << 30 : (int)d;
+}
+
+static bool CloseVec(Vector2 a, Vector2 b, int ulps) {
+  return UlpDistance(a.x, b.x) <= ulps && UlpDistance(a.y, b.y) <= ulps;
+}
+
+// Describes the first difference between the paths into what, if any.
+static bool PathsAgree(const BeamPath *ref, const BeamPath *got, int ulps,
+                       char *what, size_t size) {
+  if (ref->hitGoal != got->hitGoal || ref->end != got->end) {
+    snprintf(what, size, "outcome: goal %d end %d vs goal %d end %d",
+             ref->hitGoal, ref->end, got->hitGoal, got->end);
+    return false;
+  }
+  int n = ref->segmentCount < got->segmentCount ? ref->segmentCount
+                                                : got->segmentCount;
+  for (int i = 0; i < n; i++) {
+    const BeamSegment *a = &ref->segments[i];
+    const BeamSegment *b = &got->segments[i];
+    if (a->hitKind != b->hitKind || a->hitIndex != b->hitIndex) {
+      snprintf(what, size, "segment %d hits kind %d #%d vs kind %d #%d", i,
+               a->hitKind, a->hitIndex, b->hitKind, b->hitIndex);
+      return false;
+    }
+    if (!CloseVec(a->start, b->start, ulps) ||
+        !CloseVec(a->end, b->end, ulps) ||
+        !CloseVec(a->normal, b->normal, ulps) ||
+        UlpDistance(a->endDist, b->endDist) > ulps) {
+      snprintf(what, size,
+               "segment %d ends at (%.9g, %.9g) t %.9g vs (%.9g, %.9g) t %.9g",
+               i, a->end.x, a->end.y, a->endDist, b->end.x, b->end.y,
+               b->endDist);
+      return false;
+    }
+  }
+  if (ref->segmentCount != got->segmentCount) {
+    snprintf(what, size, "%d segments vs %d", ref->segmentCount,
+             got->segmentCount);
+    return false;
+  }
+  return true;
+}
+
+static void TraceReference(StageData *stage, const DiffCase *c,
+                           BeamPath *ref) {
+  stage->accel = STAGE_ACCEL_BRUTE;
+  for (int l = 0; l < c->count; l++)
+    TraceBeam(stage, c->origin, c->dirs[l], stage->maxBounces,
+              BEAM_DEFAULT_LENGTH, &ref[l]);
+}
+
+// Runs the variant over the group into got and returns the first lane that
+// differs from the reference paths, or -1.
+static int RunVariant(StageData *stage, DiffVariant variant, const DiffCase *c,
+                      int ulps, const BeamPath *ref, BeamPath *got,
+                      BeamRetrace *retrace, char *what, size_t size) {
+  int maxBounces = stage->maxBounces;
+  float maxLength = BEAM_DEFAULT_LENGTH;
+  switch (variant) {
+  case VARIANT_PACKET:
+    stage->accel = STAGE_ACCEL_BVH;
+    TraceBeamPacket(stage, c->origin, c->dirs, c->count, maxBounces,
+                    maxLength, got);
+    break;
+  case VARIANT_RETRACE:
+    stage->accel = STAGE_ACCEL_BVH;
+    ResetBeamRetrace(retrace);
+    for (int l = 0; l < c->count; l++)
+      RetraceBeam(stage, c->origin, c->dirs[l], maxBounces, maxLength, retrace,
+                  &got[l]);
+    break;
+  default:
+    stage->accel = variant == VARIANT_BVH    ? STAGE_ACCEL_BVH
+                   : variant == VARIANT_GRID ? STAGE_ACCEL_GRID
+                                             : STAGE_ACCEL_SIMD;
+    for (int l = 0; l < c->count; l++)
+      TraceBeam(stage, c->origin, c->dirs[l], maxBounces, maxLength, &got[l]);
+    break;
+  }
+  for (int l = 0; l < c->count; l++)
+    if (!PathsAgree(&ref[l], &got[l], ulps, what, size))
+      return l;
+  return -1;
+}
+
+static bool CaseFails(const StageSpec *spec, const DiffCase *c, int ulps,
+                      StageData *stage, BeamPath *ref, BeamPath *got,
+                      BeamRetrace *retrace) {
+  char what[160];
+  if (!BuildStageFromSpec(spec, stage))
+    return false;
+  TraceReference(stage, c, ref);
+  return RunVariant(stage, c->variant, c, ulps, ref, got, retrace, what,
+                    sizeof(what)) >= 0;
+}
+
+// Drops chunks of obstacles, halving the chunk size down to one, as long as
+// the case keeps failing; then the goal, the ray group and the bounce
+// budget.
+static void ShrinkCase(StageSpec *spec, DiffCase *c, int ulps,
+                       StageData *stage, BeamPath *ref, BeamPath *got,
+                       BeamRetrace *retrace) {
+  for (int pass = 0; pass < 2; pass++) {
+    for (int chunk = spec->rectCount + spec->circleCount; chunk >= 1;
+         chunk /= 2) {
+      for (int start = 0; start < spec->rectCount + spec->circleCount;) {
+        // Rects come first in the combined numbering, circles after.
+        int end = start + chunk;
+        int rectEnd = end < spec->rectCount ? end : spec->rectCount;
+        int rectDrop = start < spec->rectCount ? rectEnd - start : 0;
+        int circleStart =
+            start > spec->rectCount ? start - spec->rectCount : 0;
+        int circleEnd = end > spec->rectCount ? end - spec->rectCount : 0;
+        if (circleEnd > spec->circleCount)
+          circleEnd = spec->circleCount;
+        int circleDrop = circleEnd > circleStart ? circleEnd - circleStart : 0;
+
+        StageSpec copy = {0};
+        if (!AllocStageSpec(&copy, spec->rectCount, spec->circleCount)) {
+          UnloadStageSpec(&copy);
+          return;
+        }
+        copy.hasGoal = spec->hasGoal;
+        copy.goalPos = spec->goalPos;
+        copy.goalRadius = spec->goalRadius;
+        copy.maxBounces = spec->maxBounces;
+        copy.stopLoops = spec->stopLoops;
+        for (int i = 0; i < spec->rectCount; i++)
+          if (rectDrop == 0 || i < start || i >= rectEnd)
+            copy.rects[copy.rectCount++] = spec->rects[i];
+        for (int i = 0; i < spec->circleCount; i++)
+          if (circleDrop == 0 || i < circleStart || i >= circleEnd) {
+            copy.circlePos[copy.circleCount] = spec->circlePos[i];
+            copy.circleRadius[copy.circleCount] = spec->circleRadius[i];
+            copy.circleCount++;
+          }
+        if (rectDrop + circleDrop > 0 &&
+            CaseFails(&copy, c, ulps, stage, ref, got, retrace)) {
+          UnloadStageSpec(spec);
+          *spec = copy;
+        } else {
+          UnloadStageSpec(&copy);
+          start += chunk;
+        }
+      }
+    }
+  }
+
+  StageSpec noGoal = *spec;
+  noGoal.hasGoal = false;
+  if (spec->hasGoal && CaseFails(&noGoal, c, ulps, stage, ref, got, retrace))
+    spec->hasGoal = false;
+
+  DiffCase single = *c;
+  single.dirs[0] = c->dirs[c->lane];
+  single.count = 1;
+  single.lane = 0;
+  if (c->count > 1 && CaseFails(spec, &single, ulps, stage, ref, got, retrace))
+    *c = single;
+
+  // Halve the budget while that still fails, then step it down one by one.
+  for (int step = (spec->maxBounces + 1) / 2; step >= 1;) {
+    StageSpec fewer = *spec;
+    fewer.maxBounces = spec->maxBounces - step;
+    if (fewer.maxBounces >= 0 &&
+        CaseFails(&fewer, c, ulps, stage, ref, got, retrace))
+      spec->maxBounces = fewer.maxBounces;
+    else
+      step = step > 1 ? 1 : 0;
+    if (step > 1)
+      step = (spec->maxBounces + 1) / 2;
+  }
+}
+
+static cJSON *CaseToJson(const StageSpec *spec, const DiffCase *c,
+                         BeamKernel kernel, const char *what) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddNumberToObject(root, "maxBounces", spec->maxBounces);
+  cJSON *rects = cJSON_AddArrayToObject(root, "rects");
+  for (int i = 0; i < spec->rectCount; i++) {
+    cJSON *r = cJSON_CreateObject();
+    cJSON_AddNumberToObject(r, "x", spec->rects[i].x);
+    cJSON_AddNumberToObject(r, "y", spec->rects[i].y);
+    cJSON_AddNumberToObject(r, "w", spec->rects[i].width);
+    cJSON_AddNumberToObject(r, "h", spec->rects[i].height);
+    cJSON_AddItemToArray(rects, r);
+  }
+  cJSON *circles = cJSON_AddArrayToObject(root, "circles");
+  for (int i = 0; i < spec->circleCount; i++) {
+    cJSON *o = cJSON_CreateObject();
+    cJSON_AddNumberToObject(o, "x", spec->circlePos[i].x);
+    cJSON_AddNumberToObject(o, "y", spec->circlePos[i].y);
+    cJSON_AddNumberToObject(o, "r", spec->circleRadius[i]);
+    cJSON_AddItemToArray(circles, o);
+  }
+  if (spec->hasGoal) {
+    cJSON *goal = cJSON_AddObjectToObject(root, "goal");
+    cJSON_AddNumberToObject(goal, "x", spec->goalPos.x);
+    cJSON_AddNumberToObject(goal, "y", spec->goalPos.y);
+    cJSON_AddNumberToObject(goal, "r", spec->goalRadius);
+  }
+  // Not part of the stage format; LoadStage ignores it.
+  cJSON *ray = cJSON_AddObjectToObject(root, "diff");
+  cJSON_AddStringToObject(ray, "variant", variantNames[c->variant]);
+  cJSON_AddStringToObject(ray, "kernel", kernelNames[kernel]);
+  cJSON_AddStringToObject(ray, "difference", what);
+  cJSON_AddBoolToObject(ray, "stopLoops", spec->stopLoops);
+  cJSON_AddNumberToObject(ray, "originX", c->origin.x);
+  cJSON_AddNumberToObject(ray, "originY", c->origin.y);
+  cJSON *dirs = cJSON_AddArrayToObject(ray, "dirs");
+  for (int i = 0; i < c->count; i++) {
+    float xy[2] = {c->dirs[i].x, c->dirs[i].y};
+    cJSON_AddItemToArray(dirs, cJSON_CreateFloatArray(xy, 2));
+  }
+  cJSON_AddNumberToObject(ray, "lane", c->lane);
+  return root;
+}
+
+static char *ReportCase(const DiffOptions *options, int index,
+                        const StageSpec *spec, const DiffCase *c,
+                        BeamKernel kernel, const char *first,
+                        const char *what) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/beamdiff-%08x-%d.json", options->outDir,
+           options->seed, index);
+  cJSON *json = CaseToJson(spec, c, kernel, what);
+  char *text = json ? cJSON_Print(json) : NULL;
+  FILE *file = text ? fopen(path, "w") : NULL;
+  bool written = file && fputs(text, file) >= 0 && fputc('\n', file) >= 0;
+  if (file && fclose(file) != 0)
+    written = false;
+  free(text);
+  cJSON_Delete(json);
+
+  size_t size = 1024;
+  char *report = malloc(size);
+  if (report)
+    snprintf(report, size,
+             "stage %d: %s (%s kernel) differs from brute: %s\n"
+             "  shrunk to %d rects, %d circles, %d ray%s, maxBounces %d%s: "
+             "%s\n"
+             "  %s %s\n",
+             index, variantNames[c->variant], kernelNames[kernel], first,
+             spec->rectCount, spec->circleCount, c->count,
+             c->count == 1 ? "" : "s", spec->maxBounces,
+             spec->stopLoops ? " (stopLoops)" : "", what,
+             written ? "written to" : "could not write", path);
+  return report;
+}
+
+static void DiffRange(void *ctx, int begin, int end, int worker) {
+  DiffJob *job = ctx;
+  const DiffOptions *options = job->options;
+  StageData *stage = &job->stages[worker];
+  BeamPath *ref = &job->paths[worker * DIFF_GROUP * 2];
+  BeamPath *got = ref + DIFF_GROUP;
+  BeamRetrace *retrace = &job->retraces[worker];
+  for (int index = begin; index < end; index++) {
+    unsigned int state = options->seed * 2654435761u ^ (unsigned int)index;
+    state = state ? state : 1u;
+    for (int i = 0; i < 4; i++)
+      NextRandom(&state);
+    StageSpec spec = {0};
+    ResetStage(stage);
+    if (!RandomStageSpec(&state, stage->field, &spec) ||
+        !BuildStageFromSpec(&spec, stage)) {
+      UnloadStageSpec(&spec);
+      continue;
+    }
+    for (int g = 0; g < options->groups && !job->reports[index]; g++) {
+      DiffCase c = {0};
+      RandomGroup(&state, stage, &c);
+      TraceReference(stage, &c, ref);
+      for (int v = 0; v < VARIANT_COUNT; v++) {
+        if (!(job->variants & (1u << v)))
+          continue;
+        char first[160];
+        c.variant = (DiffVariant)v;
+        c.lane = RunVariant(stage, c.variant, &c, options->ulps, ref, got,
+                            retrace, first, sizeof(first));
+        job->rays[worker] += c.count;
+        if (c.lane < 0)
+          continue;
+        ShrinkCase(&spec, &c, options->ulps, stage, ref, got, retrace);
+        char what[160] = "no longer reproduces";
+        if (BuildStageFromSpec(&spec, stage)) {
+          TraceReference(stage, &c, ref);
+          RunVariant(stage, c.variant, &c, options->ulps, ref, got, retrace,
+                     what, sizeof(what));
+        }
+        job->reports[index] =
+            ReportCase(options, index, &spec, &c, job->kernel, first, what);
+        break;
+      }
+    }
+    UnloadStageSpec(&spec);
+  }
+}
+
+// Bits of SweepCheckJob.hits.
+enum { SWEEP_GOAL = 1, SWEEP_LOOP_CHANGED = 2 };
+
+typedef struct SweepCheckJob {
+  const StageData *stage;    // as the game traces it
+  const StageData *stopping; // the same stage with stopLoops set
+  unsigned char *hits;       // per sweep angle, SWEEP_* bits
+} SweepCheckJob;
+
+static float SweepCheckAngle(int i) {
+  return (float)(-M_PI + 2.0 * M_PI * (double)i / (double)CHECK_SWEEP_RAYS);
+}
+
+// A trace cut short at a repeat must be the start of the full trace, and
+// must not hide a goal hit; any other trace must be the full one. The full
+// trace itself never ends in a loop.
+static bool StoppedPathAgrees(const BeamPath *full, const BeamPath *stopped) {
+  if (full->end == BEAM_END_LOOP ||
+      stopped->segmentCount > full->segmentCount)
+    return false;
+  for (int i = 0; i < stopped->segmentCount; i++) {
+    const BeamSegment *a = &full->segments[i];
+    const BeamSegment *b = &stopped->segments[i];
+    if (a->hitKind != b->hitKind || a->hitIndex != b->hitIndex ||
+        !CloseVec(a->end, b->end, 0) || a->endDist != b->endDist)
+      return false;
+  }
+  if (stopped->end == BEAM_END_LOOP)
+    return !full->hitGoal;
+  return stopped->end == full->end &&
+         stopped->segmentCount == full->segmentCount;
+}
+
+static void SweepCheckRange(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  SweepCheckJob *job = ctx;
+  BeamPath path = {0};
+  BeamPath stopped = {0};
+  for (int i = begin; i < end; i++) {
+    float angle = SweepCheckAngle(i);
+    Vector2 dir = {cosf(angle), sinf(angle)};
+    TraceBeam(job->stage, job->stage->start, dir, job->stage->maxBounces,
+              BEAM_DEFAULT_LENGTH, &path);
+    TraceBeam(job->stopping, job->stopping->start, dir,
+              job->stopping->maxBounces, BEAM_DEFAULT_LENGTH, &stopped);
+    job->hits[i] = (path.hitGoal ? SWEEP_GOAL : 0) |
+                   (StoppedPathAgrees(&path, &stopped) ? 0
+                                                       : SWEEP_LOOP_CHANGED);
+  }
+  UnloadBeamPath(&path);
+  UnloadBeamPath(&stopped);
+}
+
+static bool NearWindow(const BeamWindowList *list, float angle) {
+  for (int i = 0; i < list->count; i++) {
+    const BeamWindow *w = &list->windows[i];
+    if ((angle >= w->start - CHECK_TOLERANCE &&
+         angle <= w->end + CHECK_TOLERANCE) ||
+        angle + 2.0f * BEAM_PI <= w->end + CHECK_TOLERANCE)
+      return true;
+  }
+  return false;
+}
+
+// Counts the runs of goal-hitting sweep angles no solver window touches,
+// printing the first few.
+static int CountMissedWindows(const char *path, const char *solver,
+                              const unsigned char *hits,
+                              const BeamWindowList *list) {
+  int missed = 0;
+  int runs = 0;
+  for (int i = 0; i < CHECK_SWEEP_RAYS;) {
+    if (!(hits[i] & SWEEP_GOAL)) {
+      i++;
+      continue;
+    }
+    int first = i;
+    bool found = false;
+    for (; i < CHECK_SWEEP_RAYS && (hits[i] & SWEEP_GOAL); i++)
+      found = found || NearWindow(list, SweepCheckAngle(i));
+    runs++;
+    if (found)
+      continue;
+    if (missed++ < 5)
+      printf("%s: %s misses [%+.7f, %+.7f] rad\n", path, solver,
+             SweepCheckAngle(first), SweepCheckAngle(i - 1));
+  }
+  printf("%s: %s found %d windows (%lld rays); the sweep's %d runs all "
+         "covered but %d\n",
+         path, solver, list->count, list->rays, runs, missed);
+  return missed;
+}
+
+// Counts the sweep angles whose trace changed when stopLoops was set,
+// printing the first few.
+static int CountLoopChanges(const char *path, const unsigned char *hits) {
+  int changed = 0;
+  for (int i = 0; i < CHECK_SWEEP_RAYS; i++) {
+    if (!(hits[i] & SWEEP_LOOP_CHANGED))
+      continue;
+    if (changed++ < 5)
+      printf("%s: stopLoops changes the trace at %+.7f rad\n", path,
+             SweepCheckAngle(i));
+  }
+  printf("%s: %d of %d game traces changed by stopLoops\n", path, changed,
+         CHECK_SWEEP_RAYS);
+  return changed;
+}
+
+// Solves the stage file with both solvers at its own bounce budget, with
+// stopLoops set as solve does, and checks every goal ray of a dense sweep of
+// full game traces lies in a window the solver found. Returns the number of
+// sweep windows missed plus traces stopLoops changed, or -1 if the stage
+// could not be loaded or solved.
+static int CheckSolvers(const char *path, BeamPool *pool,
+                        unsigned char *hits) {
+  StageData stage = {0};
+  StageData stopping = {0};
+  if (!LoadStage(path, &stage) || !LoadStage(path, &stopping)) {
+    fprintf(stderr, "%s: failed to load stage\n", path);
+    UnloadStage(&stage);
+    UnloadStage(&stopping);
+    return -1;
+  }
+  stopping.stopLoops = true;
+  SweepCheckJob job = {&stage, &stopping, hits};
+  RunBeamPool(pool, CHECK_SWEEP_RAYS, 4096, SweepCheckRange, &job);
+  int failures = CountLoopChanges(path, hits);
+
+  BeamWindowList windows = {0};
+  bool solved = SolveStageAdaptive(&stopping, stopping.maxBounces,
+                                   BEAM_DEFAULT_LENGTH, CHECK_SOLVE_SAMPLES,
+                                   pool, &windows);
+  if (solved)
+    failures += CountMissedWindows(path, "adaptive", hits, &windows);
+  solved = solved && SolveStageBidirectional(&stopping, stopping.maxBounces,
+                                             BEAM_DEFAULT_LENGTH,
+                                             CHECK_SOLVE_SAMPLES,
+                                             CHECK_REVERSE_SAMPLES, pool,
+                                             &windows);
+  if (solved) {
+    failures += CountMissedWindows(path, "bidirectional", hits, &windows);
+  } else {
+    fprintf(stderr, "%s: out of memory while solving\n", path);
+    failures = -1;
+  }
+  UnloadBeamWindows(&windows);
+  UnloadStage(&stage);
+  UnloadStage(&stopping);
+  return failures;
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-n stages] [-g groups] [-u ulps] [-s seed] [-j threads] "
+          "[-o dir]\n"
+          "       [stage.json...]\n"
+          "Fires groups of %d rays through random stages and checks every "
+          "tracer variant\n"
+          "(bvh, grid, simd under each kernel, packet, retrace) against the "
+          "brute-force\n"
+          "reference: hit sequence, points and distances within -u ulps "
+          "(default 0),\n"
+          "goal and end reason. Each failing stage is shrunk to a minimal "
+          "stage and ray\n"
+          "group, written as a loadable stage file into -o (default .).\n"
+          "Stage files given are solved by the adaptive and bidirectional "
+          "solvers at their\n"
+          "own bounce budget, and every window a %d-ray sweep finds must be "
+          "among the\n"
+          "windows of each;\n"
+          "the sweep's traces must not change when stopLoops is set, other "
+          "than ending\n"
+          "early on a repeat.\n"
+          "Defaults: 2000 stages of 32 groups. Exits with 1 on any "
+          "difference.\n",
+          argv0, DIFF_GROUP, CHECK_SWEEP_RAYS);
+}
+
+int main(int argc, char **argv) {
+  DiffOptions options = {2000, 32, 0, 1u, 0, "."};
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    const char *arg = argv[argi];
+    const char *value = argi + 1 < argc ? argv[argi + 1] : NULL;
+    if (strcmp(arg, "-h") == 0) {
+      Usage(argv[0]);
+      return 0;
+    }
+    if (!value) {
+      Usage(argv[0]);
+      return 2;
+    }
+    if (strcmp(arg, "-n") == 0) {
+      options.stages = atoi(value);
+    } else if (strcmp(arg, "-g") == 0) {
+      options.groups = atoi(value);
+    } else if (strcmp(arg, "-u") == 0) {
+      options.ulps = atoi(value);
+    } else if (strcmp(arg, "-s") == 0) {
+      options.seed = (unsigned int)strtoul(value, NULL, 0);
+    } else if (strcmp(arg, "-j") == 0) {
+      options.threads = atoi(value);
+    } else if (strcmp(arg, "-o") == 0) {
+      options.outDir = value;
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+    argi++;
+  }
+  if (options.stages < 1 || options.groups < 1 || options.ulps < 0) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  BeamPool *pool = CreateBeamPool(options.threads);
+  int workers = pool ? GetBeamPoolThreads(pool) : 0;
+  DiffJob job = {&options,
+                 0,
+                 BEAM_KERNEL_SCALAR,
+                 calloc((size_t)workers, sizeof(StageData)),
+                 calloc((size_t)workers * DIFF_GROUP * 2, sizeof(BeamPath)),
+                 calloc((size_t)workers, sizeof(BeamRetrace)),
+                 calloc((size_t)options.stages, sizeof(char *)),
+                 calloc((size_t)workers, sizeof(long long))};
+  if (!pool || !job.stages || !job.paths || !job.retraces || !job.reports ||
+      !job.rays) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  // The SIMD kernel is process-wide, so each one gets its own pass; the
+  // other variants only run in the first.
+  int failures = 0;
+  bool seen[3] = {false, false, false};
+  static const BeamKernel kernels[] = {BEAM_KERNEL_AVX2, BEAM_KERNEL_SSE2,
+                                       BEAM_KERNEL_SCALAR};
+  for (int k = 0; k < 3; k++) {
+    job.kernel = SetBeamKernel(kernels[k]);
+    if (seen[job.kernel])
+      continue;
+    seen[job.kernel] = true;
+    job.variants = k == 0 ? (1u << VARIANT_COUNT) - 1 : 1u << VARIANT_SIMD;
+    RunBeamPool(pool, options.stages, 1, DiffRange, &job);
+    for (int i = 0; i < options.stages; i++) {
+      if (!job.reports[i])
+        continue;
+      fputs(job.reports[i], stdout);
+      free(job.reports[i]);
+      job.reports[i] = NULL;
+      failures++;
+    }
+  }
+
+  long long rays = 0;
+  for (int w = 0; w < workers; w++) {
+    rays += job.rays[w];
+    UnloadStage(&job.stages[w]);
+  }
+  for (int i = 0; i < workers * DIFF_GROUP * 2; i++)
+    UnloadBeamPath(&job.paths[i]);
+  printf("%lld rays through %d stages on %d threads: %d failing stage%s\n",
+         rays, options.stages, workers, failures, failures == 1 ? "" : "s");
+
+  int status = failures > 0 ? 1 : 0;
+  unsigned char *hits = argi < argc ? malloc(CHECK_SWEEP_RAYS) : NULL;
+  if (argi < argc && !hits) {
+    fprintf(stderr, "out of memory\n");
+    status = 2;
+  }
+  for (; hits && argi < argc; argi++) {
+    int problems = CheckSolvers(argv[argi], pool, hits);
+    if (problems < 0)
+      status = 2;
+    else if (problems > 0 && status == 0)
+      status = 1;
+  }
+  free(hits);
+  free(job.stages);
+  free(job.paths);
+  free(job.retraces);
+  free(job.reports);
+  free(job.rays);
+  DestroyBeamPool(pool);
+  return status;
+}
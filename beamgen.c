@@ -0,0 +1,558 @@
+#include "beamtrace.h"
+#include "cJSON.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GEN_MAX_RECTS 32
+#define GEN_MAX_CIRCLES 48
+#define GEN_BATCH 256      // candidates judged per pool run
+#define GEN_START_CLEAR 40 // free space kept around the start
+#define GEN_GOAL_CLEAR 15  // and around the goal, beyond its radius
+
+typedef enum GenLayout {
+  LAYOUT_SCATTER,
+  LAYOUT_WALLS,
+  LAYOUT_MIRRORS,
+  LAYOUT_PILLARS,
+  LAYOUT_COUNT,
+} GenLayout;
+
+static const char *layoutNames[] = {"scatter", "walls", "mirrors", "pillars"};
+
+typedef enum GenVerdict {
+  VERDICT_ACCEPTED,
+  VERDICT_DIRECT, // the goal is in plain sight of the start
+  VERDICT_UNSOLVABLE,
+  VERDICT_TOO_WIDE,
+  VERDICT_TOO_FEW_BOUNCES,
+  VERDICT_COUNT,
+} GenVerdict;
+
+static const char *verdictNames[] = {"accepted", "direct", "unsolvable",
+                                     "too wide", "too few bounces"};
+
+typedef struct GenOptions {
+  int count;
+  unsigned int seed;
+  int threads;
+  const char *outDir;
+  int layout; // GenLayout, or -1 to pick one per candidate
+  int minBounces;
+  float maxWidth; // widest window allowed, as a fraction of the circle
+  int samples;
+  int maxBounces;
+} GenOptions;
+
+// Obstacles are collected here, then copied into the worker's stage.
+typedef struct GenLayoutData {
+  Rectangle rects[GEN_MAX_RECTS];
+  int rectCount;
+  Vector2 circlePos[GEN_MAX_CIRCLES];
+  float circleRadius[GEN_MAX_CIRCLES];
+  int circleCount;
+  Vector2 goalPos;
+  float goalRadius;
+} GenLayoutData;
+
+typedef struct GenJob {
+  const GenOptions *options;
+  int base;               // candidate index of the batch's first slot
+  StageData *stages;      // one per pool worker
+  BeamPath *paths;        // BEAM_PACKET_MAX per pool worker
+  char *texts[GEN_BATCH]; // stage JSON of accepted candidates
+  GenVerdict verdicts[GEN_BATCH];
+  long long *rays; // per worker
+} GenJob;
+
+static unsigned int NextRandom(unsigned int *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// In [lo, hi]. Stages are laid out on whole pixels like the hand-made ones.
+static int RandomRange(unsigned int *state, int lo, int hi) {
+  return lo + (int)(NextRandom(state) % (unsigned int)(hi - lo + 1));
+}
+
+static float RectDistance(Rectangle r, Vector2 p) {
+  float dx = fmaxf(fmaxf(r.x - p.x, p.x - (r.x + r.width)), 0.0f);
+  float dy = fmaxf(fmaxf(r.y - p.y, p.y - (r.y + r.height)), 0.0f);
+  return sqrtf(dx * dx + dy * dy);
+}
+
+// Obstacles may not cover the start or touch the goal, or the stage is
+// either unplayable or trivially blocked.
+static bool RectFits(const GenLayoutData *data, Vector2 start, Rectangle r) {
+  return data->rectCount < GEN_MAX_RECTS && r.width > 0.0f &&
+         r.height > 0.0f && RectDistance(r, start) > GEN_START_CLEAR &&
+         RectDistance(r, data->goalPos) > data->goalRadius + GEN_GOAL_CLEAR;
+}
+
+static bool CircleFits(const GenLayoutData *data, Vector2 start, Vector2 p,
+                       float radius) {
+  return data->circleCount < GEN_MAX_CIRCLES &&
+         hypotf(p.x - start.x, p.y - start.y) - radius > GEN_START_CLEAR &&
+         hypotf(p.x - data->goalPos.x, p.y - data->goalPos.y) - radius >
+             data->goalRadius + GEN_GOAL_CLEAR;
+}
+
+static void AddRect(GenLayoutData *data, Vector2 start, Rectangle r) {
+  if (RectFits(data, start, r))
+    data->rects[data->rectCount++] = r;
+}
+
+static void AddCircle(GenLayoutData *data, Vector2 start, Vector2 p,
+                      float radius) {
+  if (!CircleFits(data, start, p, radius))
+    return;
+  data->circlePos[data->circleCount] = p;
+  data->circleRadius[data->circleCount] = radius;
+  data->circleCount++;
+}
+
+static Vector2 RandomPoint(unsigned int *state, Rectangle field, int margin) {
+  return (Vector2){
+      (float)RandomRange(state, (int)field.x + margin,
+                         (int)(field.x + field.width) - margin),
+      (float)RandomRange(state, (int)field.y + margin,
+                         (int)(field.y + field.height) - margin)};
+}
+
+// A handful of boxes and discs anywhere, like the hand-made stages.
+static void LayoutScatter(unsigned int *state, Rectangle field, Vector2 start,
+                          GenLayoutData *data) {
+  int count = RandomRange(state, 3, 10);
+  for (int i = 0; i < count; i++) {
+    if (RandomRange(state, 0, 4) < 3) {
+      Vector2 p = RandomPoint(state, field, 0);
+      int w = RandomRange(state, 20, 220);
+      int h = RandomRange(state, 20, 220);
+      // Mostly slabs: one side thin, the other long.
+      if (RandomRange(state, 0, 1))
+        w = RandomRange(state, 20, 50);
+      else
+        h = RandomRange(state, 20, 50);
+      AddRect(data, start, (Rectangle){p.x, p.y, (float)w, (float)h});
+    } else {
+      AddCircle(data, start, RandomPoint(state, field, 0),
+                (float)RandomRange(state, 15, 70));
+    }
+  }
+}
+
+// Two to four field-wide walls, each broken by a gap or two, so the beam
+// has to thread or bank around them.
+static void LayoutWalls(unsigned int *state, Rectangle field, Vector2 start,
+                        GenLayoutData *data) {
+  bool vertical = RandomRange(state, 0, 1);
+  float span = vertical ? field.width : field.height;
+  int walls = RandomRange(state, 2, 4);
+  for (int i = 0; i < walls; i++) {
+    float at = (vertical ? field.x : field.y) +
+               span * ((float)i + 0.5f) / (float)walls +
+               (float)RandomRange(state, -40, 40);
+    float thick = (float)RandomRange(state, 16, 36);
+    float length = vertical ? field.height : field.width;
+    float lo = vertical ? field.y : field.x;
+    int gaps = RandomRange(state, 1, 2);
+    float cut[4];
+    for (int g = 0; g < gaps; g++) {
+      float size = (float)RandomRange(state, 60, 160);
+      float pos = lo + (float)RandomRange(state, 0, (int)(length - size));
+      cut[g * 2] = pos;
+      cut[g * 2 + 1] = pos + size;
+    }
+    if (gaps == 2 && cut[0] > cut[2]) {
+      float a = cut[0], b = cut[1];
+      cut[0] = cut[2];
+      cut[1] = cut[3];
+      cut[2] = a;
+      cut[3] = b;
+    }
+    // Pieces between field edge, gaps and field edge.
+    float from = lo;
+    for (int g = 0; g <= gaps; g++) {
+      float to = g < gaps ? cut[g * 2] : lo + length;
+      if (to > from) {
+        Rectangle r = vertical ? (Rectangle){at, from, thick, to - from}
+                               : (Rectangle){from, at, to - from, thick};
+        AddRect(data, start, r);
+      }
+      if (g < gaps && cut[g * 2 + 1] > from)
+        from = cut[g * 2 + 1];
+    }
+  }
+}
+
+// Thin axis-aligned slabs to bank off, and a block between start and goal
+// so the straight shot is gone.
+static void LayoutMirrors(unsigned int *state, Rectangle field, Vector2 start,
+                          GenLayoutData *data) {
+  int count = RandomRange(state, 3, 7);
+  for (int i = 0; i < count; i++) {
+    Vector2 p = RandomPoint(state, field, 40);
+    float length = (float)RandomRange(state, 80, 320);
+    float thick = (float)RandomRange(state, 8, 16);
+    Rectangle r = RandomRange(state, 0, 1)
+                      ? (Rectangle){p.x, p.y, length, thick}
+                      : (Rectangle){p.x, p.y, thick, length};
+    AddRect(data, start, r);
+  }
+  Vector2 mid = {roundf((start.x + data->goalPos.x) * 0.5f),
+                 roundf((start.y + data->goalPos.y) * 0.5f)};
+  if (RandomRange(state, 0, 1)) {
+    float size = (float)RandomRange(state, 60, 140);
+    AddRect(data, start,
+            (Rectangle){mid.x - size * 0.5f, mid.y - size * 0.5f, size, size});
+  } else {
+    AddCircle(data, start, mid, (float)RandomRange(state, 30, 70));
+  }
+}
+
+// A jittered lattice of posts with some left out.
+static void LayoutPillars(unsigned int *state, Rectangle field, Vector2 start,
+                          GenLayoutData *data) {
+  int spacing = RandomRange(state, 110, 220);
+  int radius = RandomRange(state, 10, 35);
+  int jitter = spacing / 2 - radius - 5;
+  for (float y = field.y + (float)spacing * 0.5f; y < field.y + field.height;
+       y += (float)spacing)
+    for (float x = field.x + (float)spacing * 0.5f; x < field.x + field.width;
+         x += (float)spacing) {
+      if (RandomRange(state, 0, 2) == 0)
+        continue;
+      Vector2 p = {x + (float)RandomRange(state, -jitter, jitter),
+                   y + (float)RandomRange(state, -jitter, jitter)};
+      AddCircle(data, start, p, (float)radius);
+    }
+}
+
+static void GenerateLayout(unsigned int *state, const GenOptions *options,
+                           StageData *stage, GenLayoutData *data) {
+  const Rectangle field = stage->field;
+  const Vector2 start = stage->start;
+  data->rectCount = 0;
+  data->circleCount = 0;
+  data->goalRadius = (float)RandomRange(state, 15, 40);
+  do {
+    data->goalPos = RandomPoint(state, field, (int)data->goalRadius + 10);
+  } while (hypotf(data->goalPos.x - start.x, data->goalPos.y - start.y) <
+           250.0f);
+
+  GenLayout layout = options->layout >= 0
+                         ? (GenLayout)options->layout
+                         : (GenLayout)RandomRange(state, 0, LAYOUT_COUNT - 1);
+  switch (layout) {
+  case LAYOUT_WALLS:
+    LayoutWalls(state, field, start, data);
+    break;
+  case LAYOUT_MIRRORS:
+    LayoutMirrors(state, field, start, data);
+    break;
+  case LAYOUT_PILLARS:
+    LayoutPillars(state, field, start, data);
+    break;
+  default:
+    LayoutScatter(state, field, start, data);
+    break;
+  }
+}
+
+static bool BuildStageFromLayout(const GenLayoutData *data, int maxBounces,
+                                 StageData *stage) {
+  ResetStage(stage);
+  if (!ReserveStageObstacles(stage, data->rectCount, data->circleCount))
+    return false;
+  memcpy(stage->rects, data->rects,
+         sizeof(Rectangle) * (size_t)data->rectCount);
+  memcpy(stage->circlePos, data->circlePos,
+         sizeof(Vector2) * (size_t)data->circleCount);
+  memcpy(stage->circleRadius, data->circleRadius,
+         sizeof(float) * (size_t)data->circleCount);
+  stage->rectCount = data->rectCount;
+  stage->circleCount = data->circleCount;
+  stage->hasGoal = true;
+  stage->goalPos = data->goalPos;
+  stage->goalRadius = data->goalRadius;
+  stage->maxBounces = maxBounces;
+  PrepareStage(stage);
+  return true;
+}
+
+// Same schema as stages/stage1.json.
+static char *StageToJson(const StageData *stage) {
+  cJSON *root = cJSON_CreateObject();
+  if (!root)
+    return NULL;
+  cJSON *rects = cJSON_AddArrayToObject(root, "rects");
+  for (int i = 0; i < stage->rectCount; i++) {
+    cJSON *r = cJSON_CreateObject();
+    cJSON_AddNumberToObject(r, "x", stage->rects[i].x);
+    cJSON_AddNumberToObject(r, "y", stage->rects[i].y);
+    cJSON_AddNumberToObject(r, "w", stage->rects[i].width);
+    cJSON_AddNumberToObject(r, "h", stage->rects[i].height);
+    cJSON_AddItemToArray(rects, r);
+  }
+  cJSON *circles = cJSON_AddArrayToObject(root, "circles");
+  for (int i = 0; i < stage->circleCount; i++) {
+    cJSON *o = cJSON_CreateObject();
+    cJSON_AddNumberToObject(o, "x", stage->circlePos[i].x);
+    cJSON_AddNumberToObject(o, "y", stage->circlePos[i].y);
+    cJSON_AddNumberToObject(o, "r", stage->circleRadius[i]);
+    cJSON_AddItemToArray(circles, o);
+  }
+  cJSON *goal = cJSON_AddObjectToObject(root, "goal");
+  cJSON_AddNumberToObject(goal, "x", stage->goalPos.x);
+  cJSON_AddNumberToObject(goal, "y", stage->goalPos.y);
+  cJSON_AddNumberToObject(goal, "r", stage->goalRadius);
+  if (stage->maxBounces != BEAM_DEFAULT_MAX_BOUNCES)
+    cJSON_AddNumberToObject(root, "maxBounces", stage->maxBounces);
+  char *text = cJSON_Print(root);
+  cJSON_Delete(root);
+  return text;
+}
+
+// Sweeps the circle of firing angles with packets of neighbouring rays.
+// Unlike the adaptive solver, whose cost grows with every route boundary
+// (seconds for a beam rattling in a cage), this costs the same for every
+// stage; windows narrower than the spacing count as missing.
+static GenVerdict JudgeStage(const GenOptions *options, const StageData *stage,
+                             BeamPath *paths, long long *rays) {
+  // One ray at the goal's centre settles the most common rejection before
+  // the sweep.
+  if (options->minBounces > 0) {
+    Vector2 d = {stage->goalPos.x - stage->start.x,
+                 stage->goalPos.y - stage->start.y};
+    float length = hypotf(d.x, d.y);
+    TraceBeam(stage, stage->start, (Vector2){d.x / length, d.y / length},
+              stage->maxBounces, BEAM_DEFAULT_LENGTH, &paths[0]);
+    (*rays)++;
+    if (paths[0].hitGoal && paths[0].segmentCount == 1)
+      return VERDICT_DIRECT;
+  }
+
+  const int samples = options->samples;
+  int hits = 0;
+  int fewest = BEAM_MAX_BOUNCES;
+  int run = 0;
+  int firstRun = -1; // joins the last run, which wraps around to it
+  int widest = 0;
+  Vector2 dirs[BEAM_PACKET_MAX];
+  for (int i = 0; i < samples; i += BEAM_PACKET_MAX) {
+    int count = samples - i < BEAM_PACKET_MAX ? samples - i : BEAM_PACKET_MAX;
+    for (int l = 0; l < count; l++) {
+      float angle = (float)(-M_PI + 2.0 * M_PI * ((double)(i + l) + 0.5) /
+                                        (double)samples);
+      dirs[l] = (Vector2){cosf(angle), sinf(angle)};
+    }
+    TraceBeamPacket(stage, stage->start, dirs, count, stage->maxBounces,
+                    BEAM_DEFAULT_LENGTH, paths);
+    for (int l = 0; l < count; l++) {
+      if (paths[l].hitGoal) {
+        hits++;
+        run++;
+        if (paths[l].segmentCount - 1 < fewest)
+          fewest = paths[l].segmentCount - 1;
+        continue;
+      }
+      if (firstRun < 0)
+        firstRun = run;
+      if (run > widest)
+        widest = run;
+      run = 0;
+    }
+  }
+  *rays += samples;
+  if (firstRun < 0)
+    widest = samples;
+  else if (run + firstRun > widest)
+    widest = run + firstRun;
+
+  if (hits == 0)
+    return VERDICT_UNSOLVABLE;
+  if (fewest < options->minBounces)
+    return VERDICT_TOO_FEW_BOUNCES;
+  if ((float)widest > options->maxWidth * (float)samples)
+    return VERDICT_TOO_WIDE;
+  return VERDICT_ACCEPTED;
+}
+
+static void GenRange(void *ctx, int begin, int end, int worker) {
+  GenJob *job = ctx;
+  const GenOptions *options = job->options;
+  StageData *stage = &job->stages[worker];
+  GenLayoutData data;
+  for (int slot = begin; slot < end; slot++) {
+    unsigned int index = (unsigned int)(job->base + slot);
+    unsigned int state = options->seed * 2654435761u ^ index;
+    state = state ? state : 1u;
+    for (int i = 0; i < 4; i++)
+      NextRandom(&state);
+    ResetStage(stage);
+    GenerateLayout(&state, options, stage, &data);
+    if (!BuildStageFromLayout(&data, options->maxBounces, stage)) {
+      job->verdicts[slot] = VERDICT_UNSOLVABLE;
+      continue;
+    }
+    job->verdicts[slot] =
+        JudgeStage(options, stage, &job->paths[worker * BEAM_PACKET_MAX],
+                   &job->rays[worker]);
+    if (job->verdicts[slot] == VERDICT_ACCEPTED)
+      job->texts[slot] = StageToJson(stage);
+  }
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static bool WriteText(const char *path, const char *text) {
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return false;
+  bool ok = fputs(text, file) >= 0 && fputc('\n', file) >= 0;
+  return fclose(file) == 0 && ok;
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-n stages] [-s seed] [-j threads] [-o dir] [-l layout] "
+          "[-b bounces]\n"
+          "          [-w width] [-a samples] [-m maxBounces]\n"
+          "Generates random stages and keeps those a sweep of -a rays "
+          "finds solvable,\n"
+          "writing them as <dir>/gen-<seed>-<n>.json (dir defaults to .).\n"
+          "  -l  scatter, walls, mirrors, pillars or mixed (default)\n"
+          "  -b  fewest bounces any solution may need (default 1)\n"
+          "  -w  widest window allowed, as a fraction of the circle "
+          "(default 0.01)\n"
+          "  -a  rays swept around the start (default 4096)\n"
+          "  -m  bounce budget written into each stage (default %d)\n"
+          "Defaults: 100 stages, seed 1, every CPU. The same seed gives the "
+          "same stages\n"
+          "on any thread count.\n",
+          argv0, BEAM_DEFAULT_MAX_BOUNCES);
+}
+
+int main(int argc, char **argv) {
+  GenOptions options = {
+      100, 1u, 0, ".", -1, 1, 0.01f, 4096, BEAM_DEFAULT_MAX_BOUNCES};
+  for (int argi = 1; argi < argc; argi++) {
+    const char *arg = argv[argi];
+    const char *value = argi + 1 < argc ? argv[argi + 1] : NULL;
+    if (strcmp(arg, "-h") == 0) {
+      Usage(argv[0]);
+      return 0;
+    }
+    if (!value) {
+      Usage(argv[0]);
+      return 2;
+    }
+    if (strcmp(arg, "-n") == 0) {
+      options.count = atoi(value);
+    } else if (strcmp(arg, "-s") == 0) {
+      options.seed = (unsigned int)strtoul(value, NULL, 0);
+    } else if (strcmp(arg, "-j") == 0) {
+      options.threads = atoi(value);
+    } else if (strcmp(arg, "-o") == 0) {
+      options.outDir = value;
+    } else if (strcmp(arg, "-l") == 0) {
+      options.layout = -2;
+      if (strcmp(value, "mixed") == 0)
+        options.layout = -1;
+      for (int l = 0; l < LAYOUT_COUNT; l++)
+        if (strcmp(value, layoutNames[l]) == 0)
+          options.layout = l;
+    } else if (strcmp(arg, "-b") == 0) {
+      options.minBounces = atoi(value);
+    } else if (strcmp(arg, "-w") == 0) {
+      options.maxWidth = strtof(value, NULL);
+    } else if (strcmp(arg, "-a") == 0) {
+      options.samples = atoi(value);
+    } else if (strcmp(arg, "-m") == 0) {
+      options.maxBounces = atoi(value);
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+    argi++;
+  }
+  if (options.count < 1 || options.layout < -1 || options.samples < 1 ||
+      options.maxBounces < 0 || options.maxBounces > BEAM_MAX_BOUNCES ||
+      options.maxWidth <= 0.0f) {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  BeamPool *pool = CreateBeamPool(options.threads);
+  int workers = pool ? GetBeamPoolThreads(pool) : 0;
+  GenJob job = {&options,
+                0,
+                calloc((size_t)workers, sizeof(StageData)),
+                calloc((size_t)workers * BEAM_PACKET_MAX, sizeof(BeamPath)),
+                {0},
+                {0},
+                calloc((size_t)workers, sizeof(long long))};
+  if (!pool || !job.stages || !job.paths || !job.rays) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  // Candidates are judged a batch at a time but written in index order, so
+  // the output depends only on the seed.
+  int accepted = 0;
+  long long verdicts[VERDICT_COUNT] = {0};
+  bool failed = false;
+  double start = Now();
+  while (accepted < options.count && !failed) {
+    RunBeamPool(pool, GEN_BATCH, 1, GenRange, &job);
+    for (int slot = 0; slot < GEN_BATCH; slot++) {
+      if (accepted < options.count) {
+        verdicts[job.verdicts[slot]]++;
+        if (job.verdicts[slot] == VERDICT_ACCEPTED) {
+          char path[512];
+          snprintf(path, sizeof(path), "%s/gen-%08x-%05d.json",
+                   options.outDir, options.seed, accepted);
+          if (!job.texts[slot] || !WriteText(path, job.texts[slot])) {
+            fprintf(stderr, "could not write %s\n", path);
+            failed = true;
+          }
+          accepted++;
+        }
+      }
+      free(job.texts[slot]);
+      job.texts[slot] = NULL;
+    }
+    job.base += GEN_BATCH;
+  }
+  double elapsed = Now() - start;
+
+  long long rays = 0;
+  for (int w = 0; w < workers; w++) {
+    rays += job.rays[w];
+    UnloadStage(&job.stages[w]);
+  }
+  for (int i = 0; i < workers * BEAM_PACKET_MAX; i++)
+    UnloadBeamPath(&job.paths[i]);
+  long long tried = 0;
+  for (int v = 0; v < VERDICT_COUNT; v++)
+    tried += verdicts[v];
+  printf("%d stages from %lld candidates in %.2f s on %d threads "
+         "(%.0f stages/min, %lld rays)\n",
+         accepted, tried, elapsed, workers,
+         elapsed > 0.0 ? (double)accepted / elapsed * 60.0 : 0.0, rays);
+  for (int v = 0; v < VERDICT_COUNT; v++)
+    printf("  %-16s %lld\n", verdictNames[v], verdicts[v]);
+  free(job.stages);
+  free(job.paths);
+  free(job.rays);
+  DestroyBeamPool(pool);
+  return failed ? 1 : 0;
+}
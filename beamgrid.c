@@ -0,0 +1,200 @@
+#include "beamtrace.h"
+#include <math.h>
+#include <stdlib.h>
+
+#define GRID_CELLS_PER_OBSTACLE 2.0f
+#define GRID_MAX_DIM 1024
+
+typedef struct GridSpan {
+  int x0, y0, x1, y1;
+} GridSpan;
+
+void UnloadStageGrid(StageData *stage) {
+  free(stage->grid.cellStart);
+  free(stage->grid.items);
+  stage->grid = (StageGrid){0};
+}
+
+static int ClampCell(float v, int count) {
+  if (!(v >= 0.0f))
+    return 0;
+  if (v >= (float)count)
+    return count - 1;
+  return (int)v;
+}
+
+// Cells are registered with inclusive, slightly padded bounds so that a ray
+// grazing a cell corner or running along a cell edge still meets the
+// obstacle in every cell the DDA may step through.
+static GridSpan ObstacleSpan(const StageData *stage, const StageGrid *grid,
+                             int id, float drift) {
+  float minX, minY, maxX, maxY;
+  if (id < stage->rectCount) {
+    Rectangle r = stage->rects[id];
+    minX = r.x - 0.01f;
+    minY = r.y - 0.01f;
+    maxX = r.x + r.width + 0.01f;
+    maxY = r.y + r.height + 0.01f;
+  } else {
+    int c = id - stage->rectCount;
+    float r = stage->circleRadius[c] * 1.001f + 1.0f + drift;
+    minX = stage->circlePos[c].x - r;
+    minY = stage->circlePos[c].y - r;
+    maxX = stage->circlePos[c].x + r;
+    maxY = stage->circlePos[c].y + r;
+  }
+  return (GridSpan){
+      ClampCell((minX - grid->minX) / grid->cellW, grid->cols),
+      ClampCell((minY - grid->minY) / grid->cellH, grid->rows),
+      ClampCell((maxX - grid->minX) / grid->cellW, grid->cols),
+      ClampCell((maxY - grid->minY) / grid->cellH, grid->rows)};
+}
+
+void BuildStageGrid(StageData *stage, int cols, int rows) {
+  UnloadStageGrid(stage);
+  int count = stage->rectCount + stage->circleCount;
+  Rectangle field = stage->field;
+  if (count == 0 || field.width <= 0.0f || field.height <= 0.0f)
+    return;
+
+  if (cols <= 0 || rows <= 0) {
+    // Aim for a couple of cells per obstacle, but never make cells much
+    // smaller than a typical obstacle or each one lands in many cells.
+    float extent = 0.0f;
+    for (int i = 0; i < stage->rectCount; i++)
+      extent += (stage->rects[i].width + stage->rects[i].height) * 0.5f;
+    for (int i = 0; i < stage->circleCount; i++)
+      extent += stage->circleRadius[i] * 2.0f;
+    extent /= (float)count;
+    float cell = sqrtf(field.width * field.height /
+                       (GRID_CELLS_PER_OBSTACLE * (float)count));
+    if (cell < extent * 0.5f)
+      cell = extent * 0.5f;
+    cols = (int)ceilf(field.width / cell);
+    rows = (int)ceilf(field.height / cell);
+  }
+  if (cols < 1)
+    cols = 1;
+  if (rows < 1)
+    rows = 1;
+  if (cols > GRID_MAX_DIM)
+    cols = GRID_MAX_DIM;
+  if (rows > GRID_MAX_DIM)
+    rows = GRID_MAX_DIM;
+
+  StageGrid grid = {field.x, field.y, field.width / (float)cols,
+                    field.height / (float)rows, cols, rows};
+  // Near-axis rays are treated as exactly axis-aligned during the walk, so
+  // circles also absorb the sideways drift over the longest possible segment.
+  float drift = 0.0001f * (field.width + field.height);
+  int cellCount = cols * rows;
+  grid.cellStart = calloc((size_t)cellCount + 1, sizeof(int));
+  if (!grid.cellStart)
+    return;
+
+  for (int id = 0; id < count; id++) {
+    GridSpan s = ObstacleSpan(stage, &grid, id, drift);
+    for (int y = s.y0; y <= s.y1; y++)
+      for (int x = s.x0; x <= s.x1; x++)
+        grid.cellStart[y * cols + x + 1]++;
+  }
+  for (int i = 0; i < cellCount; i++)
+    grid.cellStart[i + 1] += grid.cellStart[i];
+
+  grid.items = malloc(sizeof(int) * (size_t)(grid.cellStart[cellCount] + 1));
+  int *fill = malloc(sizeof(int) * (size_t)cellCount);
+  if (!grid.items || !fill) {
+    free(grid.cellStart);
+    free(grid.items);
+    free(fill);
+    return;
+  }
+  for (int i = 0; i < cellCount; i++)
+    fill[i] = grid.cellStart[i];
+  for (int id = 0; id < count; id++) {
+    GridSpan s = ObstacleSpan(stage, &grid, id, drift);
+    for (int y = s.y0; y <= s.y1; y++)
+      for (int x = s.x0; x <= s.x1; x++)
+        grid.items[fill[y * cols + x]++] = id;
+  }
+  free(fill);
+  stage->grid = grid;
+}
+
+static float CellBoundaryT(float origin, float pos, float cellSize, int cell,
+                           float dir) {
+  if (dir > 0.0f)
+    return (origin + (float)(cell + 1) * cellSize - pos) / dir;
+  if (dir < 0.0f)
+    return (origin + (float)cell * cellSize - pos) / dir;
+  return INFINITY;
+}
+
+bool StageGridClosestHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                         BeamHit *hit) {
+  const StageGrid *grid = &stage->grid;
+  float fx = (pos.x - grid->minX) / grid->cellW;
+  float fy = (pos.y - grid->minY) / grid->cellH;
+  if (!(fx >= 0.0f && fx <= (float)grid->cols && fy >= 0.0f &&
+        fy <= (float)grid->rows))
+    return false;
+  int cx = ClampCell(fx, grid->cols);
+  int cy = ClampCell(fy, grid->rows);
+
+  // Same near-parallel rule as RayIntersectRect: such an axis never changes
+  // cell.
+  float dx = fabsf(dir.x) < 0.0001f ? 0.0f : dir.x;
+  float dy = fabsf(dir.y) < 0.0001f ? 0.0f : dir.y;
+  int stepX = dx > 0.0f ? 1 : (dx < 0.0f ? -1 : 0);
+  int stepY = dy > 0.0f ? 1 : (dy < 0.0f ? -1 : 0);
+  int bestRank = hit->kind == BEAM_HIT_WALL ? -1 : -2;
+  long long cells = 0;
+  long long obstacleTests = 0;
+
+  for (;;) {
+    int cell = cy * grid->cols + cx;
+    cells++;
+    obstacleTests += grid->cellStart[cell + 1] - grid->cellStart[cell];
+    for (int i = grid->cellStart[cell]; i < grid->cellStart[cell + 1]; i++) {
+      int id = grid->items[i];
+      float t = 0.0f;
+      Vector2 n = {0.0f, 0.0f};
+      bool found;
+      if (id < stage->rectCount) {
+        found = RayIntersectRect(pos, dir, stage->rects[id], &t, &n);
+      } else {
+        int c = id - stage->rectCount;
+        found = RayIntersectCircle(pos, dir, stage->circlePos[c],
+                                   stage->circleRadius[c], &t, &n);
+      }
+      if (!found || !(t < hit->t || (t == hit->t && id < bestRank)))
+        continue;
+      hit->t = t;
+      hit->normal = n;
+      hit->kind = id < stage->rectCount ? BEAM_HIT_RECT : BEAM_HIT_CIRCLE;
+      hit->index = id < stage->rectCount ? id : id - stage->rectCount;
+      bestRank = id;
+    }
+
+    // Every later cell starts beyond tNext, so a hit at or before it is final.
+    float tMaxX = CellBoundaryT(grid->minX, pos.x, grid->cellW, cx, dx);
+    float tMaxY = CellBoundaryT(grid->minY, pos.y, grid->cellH, cy, dy);
+    float tNext = tMaxX < tMaxY ? tMaxX : tMaxY;
+    if (tNext > hit->t)
+      break;
+    if (tMaxX < tMaxY) {
+      cx += stepX;
+      if (cx < 0 || cx >= grid->cols)
+        break;
+    } else {
+      cy += stepY;
+      if (cy < 0 || cy >= grid->rows)
+        break;
+    }
+  }
+  if (stage->stats) {
+    stage->stats->nodeTests += cells;
+    stage->stats->obstacleTests += obstacleTests;
+  }
+  return true;
+}
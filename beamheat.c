@@ -0,0 +1,199 @@
+#include "beamtrace.h"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Count and fewest bounces share a cache line, one load per pixel visited.
+typedef struct HeatCell {
+  unsigned int count;
+  unsigned int minBounces;
+} HeatCell;
+
+// Each worker counts into its own grid; they are merged once at the end.
+typedef struct HeatJob {
+  const StageData *stage;
+  Vector2 origin;
+  int rays;
+  int maxBounces;
+  float maxLength;
+  int width;
+  int height;
+  HeatCell **cells;    // per worker
+  long long *goalRays; // per worker
+} HeatJob;
+
+// Walks the segment one pixel per step along its major axis, sampling the
+// end point of each step, so consecutive segments do not count their shared
+// corner twice.
+static void RasterizeSegment(const HeatJob *job, HeatCell *cells, Vector2 a,
+                             Vector2 b, unsigned int bounces) {
+  float dx = b.x - a.x;
+  float dy = b.y - a.y;
+  int steps = (int)ceilf(fmaxf(fabsf(dx), fabsf(dy)));
+  if (steps < 1)
+    steps = 1;
+  float sx = dx / (float)steps;
+  float sy = dy / (float)steps;
+  // Copied to locals: the cell stores below could otherwise alias the job.
+  float width = (float)job->width;
+  float height = (float)job->height;
+  int stride = job->width;
+  // Both ends inside means every sample is: the grid is convex.
+  bool clipped = !(a.x >= 0.0f && a.y >= 0.0f && a.x < width && a.y < height &&
+                   b.x >= 0.0f && b.y >= 0.0f && b.x < width && b.y < height);
+  for (int i = 1; i <= steps; i++) {
+    float x = a.x + sx * (float)i;
+    float y = a.y + sy * (float)i;
+    if (clipped && !(x >= 0.0f && y >= 0.0f && x < width && y < height))
+      continue;
+    HeatCell *cell = &cells[(int)y * stride + (int)x];
+    cell->count++;
+    if (bounces < cell->minBounces)
+      cell->minBounces = bounces;
+  }
+}
+
+static void HeatRange(void *ctx, int begin, int end, int worker) {
+  HeatJob *job = ctx;
+  HeatCell *cells = job->cells[worker];
+  BeamPath paths[BEAM_PACKET_MAX] = {0};
+  Vector2 dirs[BEAM_PACKET_MAX];
+  for (int i = begin; i < end; i += BEAM_PACKET_MAX) {
+    int count = end - i < BEAM_PACKET_MAX ? end - i : BEAM_PACKET_MAX;
+    for (int l = 0; l < count; l++) {
+      float angle = BeamLutAngle(i + l, job->rays);
+      dirs[l] = (Vector2){cosf(angle), sinf(angle)};
+    }
+    TraceBeamPacket(job->stage, job->origin, dirs, count, job->maxBounces,
+                    job->maxLength, paths);
+    for (int l = 0; l < count; l++) {
+      const BeamPath *path = &paths[l];
+      for (int s = 0; s < path->segmentCount; s++)
+        RasterizeSegment(job, cells, path->segments[s].start,
+                         path->segments[s].end, (unsigned int)s);
+      if (path->hitGoal)
+        job->goalRays[worker]++;
+    }
+  }
+  for (int l = 0; l < BEAM_PACKET_MAX; l++)
+    UnloadBeamPath(&paths[l]);
+}
+
+bool ComputeBeamHeatmap(const StageData *stage, Vector2 origin, int rays,
+                        int maxBounces, float maxLength, int width, int height,
+                        BeamPool *pool, BeamHeatmap *map) {
+  UnloadBeamHeatmap(map);
+  if (rays < 1 || width < 1 || height < 1)
+    return false;
+  size_t cells = (size_t)width * (size_t)height;
+  int workers = pool ? GetBeamPoolThreads(pool) : 1;
+  HeatJob job = {stage,
+                 origin,
+                 rays,
+                 maxBounces,
+                 maxLength,
+                 width,
+                 height,
+                 calloc((size_t)workers, sizeof(HeatCell *)),
+                 calloc((size_t)workers, sizeof(long long))};
+  map->coverage = malloc(sizeof(float) * cells);
+  map->minBounces = malloc(sizeof(unsigned short) * cells);
+  bool ok = job.cells && job.goalRays && map->coverage && map->minBounces;
+  for (int w = 0; ok && w < workers; w++) {
+    job.cells[w] = malloc(sizeof(HeatCell) * cells);
+    ok = job.cells[w] != NULL;
+    for (size_t i = 0; ok && i < cells; i++)
+      job.cells[w][i] = (HeatCell){0, UINT_MAX};
+  }
+
+  if (ok) {
+    if (pool)
+      RunBeamPool(pool, rays, 4096, HeatRange, &job);
+    else
+      HeatRange(&job, 0, rays, 0);
+
+    map->width = width;
+    map->height = height;
+    map->rays = rays;
+    for (size_t i = 0; i < cells; i++) {
+      unsigned long long count = 0;
+      unsigned int fewest = UINT_MAX;
+      for (int w = 0; w < workers; w++) {
+        count += job.cells[w][i].count;
+        if (job.cells[w][i].minBounces < fewest)
+          fewest = job.cells[w][i].minBounces;
+      }
+      map->coverage[i] = (float)((double)count / (double)rays);
+      // Bounce counts past the sentinel are clamped just below it.
+      if (fewest == UINT_MAX)
+        map->minBounces[i] = BEAM_HEAT_UNREACHED;
+      else if (fewest >= BEAM_HEAT_UNREACHED)
+        map->minBounces[i] = BEAM_HEAT_UNREACHED - 1;
+      else
+        map->minBounces[i] = (unsigned short)fewest;
+    }
+    for (int w = 0; w < workers; w++)
+      map->goalRays += job.goalRays[w];
+  }
+
+  for (int w = 0; job.cells && w < workers; w++)
+    free(job.cells[w]);
+  free(job.cells);
+  free(job.goalRays);
+  if (!ok)
+    UnloadBeamHeatmap(map);
+  return ok;
+}
+
+void UnloadBeamHeatmap(BeamHeatmap *map) {
+  free(map->coverage);
+  free(map->minBounces);
+  *map = (BeamHeatmap){0};
+}
+
+static bool WritePgm(const char *path, int width, int height,
+                     const unsigned char *pixels) {
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+  size_t size = (size_t)width * (size_t)height;
+  bool ok = fprintf(file, "P5\n%d %d\n255\n", width, height) > 0 &&
+            fwrite(pixels, 1, size, file) == size;
+  return fclose(file) == 0 && ok;
+}
+
+bool ExportBeamHeatmap(const BeamHeatmap *map, const char *coveragePath,
+                       const char *bouncesPath) {
+  size_t cells = (size_t)map->width * (size_t)map->height;
+  unsigned char *pixels = malloc(cells);
+  if (!pixels)
+    return false;
+
+  bool ok = true;
+  if (coveragePath) {
+    // Log scale in passes per pixel: a single pass is already visible.
+    float peak = 0.0f;
+    for (size_t i = 0; i < cells; i++)
+      peak = fmaxf(peak, map->coverage[i]);
+    double scale = log1p((double)peak * (double)map->rays);
+    for (size_t i = 0; i < cells; i++) {
+      double v = log1p((double)map->coverage[i] * (double)map->rays);
+      pixels[i] = scale > 0.0 ? (unsigned char)lround(v / scale * 255.0) : 0;
+    }
+    ok = WritePgm(coveragePath, map->width, map->height, pixels);
+  }
+  if (ok && bouncesPath) {
+    // Brightest where the beam arrives directly, darker per bounce needed,
+    // black where it never arrives.
+    for (size_t i = 0; i < cells; i++) {
+      int b = map->minBounces[i];
+      pixels[i] = b == BEAM_HEAT_UNREACHED
+                      ? 0
+                      : (unsigned char)(b < 7 ? 255 - b * 32 : 32);
+    }
+    ok = WritePgm(bouncesPath, map->width, map->height, pixels);
+  }
+  free(pixels);
+  return ok;
+}
@@ -0,0 +1,75 @@
+#include "beamtrace.h"
+
+// A rect grown by radius is the union of two crossed rects, one widened and
+// one heightened, and a circle on each corner. A ray's first entry into the
+// union is its first entry into one of the pieces, with that piece's normal,
+// so the existing rect and circle tests trace it exactly.
+bool InflateStage(const StageData *stage, float radius, StageData *out) {
+  if (radius < 0.0f)
+    radius = 0.0f;
+  int corners = radius > 0.0f ? 4 : 0;
+  int rects = radius > 0.0f ? 2 : 1;
+  ResetStage(out);
+  if (!ReserveStageObstacles(out, stage->rectCount * rects,
+                             stage->circleCount +
+                                 stage->rectCount * corners))
+    return false;
+
+  for (int i = 0; i < stage->rectCount; i++) {
+    Rectangle r = stage->rects[i];
+    if (rects == 1) {
+      out->rects[out->rectCount++] = r;
+      continue;
+    }
+    out->rects[out->rectCount++] =
+        (Rectangle){r.x - radius, r.y, r.width + radius * 2.0f, r.height};
+    out->rects[out->rectCount++] =
+        (Rectangle){r.x, r.y - radius, r.width, r.height + radius * 2.0f};
+  }
+  for (int i = 0; i < stage->circleCount; i++) {
+    out->circlePos[out->circleCount] = stage->circlePos[i];
+    out->circleRadius[out->circleCount] = stage->circleRadius[i] + radius;
+    out->circleCount++;
+  }
+  for (int i = 0; i < stage->rectCount && corners; i++) {
+    Rectangle r = stage->rects[i];
+    Vector2 points[4] = {{r.x, r.y},
+                         {r.x + r.width, r.y},
+                         {r.x, r.y + r.height},
+                         {r.x + r.width, r.y + r.height}};
+    for (int k = 0; k < 4; k++) {
+      out->circlePos[out->circleCount] = points[k];
+      out->circleRadius[out->circleCount] = radius;
+      out->circleCount++;
+    }
+  }
+
+  out->goalPos = stage->goalPos;
+  out->goalRadius = stage->goalRadius + radius;
+  out->hasGoal = stage->hasGoal;
+  float insetX = radius * 2.0f < stage->field.width ? radius
+                                                    : stage->field.width / 2.0f;
+  float insetY = radius * 2.0f < stage->field.height
+                     ? radius
+                     : stage->field.height / 2.0f;
+  out->field = (Rectangle){stage->field.x + insetX, stage->field.y + insetY,
+                           stage->field.width - insetX * 2.0f,
+                           stage->field.height - insetY * 2.0f};
+  out->start = stage->start;
+  out->maxBounces = stage->maxBounces;
+  out->accel = stage->accel;
+  PrepareStage(out);
+  return true;
+}
+
+void InflatedHitSource(const StageData *stage, float radius, int *kind,
+                       int *index) {
+  if (radius <= 0.0f || *index < 0)
+    return;
+  if (*kind == BEAM_HIT_RECT) {
+    *index /= 2;
+  } else if (*kind == BEAM_HIT_CIRCLE && *index >= stage->circleCount) {
+    *kind = BEAM_HIT_RECT;
+    *index = (*index - stage->circleCount) / 4;
+  }
+}
@@ -0,0 +1,240 @@
+#include "beamtrace.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BEAM_LUT_MAGIC "BEAMLUT2"
+
+// On-disk layout: this header followed by size BeamOutcome entries, in host
+// byte order. The cache is a local artifact, not an interchange format.
+typedef struct BeamLutHeader {
+  char magic[8];
+  unsigned long long stageHash;
+  int size;
+  int maxBounces;
+  float maxLength;
+  int stopLoops;
+  int entrySize;
+} BeamLutHeader;
+
+typedef struct LutJob {
+  const StageData *stage;
+  int size;
+  int maxBounces;
+  float maxLength;
+  BeamOutcome *entries;
+} LutJob;
+
+static void HashBytes(unsigned long long *hash, const void *data,
+                      size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    *hash ^= bytes[i];
+    *hash *= 1099511628211ULL;
+  }
+}
+
+static void HashFloat(unsigned long long *hash, float v) {
+  HashBytes(hash, &v, sizeof(v));
+}
+
+static void HashInt(unsigned long long *hash, int v) {
+  HashBytes(hash, &v, sizeof(v));
+}
+
+unsigned long long StageContentHash(const StageData *stage) {
+  unsigned long long hash = 1469598103934665603ULL;
+  HashInt(&hash, stage->rectCount);
+  for (int i = 0; i < stage->rectCount; i++) {
+    HashFloat(&hash, stage->rects[i].x);
+    HashFloat(&hash, stage->rects[i].y);
+    HashFloat(&hash, stage->rects[i].width);
+    HashFloat(&hash, stage->rects[i].height);
+  }
+  HashInt(&hash, stage->circleCount);
+  for (int i = 0; i < stage->circleCount; i++) {
+    HashFloat(&hash, stage->circlePos[i].x);
+    HashFloat(&hash, stage->circlePos[i].y);
+    HashFloat(&hash, stage->circleRadius[i]);
+  }
+  HashInt(&hash, stage->hasGoal ? 1 : 0);
+  if (stage->hasGoal) {
+    HashFloat(&hash, stage->goalPos.x);
+    HashFloat(&hash, stage->goalPos.y);
+    HashFloat(&hash, stage->goalRadius);
+  }
+  HashFloat(&hash, stage->field.x);
+  HashFloat(&hash, stage->field.y);
+  HashFloat(&hash, stage->field.width);
+  HashFloat(&hash, stage->field.height);
+  HashFloat(&hash, stage->start.x);
+  HashFloat(&hash, stage->start.y);
+  return hash;
+}
+
+float BeamLutAngle(int i, int size) {
+  return (float)(-M_PI + 2.0 * M_PI * (double)i / (double)size);
+}
+
+static void FillRange(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  LutJob *job = ctx;
+  BeamPath paths[BEAM_PACKET_MAX] = {0};
+  Vector2 dirs[BEAM_PACKET_MAX];
+  for (int i = begin; i < end; i += BEAM_PACKET_MAX) {
+    int count = end - i < BEAM_PACKET_MAX ? end - i : BEAM_PACKET_MAX;
+    for (int l = 0; l < count; l++) {
+      float angle = BeamLutAngle(i + l, job->size);
+      dirs[l] = (Vector2){cosf(angle), sinf(angle)};
+    }
+    TraceBeamPacket(job->stage, job->stage->start, dirs, count,
+                    job->maxBounces, job->maxLength, paths);
+    for (int l = 0; l < count; l++) {
+      const BeamPath *path = &paths[l];
+      BeamOutcome *out = &job->entries[i + l];
+      *out = (BeamOutcome){-1, BEAM_HIT_NONE, 0, 0};
+      if (path->segmentCount > 0) {
+        out->firstKind = (unsigned char)path->segments[0].hitKind;
+        out->firstIndex = path->segments[0].hitIndex;
+      }
+      out->hitGoal = path->hitGoal ? 1 : 0;
+      out->bounces = (unsigned short)(path->segmentCount > 0
+                                          ? path->segmentCount - 1
+                                          : 0);
+    }
+  }
+  for (int l = 0; l < BEAM_PACKET_MAX; l++)
+    UnloadBeamPath(&paths[l]);
+}
+
+static bool MapCache(const char *path, unsigned long long hash, int size,
+                     int maxBounces, float maxLength, BeamLut *lut) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  size_t expected =
+      sizeof(BeamLutHeader) + sizeof(BeamOutcome) * (size_t)size;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != expected) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const BeamLutHeader *header = map;
+  if (memcmp(header->magic, BEAM_LUT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->stageHash != hash || header->size != size ||
+      header->maxBounces != maxBounces || header->maxLength != maxLength ||
+      header->stopLoops != lut->stopLoops ||
+      header->entrySize != (int)sizeof(BeamOutcome)) {
+    munmap(map, expected);
+    return false;
+  }
+  lut->entries = (const BeamOutcome *)(header + 1);
+  lut->mapping = map;
+  lut->mappingSize = expected;
+  lut->cached = true;
+  return true;
+}
+
+// Writes to a temporary name and renames it into place so a concurrent
+// reader never maps a half-written table.
+static bool WriteCache(const char *path, const BeamLut *lut) {
+  size_t length = strlen(path);
+  char *temp = malloc(length + 16);
+  if (!temp)
+    return false;
+  snprintf(temp, length + 16, "%s.%ld.tmp", path, (long)getpid());
+
+  FILE *file = fopen(temp, "wb");
+  if (!file) {
+    free(temp);
+    return false;
+  }
+  BeamLutHeader header = {{0}, lut->stageHash, lut->size, lut->maxBounces,
+                          lut->maxLength, lut->stopLoops,
+                          (int)sizeof(BeamOutcome)};
+  memcpy(header.magic, BEAM_LUT_MAGIC, sizeof(header.magic));
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(lut->entries, sizeof(BeamOutcome), (size_t)lut->size,
+                   file) == (size_t)lut->size;
+  ok = fclose(file) == 0 && ok;
+  if (ok)
+    ok = rename(temp, path) == 0;
+  if (!ok)
+    remove(temp);
+  free(temp);
+  return ok;
+}
+
+bool LoadBeamLut(const char *stagePath, const StageData *stage, int size,
+                 int maxBounces, float maxLength, BeamPool *pool,
+                 BeamLut *lut) {
+  UnloadBeamLut(lut);
+  if (size < 1)
+    return false;
+  unsigned long long hash = StageContentHash(stage);
+  *lut = (BeamLut){.size = size,
+                   .maxBounces = maxBounces,
+                   .maxLength = maxLength,
+                   .stopLoops = stage->stopLoops,
+                   .stageHash = hash};
+
+  char *cachePath = NULL;
+  if (stagePath) {
+    size_t length = strlen(stagePath) + 24;
+    cachePath = malloc(length);
+    if (cachePath) {
+      snprintf(cachePath, length, "%s.%d.lut", stagePath, size);
+      if (MapCache(cachePath, hash, size, maxBounces, maxLength, lut)) {
+        free(cachePath);
+        return true;
+      }
+    }
+  }
+
+  BeamOutcome *entries = malloc(sizeof(BeamOutcome) * (size_t)size);
+  if (!entries) {
+    free(cachePath);
+    *lut = (BeamLut){0};
+    return false;
+  }
+  LutJob job = {stage, size, maxBounces, maxLength, entries};
+  if (pool)
+    RunBeamPool(pool, size, 1024, FillRange, &job);
+  else
+    FillRange(&job, 0, size, 0);
+  lut->entries = entries;
+  lut->owned = entries;
+
+  // A read-only stage directory just means the table is rebuilt next time.
+  if (cachePath)
+    WriteCache(cachePath, lut);
+  free(cachePath);
+  return true;
+}
+
+void UnloadBeamLut(BeamLut *lut) {
+  if (lut->mapping)
+    munmap(lut->mapping, lut->mappingSize);
+  free(lut->owned);
+  *lut = (BeamLut){0};
+}
+
+BeamOutcome LookupBeamLut(const BeamLut *lut, float angle) {
+  if (!lut->entries)
+    return (BeamOutcome){-1, BEAM_HIT_NONE, 0, 0};
+  double f = ((double)angle + M_PI) / (2.0 * M_PI) * (double)lut->size;
+  long i = lround(f) % lut->size;
+  if (i < 0)
+    i += lut->size;
+  return lut->entries[i];
+}
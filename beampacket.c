@@ -0,0 +1,468 @@
+#include "beamtrace.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BEAM_HAVE_X86 1
+#endif
+
+#ifdef BEAM_HAVE_X86
+
+#define PACKET_GROUPS (BEAM_PACKET_MAX / 4)
+#define PACKET_STACK_SIZE 64
+
+// One closest-hit query per lane. t holds each lane's limit on entry and its
+// best hit afterwards; rank uses StageBvhClosestHit's numbering (-2 for the
+// limit, -1 for a wall, then obstacle ids).
+typedef struct PacketLanes {
+  _Alignas(16) float px[BEAM_PACKET_MAX];
+  _Alignas(16) float py[BEAM_PACKET_MAX];
+  _Alignas(16) float dx[BEAM_PACKET_MAX];
+  _Alignas(16) float dy[BEAM_PACKET_MAX];
+  _Alignas(16) float t[BEAM_PACKET_MAX];
+  _Alignas(16) float nx[BEAM_PACKET_MAX];
+  _Alignas(16) float ny[BEAM_PACKET_MAX];
+  _Alignas(16) int rank[BEAM_PACKET_MAX];
+} PacketLanes;
+
+typedef struct PacketEntry {
+  int node;
+  int mask;
+  float entry[BEAM_PACKET_MAX];
+} PacketEntry;
+
+typedef struct LaneState {
+  Vector2 pos;
+  Vector2 dir;
+  float remaining;
+  float traveled;
+  int bounces;
+  BeamLoop loop;
+} LaneState;
+
+__attribute__((target("sse2"))) static inline __m128 Select(__m128 mask,
+                                                             __m128 a,
+                                                             __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__attribute__((target("sse2"))) static inline __m128 GroupMask(int bits) {
+  return _mm_castsi128_ps(_mm_set_epi32(-((bits >> 3) & 1), -((bits >> 2) & 1),
+                                        -((bits >> 1) & 1), -(bits & 1)));
+}
+
+// RayNodeEntry for every lane in mask, with each lane's current best as its
+// limit. Returns the lanes that may have a closer hit inside the node.
+__attribute__((target("sse2"))) static int
+NodeLanes(const PacketLanes *r, int mask, const StageBvhNode *node,
+          float *entry) {
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 eps = _mm_set1_ps(0.0001f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 inf = _mm_set1_ps(INFINITY);
+  const __m128 minX = _mm_set1_ps(node->minX);
+  const __m128 minY = _mm_set1_ps(node->minY);
+  const __m128 maxX = _mm_set1_ps(node->maxX);
+  const __m128 maxY = _mm_set1_ps(node->maxY);
+  int out = 0;
+  for (int g = 0; g < PACKET_GROUPS; g++) {
+    int bits = (mask >> (g * 4)) & 15;
+    if (!bits)
+      continue;
+    __m128 px = _mm_load_ps(r->px + g * 4);
+    __m128 py = _mm_load_ps(r->py + g * 4);
+    __m128 dx = _mm_load_ps(r->dx + g * 4);
+    __m128 dy = _mm_load_ps(r->dy + g * 4);
+    __m128 limit = _mm_load_ps(r->t + g * 4);
+    __m128 drift = _mm_mul_ps(eps, limit);
+
+    __m128 parX = _mm_cmplt_ps(_mm_and_ps(dx, absMask), eps);
+    __m128 outX = _mm_or_ps(_mm_cmplt_ps(px, _mm_sub_ps(minX, drift)),
+                            _mm_cmpgt_ps(px, _mm_add_ps(maxX, drift)));
+    __m128 tx1 = _mm_div_ps(_mm_sub_ps(minX, px), dx);
+    __m128 tx2 = _mm_div_ps(_mm_sub_ps(maxX, px), dx);
+    __m128 tmin = Select(parX, zero, _mm_max_ps(_mm_min_ps(tx1, tx2), zero));
+    __m128 tmax = Select(parX, inf, _mm_min_ps(_mm_max_ps(tx1, tx2), inf));
+
+    __m128 parY = _mm_cmplt_ps(_mm_and_ps(dy, absMask), eps);
+    __m128 outY = _mm_or_ps(_mm_cmplt_ps(py, _mm_sub_ps(minY, drift)),
+                            _mm_cmpgt_ps(py, _mm_add_ps(maxY, drift)));
+    __m128 ty1 = _mm_div_ps(_mm_sub_ps(minY, py), dy);
+    __m128 ty2 = _mm_div_ps(_mm_sub_ps(maxY, py), dy);
+    tmin = Select(parY, tmin, _mm_max_ps(_mm_min_ps(ty1, ty2), tmin));
+    tmax = Select(parY, tmax, _mm_min_ps(_mm_max_ps(ty1, ty2), tmax));
+
+    __m128 miss = _mm_or_ps(_mm_and_ps(parX, outX), _mm_and_ps(parY, outY));
+    miss = _mm_or_ps(miss, _mm_cmplt_ps(tmax, tmin));
+    miss = _mm_or_ps(miss, _mm_cmpgt_ps(tmin, limit));
+    _mm_storeu_ps(entry + g * 4, tmin);
+    out |= (~_mm_movemask_ps(miss) & bits) << (g * 4);
+  }
+  return out;
+}
+
+// RayIntersectRect across lanes, keeping each lane's best under the
+// scan-order tie rule.
+__attribute__((target("sse2"))) static void
+RectLanes(PacketLanes *r, int mask, Rectangle rect, int id) {
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 eps = _mm_set1_ps(0.0001f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 minusOne = _mm_set1_ps(-1.0f);
+  const __m128 inf = _mm_set1_ps(INFINITY);
+  const __m128 negInf = _mm_set1_ps(-INFINITY);
+  const __m128 x1 = _mm_set1_ps(rect.x);
+  const __m128 y1 = _mm_set1_ps(rect.y);
+  const __m128 x2 = _mm_set1_ps(rect.x + rect.width);
+  const __m128 y2 = _mm_set1_ps(rect.y + rect.height);
+  const __m128i idv = _mm_set1_epi32(id);
+  for (int g = 0; g < PACKET_GROUPS; g++) {
+    int bits = (mask >> (g * 4)) & 15;
+    if (!bits)
+      continue;
+    __m128 px = _mm_load_ps(r->px + g * 4);
+    __m128 py = _mm_load_ps(r->py + g * 4);
+    __m128 dx = _mm_load_ps(r->dx + g * 4);
+    __m128 dy = _mm_load_ps(r->dy + g * 4);
+
+    __m128 inside = _mm_and_ps(
+        _mm_and_ps(_mm_cmpgt_ps(px, x1), _mm_cmplt_ps(px, x2)),
+        _mm_and_ps(_mm_cmpgt_ps(py, y1), _mm_cmplt_ps(py, y2)));
+
+    __m128 parX = _mm_cmplt_ps(_mm_and_ps(dx, absMask), eps);
+    __m128 outX = _mm_or_ps(_mm_cmplt_ps(px, x1), _mm_cmpgt_ps(px, x2));
+    __m128 tx1 = _mm_div_ps(_mm_sub_ps(x1, px), dx);
+    __m128 tx2 = _mm_div_ps(_mm_sub_ps(x2, px), dx);
+    __m128 ltX = _mm_cmplt_ps(tx1, tx2);
+    __m128 entryX = Select(ltX, tx1, tx2);
+    __m128 exitX = Select(ltX, tx2, tx1);
+    __m128 takeX = _mm_andnot_ps(parX, _mm_cmpgt_ps(entryX, negInf));
+    __m128 tmin = Select(takeX, entryX, negInf);
+    __m128 nx = _mm_and_ps(takeX, Select(ltX, minusOne, one));
+    __m128 tmax = Select(_mm_andnot_ps(parX, _mm_cmplt_ps(exitX, inf)), exitX,
+                         inf);
+
+    __m128 parY = _mm_cmplt_ps(_mm_and_ps(dy, absMask), eps);
+    __m128 outY = _mm_or_ps(_mm_cmplt_ps(py, y1), _mm_cmpgt_ps(py, y2));
+    __m128 ty1 = _mm_div_ps(_mm_sub_ps(y1, py), dy);
+    __m128 ty2 = _mm_div_ps(_mm_sub_ps(y2, py), dy);
+    __m128 ltY = _mm_cmplt_ps(ty1, ty2);
+    __m128 entryY = Select(ltY, ty1, ty2);
+    __m128 exitY = Select(ltY, ty2, ty1);
+    __m128 takeY = _mm_andnot_ps(parY, _mm_cmpgt_ps(entryY, tmin));
+    tmin = Select(takeY, entryY, tmin);
+    nx = _mm_andnot_ps(takeY, nx);
+    __m128 ny = _mm_and_ps(takeY, Select(ltY, minusOne, one));
+    tmax = Select(_mm_andnot_ps(parY, _mm_cmplt_ps(exitY, tmax)), exitY, tmax);
+
+    __m128 miss = _mm_or_ps(inside, _mm_or_ps(_mm_and_ps(parX, outX),
+                                              _mm_and_ps(parY, outY)));
+    miss = _mm_or_ps(miss, _mm_cmplt_ps(tmax, tmin));
+    miss = _mm_or_ps(miss, _mm_cmplt_ps(tmax, zero));
+    miss = _mm_or_ps(miss, _mm_cmplt_ps(tmin, eps));
+
+    __m128 best = _mm_load_ps(r->t + g * 4);
+    __m128i rank = _mm_load_si128((const __m128i *)(r->rank + g * 4));
+    __m128 tie = _mm_and_ps(_mm_cmpeq_ps(tmin, best),
+                            _mm_castsi128_ps(_mm_cmplt_epi32(idv, rank)));
+    __m128 take = _mm_or_ps(_mm_cmplt_ps(tmin, best), tie);
+    take = _mm_and_ps(_mm_andnot_ps(miss, take), GroupMask(bits));
+    _mm_store_ps(r->t + g * 4, Select(take, tmin, best));
+    _mm_store_ps(r->nx + g * 4, Select(take, nx, _mm_load_ps(r->nx + g * 4)));
+    _mm_store_ps(r->ny + g * 4, Select(take, ny, _mm_load_ps(r->ny + g * 4)));
+    __m128i takei = _mm_castps_si128(take);
+    _mm_store_si128((__m128i *)(r->rank + g * 4),
+                    _mm_or_si128(_mm_and_si128(takei, idv),
+                                 _mm_andnot_si128(takei, rank)));
+  }
+}
+
+// RayIntersectCircle across lanes. Only t is tracked; the winner's normal is
+// computed afterwards exactly as RayIntersectCircle does.
+__attribute__((target("sse2"))) static void
+CircleLanes(PacketLanes *r, int mask, Vector2 center, float radius, int id) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 signBit = _mm_set1_ps(-0.0f);
+  const __m128 cx = _mm_set1_ps(center.x);
+  const __m128 cy = _mm_set1_ps(center.y);
+  const float rr = radius * radius;
+  const __m128 r2 = _mm_set1_ps(rr);
+  const __m128 slack = _mm_set1_ps(-0.0001f * rr);
+  const __m128i idv = _mm_set1_epi32(id);
+  for (int g = 0; g < PACKET_GROUPS; g++) {
+    int bits = (mask >> (g * 4)) & 15;
+    if (!bits)
+      continue;
+    __m128 mx = _mm_sub_ps(_mm_load_ps(r->px + g * 4), cx);
+    __m128 my = _mm_sub_ps(_mm_load_ps(r->py + g * 4), cy);
+    __m128 b = _mm_add_ps(_mm_mul_ps(mx, _mm_load_ps(r->dx + g * 4)),
+                          _mm_mul_ps(my, _mm_load_ps(r->dy + g * 4)));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(mx, mx), _mm_mul_ps(my, my)),
+                          r2);
+    __m128 miss =
+        _mm_and_ps(_mm_cmpgt_ps(b, zero), _mm_cmpgt_ps(c, slack));
+    __m128 discr = _mm_sub_ps(_mm_mul_ps(b, b), c);
+    miss = _mm_or_ps(miss, _mm_cmplt_ps(discr, zero));
+    __m128 t = _mm_sub_ps(_mm_xor_ps(b, signBit), _mm_sqrt_ps(discr));
+    t = Select(_mm_cmplt_ps(t, zero), zero, t);
+
+    __m128 best = _mm_load_ps(r->t + g * 4);
+    __m128i rank = _mm_load_si128((const __m128i *)(r->rank + g * 4));
+    __m128 tie = _mm_and_ps(_mm_cmpeq_ps(t, best),
+                            _mm_castsi128_ps(_mm_cmplt_epi32(idv, rank)));
+    __m128 take = _mm_or_ps(_mm_cmplt_ps(t, best), tie);
+    take = _mm_and_ps(_mm_andnot_ps(miss, take), GroupMask(bits));
+    _mm_store_ps(r->t + g * 4, Select(take, t, best));
+    __m128i takei = _mm_castps_si128(take);
+    _mm_store_si128((__m128i *)(r->rank + g * 4),
+                    _mm_or_si128(_mm_and_si128(takei, idv),
+                                 _mm_andnot_si128(takei, rank)));
+  }
+}
+
+static int LowestLane(int mask) { return __builtin_ctz((unsigned)mask); }
+
+// StageBvhClosestHit for a packet: one traversal serves every lane, a node is
+// entered when any lane may hit inside it, and lanes that miss it are masked
+// off below. Each lane ends with the same winner a single-ray query finds.
+static void PacketClosestObstacle(const StageData *stage, PacketLanes *r,
+                                  int live) {
+  const StageBvh *bvh = &stage->bvh;
+  PacketEntry stack[PACKET_STACK_SIZE];
+  int top = 0;
+  // Counted per lane, as if each ray had been traced alone.
+  long long nodeTests = __builtin_popcount(live);
+  long long obstacleTests = 0;
+  int mask = NodeLanes(r, live, &bvh->nodes[0], stack[0].entry);
+  if (mask) {
+    stack[0].node = 0;
+    stack[0].mask = mask;
+    top = 1;
+  }
+
+  while (top > 0) {
+    PacketEntry *e = &stack[--top];
+    mask = 0;
+    for (int m = e->mask; m; m &= m - 1) {
+      int l = LowestLane(m);
+      if (!(e->entry[l] > r->t[l]))
+        mask |= 1 << l;
+    }
+    if (!mask)
+      continue;
+    const StageBvhNode *node = &bvh->nodes[e->node];
+
+    if (node->count > 0) {
+      obstacleTests += (long long)node->count * __builtin_popcount(mask);
+      for (int i = node->first; i < node->first + node->count; i++) {
+        int id = bvh->prims[i];
+        if (id < stage->rectCount) {
+          RectLanes(r, mask, stage->rects[id], id);
+        } else {
+          int c = id - stage->rectCount;
+          CircleLanes(r, mask, stage->circlePos[c], stage->circleRadius[c], id);
+        }
+      }
+      continue;
+    }
+
+    // The popped entry is reused for one child, so test both first.
+    nodeTests += 2 * __builtin_popcount(mask);
+    int first = node->first;
+    float leftEntry[BEAM_PACKET_MAX];
+    float rightEntry[BEAM_PACKET_MAX];
+    int leftMask = NodeLanes(r, mask, &bvh->nodes[first], leftEntry);
+    int rightMask = NodeLanes(r, mask, &bvh->nodes[first + 1], rightEntry);
+    // Visit first the child that is nearer for the lowest lane entering both.
+    bool leftFirst = true;
+    if (leftMask & rightMask) {
+      int l = LowestLane(leftMask & rightMask);
+      leftFirst = leftEntry[l] <= rightEntry[l];
+    } else if (rightMask) {
+      leftFirst = false;
+    }
+    int order[2] = {leftFirst ? 1 : 0, leftFirst ? 0 : 1};
+    for (int k = 0; k < 2; k++) {
+      int child = order[k];
+      int childMask = child == 0 ? leftMask : rightMask;
+      if (!childMask)
+        continue;
+      PacketEntry *push = &stack[top++];
+      push->node = first + child;
+      push->mask = childMask;
+      const float *src = child == 0 ? leftEntry : rightEntry;
+      for (int l = 0; l < BEAM_PACKET_MAX; l++)
+        push->entry[l] = src[l];
+    }
+  }
+  if (stage->stats) {
+    stage->stats->nodeTests += nodeTests;
+    stage->stats->obstacleTests += obstacleTests;
+  }
+}
+
+void TraceBeamPacket(const StageData *stage, Vector2 origin,
+                     const Vector2 *dirs, int count, int maxBounces,
+                     float maxLength, BeamPath *paths) {
+  if (count > BEAM_PACKET_MAX)
+    count = BEAM_PACKET_MAX;
+  // Without a BVH the single-ray fallbacks are already the best option.
+  if (stage->bvh.nodeCount == 0 && stage->rectCount + stage->circleCount > 0) {
+    for (int l = 0; l < count; l++)
+      TraceBeam(stage, origin, dirs[l], maxBounces, maxLength, &paths[l]);
+    return;
+  }
+
+  PacketLanes r;
+  LaneState lanes[BEAM_PACKET_MAX];
+  int live = 0;
+  for (int l = 0; l < BEAM_PACKET_MAX; l++) {
+    r.px[l] = r.py[l] = r.dx[l] = r.dy[l] = 0.0f;
+    r.t[l] = r.nx[l] = r.ny[l] = 0.0f;
+    r.rank[l] = -2;
+  }
+  for (int l = 0; l < count; l++) {
+    paths[l].segmentCount = 0;
+    paths[l].hitGoal = false;
+    paths[l].end = BEAM_END_LENGTH;
+    Vector2 dir = dirs[l];
+    float dirLen = sqrtf(dir.x * dir.x + dir.y * dir.y);
+    if (dirLen <= 0.0001f)
+      continue;
+    dir.x /= dirLen;
+    dir.y /= dirLen;
+    lanes[l] = (LaneState){origin, dir, maxLength, 0.0f, 0};
+    ResetBeamLoop(&lanes[l].loop);
+    if (maxBounces < 0)
+      paths[l].end = BEAM_END_BOUNCES;
+    else if (maxLength > 0.0f)
+      live |= 1 << l;
+  }
+
+  const Rectangle field = stage->field;
+  while (live) {
+    for (int m = live; m; m &= m - 1) {
+      int l = LowestLane(m);
+      LaneState *s = &lanes[l];
+      r.px[l] = s->pos.x;
+      r.py[l] = s->pos.y;
+      r.dx[l] = s->dir.x;
+      r.dy[l] = s->dir.y;
+      r.t[l] = s->remaining;
+      r.nx[l] = r.ny[l] = 0.0f;
+      r.rank[l] = -2;
+      float tWall = 0.0f;
+      Vector2 nWall = {0.0f, 0.0f};
+      if (RayIntersectWalls(s->pos, s->dir, field.x, field.x + field.width,
+                            field.y, field.y + field.height, &tWall, &nWall) &&
+          tWall < r.t[l]) {
+        r.t[l] = tWall;
+        r.nx[l] = nWall.x;
+        r.ny[l] = nWall.y;
+        r.rank[l] = -1;
+      }
+    }
+    if (stage->stats)
+      stage->stats->searches += __builtin_popcount(live);
+    if (stage->bvh.nodeCount > 0)
+      PacketClosestObstacle(stage, &r, live);
+
+    for (int m = live; m; m &= m - 1) {
+      int l = LowestLane(m);
+      LaneState *s = &lanes[l];
+      BeamPath *path = &paths[l];
+      BeamHit hit = {r.t[l], {r.nx[l], r.ny[l]}, BEAM_HIT_NONE, -1};
+      int rank = r.rank[l];
+      if (rank == -1) {
+        hit.kind = BEAM_HIT_WALL;
+      } else if (rank >= stage->rectCount) {
+        int c = rank - stage->rectCount;
+        hit.kind = BEAM_HIT_CIRCLE;
+        hit.index = c;
+        Vector2 at = {s->pos.x + s->dir.x * hit.t, s->pos.y + s->dir.y * hit.t};
+        Vector2 n = {at.x - stage->circlePos[c].x, at.y - stage->circlePos[c].y};
+        float len = sqrtf(n.x * n.x + n.y * n.y);
+        if (len > 0.0001f) {
+          n.x /= len;
+          n.y /= len;
+        }
+        hit.normal = n;
+      } else if (rank >= 0) {
+        hit.kind = BEAM_HIT_RECT;
+        hit.index = rank;
+      }
+
+      // The rest mirrors one iteration of TraceBeam.
+      BeamSegment *seg = PushBeamSegment(path);
+      if (!seg) {
+        path->end = BEAM_END_STUCK;
+        live &= ~(1 << l);
+        continue;
+      }
+      seg->start = s->pos;
+      seg->startDist = s->traveled;
+      bool done = false;
+      if (stage->hasGoal) {
+        float tGoal = 0.0f;
+        if (RayIntersectCircle(s->pos, s->dir, stage->goalPos,
+                               stage->goalRadius, &tGoal, NULL) &&
+            tGoal <= hit.t && tGoal <= s->remaining) {
+          seg->end = (Vector2){s->pos.x + s->dir.x * tGoal,
+                               s->pos.y + s->dir.y * tGoal};
+          seg->endDist = s->traveled + tGoal;
+          seg->normal = (Vector2){0.0f, 0.0f};
+          seg->hitKind = BEAM_HIT_GOAL;
+          seg->hitIndex = -1;
+          path->hitGoal = true;
+          path->end = BEAM_END_GOAL;
+          done = true;
+        }
+      }
+      if (!done) {
+        Vector2 hitPos = {s->pos.x + s->dir.x * hit.t,
+                          s->pos.y + s->dir.y * hit.t};
+        s->remaining -= hit.t;
+        s->traveled += hit.t;
+        seg->end = hitPos;
+        seg->endDist = s->traveled;
+        seg->normal = hit.normal;
+        seg->hitKind = hit.kind;
+        seg->hitIndex = hit.index;
+        if (hit.kind == BEAM_HIT_NONE) {
+          done = true;
+        } else if (hit.t <= 0.0001f) {
+          path->end = BEAM_END_STUCK;
+          done = true;
+        } else {
+          float dot = s->dir.x * hit.normal.x + s->dir.y * hit.normal.y;
+          s->dir.x = s->dir.x - 2.0f * dot * hit.normal.x;
+          s->dir.y = s->dir.y - 2.0f * dot * hit.normal.y;
+          s->pos = hitPos;
+          s->bounces++;
+          if (stage->stopLoops && BeamLoopRepeats(&s->loop, seg, s->dir)) {
+            path->end = BEAM_END_LOOP;
+            done = true;
+          }
+        }
+      }
+      if (!done && s->bounces > maxBounces)
+        path->end = BEAM_END_BOUNCES;
+      if (done || !(s->remaining > 0.0f) || s->bounces > maxBounces)
+        live &= ~(1 << l);
+    }
+  }
+}
+
+#else
+
+void TraceBeamPacket(const StageData *stage, Vector2 origin,
+                     const Vector2 *dirs, int count, int maxBounces,
+                     float maxLength, BeamPath *paths) {
+  if (count > BEAM_PACKET_MAX)
+    count = BEAM_PACKET_MAX;
+  for (int l = 0; l < count; l++)
+    TraceBeam(stage, origin, dirs[l], maxBounces, maxLength, &paths[l]);
+}
+
+#endif
@@ -0,0 +1,312 @@
+#include "beamtrace.h"
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BEAM_PLUGIN_VERSION 1
+#define BEAM_PLUGIN_SYMBOL "beamStagePlugin"
+
+// What a plugin exports under BEAM_PLUGIN_SYMBOL. The generated source
+// declares its own copy, so the layout may only change with the version.
+typedef struct BeamStagePlugin {
+  int version;
+  unsigned long long stageHash;
+  int rectCount;
+  int circleCount;
+  StageObstacleFn closestHit;
+} BeamStagePlugin;
+
+// The stage's BVH becomes one function per node with the child boxes as
+// constants, visiting the near child first by the sign of the ray along the
+// split. Box tests multiply by the ray's reciprocals and are only used to
+// cull, against boxes padded well past the reciprocals' rounding error. The
+// obstacle tests at the leaves are RayIntersectRect/RayIntersectCircle with
+// constant bounds, so hits are bit-identical to STAGE_ACCEL_BRUTE; ties go
+// to the lower scan rank as in StageBvhClosestHit.
+static const char *pluginPrologue =
+    "#include <math.h>\n"
+    "\n"
+    "typedef struct Vector2 {\n"
+    "  float x;\n"
+    "  float y;\n"
+    "} Vector2;\n"
+    "\n"
+    "typedef struct BeamHit {\n"
+    "  float t;\n"
+    "  Vector2 normal;\n"
+    "  int kind;\n"
+    "  int index;\n"
+    "} BeamHit;\n"
+    "\n"
+    "typedef struct BeamStagePlugin {\n"
+    "  int version;\n"
+    "  unsigned long long stageHash;\n"
+    "  int rectCount;\n"
+    "  int circleCount;\n"
+    "  void (*closestHit)(Vector2 pos, Vector2 dir, BeamHit *hit);\n"
+    "} BeamStagePlugin;\n"
+    "\n"
+    "typedef struct Ray {\n"
+    "  Vector2 pos;\n"
+    "  Vector2 dir;\n"
+    "  Vector2 inv;\n"
+    "  int parallelX;\n"
+    "  int parallelY;\n"
+    "  int rank; // scan rank of the current best, -1 a wall, -2 none\n"
+    "} Ray;\n"
+    "\n"
+    "#define INLINE static inline __attribute__((always_inline))\n"
+    "\n"
+    "INLINE int Box(const Ray *ray, float minX, float minY, float maxX,\n"
+    "               float maxY, float limit) {\n"
+    "  float tmin = 0.0f;\n"
+    "  float tmax = INFINITY;\n"
+    "  if (ray->parallelX) {\n"
+    "    float drift = 0.0001f * limit;\n"
+    "    if (ray->pos.x < minX - drift || ray->pos.x > maxX + drift)\n"
+    "      return 0;\n"
+    "  } else {\n"
+    "    float t1 = (minX - ray->pos.x) * ray->inv.x;\n"
+    "    float t2 = (maxX - ray->pos.x) * ray->inv.x;\n"
+    "    float entry = t1 < t2 ? t1 : t2;\n"
+    "    float exit = t1 < t2 ? t2 : t1;\n"
+    "    tmin = entry > tmin ? entry : tmin;\n"
+    "    tmax = exit < tmax ? exit : tmax;\n"
+    "  }\n"
+    "  if (ray->parallelY) {\n"
+    "    float drift = 0.0001f * limit;\n"
+    "    if (ray->pos.y < minY - drift || ray->pos.y > maxY + drift)\n"
+    "      return 0;\n"
+    "  } else {\n"
+    "    float t1 = (minY - ray->pos.y) * ray->inv.y;\n"
+    "    float t2 = (maxY - ray->pos.y) * ray->inv.y;\n"
+    "    float entry = t1 < t2 ? t1 : t2;\n"
+    "    float exit = t1 < t2 ? t2 : t1;\n"
+    "    tmin = entry > tmin ? entry : tmin;\n"
+    "    tmax = exit < tmax ? exit : tmax;\n"
+    "  }\n"
+    "  return tmax >= tmin && tmin <= limit;\n"
+    "}\n"
+    "\n"
+    "INLINE int Closer(const Ray *ray, const BeamHit *hit, float t, int "
+    "rank) {\n"
+    "  return t < hit->t || (t == hit->t && rank < ray->rank);\n"
+    "}\n"
+    "\n"
+    "INLINE void Rect(int rank, float x1, float y1, float x2, float y2,\n"
+    "                 Ray *ray, BeamHit *hit) {\n"
+    "  Vector2 pos = ray->pos;\n"
+    "  Vector2 dir = ray->dir;\n"
+    "  if (pos.x > x1 && pos.x < x2 && pos.y > y1 && pos.y < y2)\n"
+    "    return;\n"
+    "  float tmin = -INFINITY;\n"
+    "  float tmax = INFINITY;\n"
+    "  Vector2 n = {0.0f, 0.0f};\n"
+    "  if (ray->parallelX) {\n"
+    "    if (pos.x < x1 || pos.x > x2)\n"
+    "      return;\n"
+    "  } else {\n"
+    "    float t1 = (x1 - pos.x) / dir.x;\n"
+    "    float t2 = (x2 - pos.x) / dir.x;\n"
+    "    tmin = t1 < t2 ? t1 : t2;\n"
+    "    tmax = t1 < t2 ? t2 : t1;\n"
+    "    n = t1 < t2 ? (Vector2){-1.0f, 0.0f} : (Vector2){1.0f, 0.0f};\n"
+    "  }\n"
+    "  if (ray->parallelY) {\n"
+    "    if (pos.y < y1 || pos.y > y2)\n"
+    "      return;\n"
+    "  } else {\n"
+    "    float t1 = (y1 - pos.y) / dir.y;\n"
+    "    float t2 = (y2 - pos.y) / dir.y;\n"
+    "    float entry = t1 < t2 ? t1 : t2;\n"
+    "    float exit = t1 < t2 ? t2 : t1;\n"
+    "    if (entry > tmin) {\n"
+    "      tmin = entry;\n"
+    "      n = t1 < t2 ? (Vector2){0.0f, -1.0f} : (Vector2){0.0f, 1.0f};\n"
+    "    }\n"
+    "    if (exit < tmax)\n"
+    "      tmax = exit;\n"
+    "  }\n"
+    "  if (tmax < tmin || tmax < 0.0f || tmin < 0.0001f ||\n"
+    "      !Closer(ray, hit, tmin, rank))\n"
+    "    return;\n"
+    "  hit->t = tmin;\n"
+    "  hit->normal = n;\n"
+    "  hit->kind = %d;\n"
+    "  hit->index = rank;\n"
+    "  ray->rank = rank;\n"
+    "}\n"
+    "\n"
+    "INLINE void Circle(int rank, int index, float cx, float cy, float r2,\n"
+    "                   float leave, Ray *ray, BeamHit *hit) {\n"
+    "  Vector2 pos = ray->pos;\n"
+    "  Vector2 dir = ray->dir;\n"
+    "  float mx = pos.x - cx;\n"
+    "  float my = pos.y - cy;\n"
+    "  float b = mx * dir.x + my * dir.y;\n"
+    "  float c = mx * mx + my * my - r2;\n"
+    "  if (b > 0.0f && c > leave)\n"
+    "    return;\n"
+    "  float discr = b * b - c;\n"
+    "  if (discr < 0.0f)\n"
+    "    return;\n"
+    "  float t = -b - sqrtf(discr);\n"
+    "  if (t < 0.0f)\n"
+    "    t = 0.0f;\n"
+    "  if (!Closer(ray, hit, t, rank))\n"
+    "    return;\n"
+    "  Vector2 at = {pos.x + dir.x * t, pos.y + dir.y * t};\n"
+    "  Vector2 n = {at.x - cx, at.y - cy};\n"
+    "  float len = sqrtf(n.x * n.x + n.y * n.y);\n"
+    "  if (len > 0.0001f) {\n"
+    "    n.x /= len;\n"
+    "    n.y /= len;\n"
+    "  }\n"
+    "  hit->t = t;\n"
+    "  hit->normal = n;\n"
+    "  hit->kind = %d;\n"
+    "  hit->index = index;\n"
+    "  ray->rank = rank;\n"
+    "}\n";
+
+// Widens a box bound by far more than the reciprocal slab test's rounding.
+static float PadBound(float v, float sign) {
+  return v + sign * (0.01f + fabsf(v) * 1e-5f);
+}
+
+static bool WriteBox(FILE *file, const StageBvhNode *node) {
+  return fprintf(file, "%af, %af, %af, %af",
+                 (double)PadBound(node->minX, -1.0f),
+                 (double)PadBound(node->minY, -1.0f),
+                 (double)PadBound(node->maxX, 1.0f),
+                 (double)PadBound(node->maxY, 1.0f)) > 0;
+}
+
+static bool WriteLeaf(FILE *file, const StageData *stage,
+                      const StageBvhNode *node) {
+  bool ok = true;
+  for (int i = node->first; ok && i < node->first + node->count; i++) {
+    int id = stage->bvh.prims[i];
+    if (id < stage->rectCount) {
+      Rectangle r = stage->rects[id];
+      ok = fprintf(file, "  Rect(%d, %af, %af, %af, %af, ray, hit);\n", id,
+                   (double)r.x, (double)r.y, (double)(r.x + r.width),
+                   (double)(r.y + r.height)) > 0;
+    } else {
+      int c = id - stage->rectCount;
+      float radius = stage->circleRadius[c];
+      float r2 = radius * radius;
+      ok = fprintf(file, "  Circle(%d, %d, %af, %af, %af, %af, ray, hit);\n",
+                   id, c, (double)stage->circlePos[c].x,
+                   (double)stage->circlePos[c].y, (double)r2,
+                   (double)(-0.0001f * r2)) > 0;
+    }
+  }
+  return ok;
+}
+
+// Visits one child if the ray enters its box within the current best.
+static bool WriteVisit(FILE *file, const StageBvh *bvh, int child,
+                       const char *indent) {
+  return fprintf(file, "%sif (Box(ray, ", indent) > 0 &&
+         WriteBox(file, &bvh->nodes[child]) &&
+         fprintf(file, ", hit->t))\n%s  Node%d(ray, hit);\n", indent,
+                 child) > 0;
+}
+
+// Children are written before their parent so every call is to a function
+// already defined.
+static bool WriteNode(FILE *file, const StageData *stage, int index) {
+  const StageBvh *bvh = &stage->bvh;
+  const StageBvhNode *node = &bvh->nodes[index];
+  if (node->count > 0)
+    return fprintf(file, "\nstatic void Node%d(Ray *ray, BeamHit *hit) {\n",
+                   index) > 0 &&
+           WriteLeaf(file, stage, node) && fprintf(file, "}\n") > 0;
+
+  int left = node->first;
+  int right = node->first + 1;
+  if (!WriteNode(file, stage, left) || !WriteNode(file, stage, right))
+    return false;
+  const StageBvhNode *a = &bvh->nodes[left];
+  const StageBvhNode *b = &bvh->nodes[right];
+  float dx = (b->minX + b->maxX) - (a->minX + a->maxX);
+  float dy = (b->minY + b->maxY) - (a->minY + a->maxY);
+  bool alongX = fabsf(dx) >= fabsf(dy);
+  return fprintf(file,
+                 "\nstatic void Node%d(Ray *ray, BeamHit *hit) {\n"
+                 "  if (ray->dir.%c %s 0.0f) {\n",
+                 index, alongX ? 'x' : 'y',
+                 (alongX ? dx : dy) >= 0.0f ? ">=" : "<") > 0 &&
+         WriteVisit(file, bvh, left, "    ") &&
+         WriteVisit(file, bvh, right, "    ") &&
+         fprintf(file, "  } else {\n") > 0 &&
+         WriteVisit(file, bvh, right, "    ") &&
+         WriteVisit(file, bvh, left, "    ") && fprintf(file, "  }\n}\n") > 0;
+}
+
+bool ExportStageSource(const StageData *stage, const char *path) {
+  int obstacles = stage->rectCount + stage->circleCount;
+  if (obstacles > 0 && stage->bvh.nodeCount == 0)
+    return false;
+  FILE *file = fopen(path, "w");
+  if (!file)
+    return false;
+  bool ok = fprintf(file,
+                    "// Closest-obstacle search for one stage, %d rects and "
+                    "%d circles.\n// Generated by ExportStageSource; rebuild "
+                    "rather than edit.\n",
+                    stage->rectCount, stage->circleCount) > 0 &&
+            fprintf(file, pluginPrologue, BEAM_HIT_RECT, BEAM_HIT_CIRCLE) > 0;
+  if (obstacles > 0)
+    ok = ok && WriteNode(file, stage, 0);
+
+  ok = ok &&
+       fprintf(file,
+               "\nstatic void ClosestHit(Vector2 pos, Vector2 dir, "
+               "BeamHit *hit) {\n"
+               "  Ray state = {pos, dir, {1.0f / dir.x, 1.0f / dir.y},\n"
+               "               fabsf(dir.x) < 0.0001f, fabsf(dir.y) < "
+               "0.0001f,\n"
+               "               hit->kind == %d ? -1 : -2};\n"
+               "  Ray *ray = &state;\n",
+               BEAM_HIT_WALL) > 0;
+  if (obstacles > 0)
+    ok = ok && WriteVisit(file, &stage->bvh, 0, "  ");
+  else
+    ok = ok && fprintf(file, "  (void)ray;\n") > 0;
+  ok = ok && fprintf(file,
+                     "}\n\n"
+                     "const BeamStagePlugin " BEAM_PLUGIN_SYMBOL
+                     " = {%d, 0x%llxULL, %d, %d,\n"
+                     "                                       ClosestHit};\n",
+                     BEAM_PLUGIN_VERSION, StageContentHash(stage),
+                     stage->rectCount, stage->circleCount) > 0;
+  return fclose(file) == 0 && ok;
+}
+
+bool LoadStagePlugin(StageData *stage, const char *path) {
+  UnloadStagePlugin(stage);
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle)
+    return false;
+  const BeamStagePlugin *plugin = dlsym(handle, BEAM_PLUGIN_SYMBOL);
+  if (!plugin || plugin->version != BEAM_PLUGIN_VERSION ||
+      plugin->stageHash != StageContentHash(stage) ||
+      plugin->rectCount != stage->rectCount ||
+      plugin->circleCount != stage->circleCount || !plugin->closestHit) {
+    dlclose(handle);
+    return false;
+  }
+  stage->plugin = handle;
+  stage->pluginHit = plugin->closestHit;
+  return true;
+}
+
+void UnloadStagePlugin(StageData *stage) {
+  if (stage->plugin)
+    dlclose(stage->plugin);
+  stage->plugin = NULL;
+  stage->pluginHit = NULL;
+}
@@ -0,0 +1,142 @@
+#include "beamtrace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct BeamPool {
+  pthread_t *threads;
+  int threadCount; // including the caller
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  unsigned long generation;
+  int running;
+  bool quit;
+
+  BeamJobFn fn;
+  void *ctx;
+  int count;
+  int chunk;
+  atomic_int next;
+};
+
+typedef struct PoolWorker {
+  BeamPool *pool;
+  int index;
+} PoolWorker;
+
+static void RunChunks(BeamPool *pool, int worker) {
+  for (;;) {
+    int begin = atomic_fetch_add(&pool->next, pool->chunk);
+    if (begin >= pool->count)
+      break;
+    int end = begin + pool->chunk;
+    if (end > pool->count)
+      end = pool->count;
+    pool->fn(pool->ctx, begin, end, worker);
+  }
+}
+
+static void *WorkerMain(void *arg) {
+  PoolWorker *self = arg;
+  BeamPool *pool = self->pool;
+  int index = self->index;
+  free(self);
+
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->generation == seen)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->quit)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    RunChunks(pool, index);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+BeamPool *CreateBeamPool(int threads) {
+  if (threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int)cpus : 1;
+  }
+  BeamPool *pool = calloc(1, sizeof(BeamPool));
+  if (!pool)
+    return NULL;
+  pool->threads = calloc((size_t)threads, sizeof(pthread_t));
+  if (!pool->threads) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  atomic_init(&pool->next, 0);
+
+  pool->threadCount = 1;
+  for (int i = 1; i < threads; i++) {
+    PoolWorker *worker = malloc(sizeof(PoolWorker));
+    if (!worker)
+      break;
+    *worker = (PoolWorker){pool, i};
+    if (pthread_create(&pool->threads[i], NULL, WorkerMain, worker) != 0) {
+      free(worker);
+      break;
+    }
+    pool->threadCount++;
+  }
+  return pool;
+}
+
+void DestroyBeamPool(BeamPool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1; i < pool->threadCount; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+int GetBeamPoolThreads(const BeamPool *pool) { return pool->threadCount; }
+
+void RunBeamPool(BeamPool *pool, int count, int chunk, BeamJobFn fn,
+                 void *ctx) {
+  if (count <= 0)
+    return;
+  if (chunk <= 0)
+    chunk = 1;
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->count = count;
+  pool->chunk = chunk;
+  atomic_store(&pool->next, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->running = pool->threadCount - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  RunChunks(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
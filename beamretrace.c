@@ -0,0 +1,231 @@
+#include "beamtrace.h"
+#include <math.h>
+
+// Smallest distance a segment's endpoints may move between calls before its
+// obstacle list is rebuilt; it grows to twice the last observed movement.
+#define RETRACE_MARGIN 4.0f
+#define RETRACE_MAX_MARGIN 64.0f
+
+// Scan-order rank of a hit, as used for tie-breaking by StageClosestHit.
+static int HitRank(const StageData *stage, const BeamHit *hit) {
+  switch (hit->kind) {
+  case BEAM_HIT_WALL:
+    return -1;
+  case BEAM_HIT_RECT:
+    return hit->index;
+  case BEAM_HIT_CIRCLE:
+    return stage->rectCount + hit->index;
+  default:
+    return -2;
+  }
+}
+
+static bool ObstacleBeats(const StageData *stage, int id, Vector2 pos,
+                          Vector2 dir, const BeamHit *hit, int rank) {
+  float t = 0.0f;
+  bool found;
+  if (id < stage->rectCount) {
+    found = RayIntersectRect(pos, dir, stage->rects[id], &t, NULL);
+  } else {
+    int c = id - stage->rectCount;
+    found = RayIntersectCircle(pos, dir, stage->circlePos[c],
+                               stage->circleRadius[c], &t, NULL);
+  }
+  return found && (t < hit->t || (t == hit->t && id < rank));
+}
+
+// StageClosestHit restricted to the walls and the object guessed to win.
+// Returns false when the guess is not even the winner among those.
+static bool GuessHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                     int kind, int index, BeamHit *hit) {
+  hit->normal = (Vector2){0.0f, 0.0f};
+  hit->kind = BEAM_HIT_NONE;
+  hit->index = -1;
+
+  const Rectangle field = stage->field;
+  float tWall = 0.0f;
+  Vector2 nWall = {0.0f, 0.0f};
+  if (RayIntersectWalls(pos, dir, field.x, field.x + field.width, field.y,
+                        field.y + field.height, &tWall, &nWall) &&
+      tWall < hit->t) {
+    hit->t = tWall;
+    hit->normal = nWall;
+    hit->kind = BEAM_HIT_WALL;
+  }
+
+  float t = 0.0f;
+  Vector2 n = {0.0f, 0.0f};
+  bool found = false;
+  if (kind == BEAM_HIT_RECT && index >= 0 && index < stage->rectCount)
+    found = RayIntersectRect(pos, dir, stage->rects[index], &t, &n);
+  else if (kind == BEAM_HIT_CIRCLE && index >= 0 && index < stage->circleCount)
+    found = RayIntersectCircle(pos, dir, stage->circlePos[index],
+                               stage->circleRadius[index], &t, &n);
+  if (found && t < hit->t) {
+    hit->t = t;
+    hit->normal = n;
+    hit->kind = kind;
+    hit->index = index;
+  }
+  return hit->kind == kind;
+}
+
+static float DistanceToSegment(Vector2 p, Vector2 a, Vector2 b) {
+  float abx = b.x - a.x, aby = b.y - a.y;
+  float len2 = abx * abx + aby * aby;
+  float f = len2 > 0.0f ? ((p.x - a.x) * abx + (p.y - a.y) * aby) / len2 : 0.0f;
+  f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+  float dx = p.x - (a.x + abx * f), dy = p.y - (a.y + aby * f);
+  return sqrtf(dx * dx + dy * dy);
+}
+
+// Gathers the obstacles near the step's segment. A corridor crowded enough
+// to need more than BEAM_CORRIDOR_IDS entries is left without a list; the
+// closest-hit search is as cheap as scanning it.
+static void BuildCorridor(const StageData *stage, BeamCorridor *c, Vector2 a,
+                          Vector2 b, float slack, float drift,
+                          const BeamHit *hit) {
+  c->start = a;
+  c->end = b;
+  c->slack = slack;
+  c->kind = hit->kind;
+  c->index = hit->index;
+  c->count = -1;
+  if (slack <= 0.0f)
+    return;
+  int count = StageBvhSegmentQuery(stage, a, b, slack * 2.0f + drift, c->ids,
+                                   BEAM_CORRIDOR_IDS);
+  if (count <= BEAM_CORRIDOR_IDS)
+    c->count = count;
+}
+
+void ResetBeamRetrace(BeamRetrace *state) { state->stepCount = 0; }
+
+int RetraceBeam(const StageData *stage, Vector2 origin, Vector2 dir,
+                int maxBounces, float maxLength, BeamRetrace *state,
+                BeamPath *path) {
+  if (stage->bvh.nodeCount == 0) {
+    TraceBeam(stage, origin, dir, maxBounces, maxLength, path);
+    state->stepCount = 0;
+    return path->segmentCount;
+  }
+  path->segmentCount = 0;
+  path->hitGoal = false;
+  path->end = BEAM_END_LENGTH;
+  float dirLen = sqrtf(dir.x * dir.x + dir.y * dir.y);
+  if (dirLen <= 0.0001f) {
+    state->stepCount = 0;
+    return 0;
+  }
+  dir.x /= dirLen;
+  dir.y /= dirLen;
+
+  // Near-parallel rect hits may land this far off the ray's true line.
+  float drift = 0.0001f * maxLength;
+  bool guessing = true;
+  int searches = 0;
+
+  // Mirrors TraceBeam, with the closest-hit search replaced by a guess where
+  // the previous call's route still holds.
+  Vector2 pos = origin;
+  float remaining = maxLength;
+  float traveled = 0.0f;
+  int bounces = 0;
+  BeamLoop loop;
+  ResetBeamLoop(&loop);
+  while (remaining > 0.0f && bounces <= maxBounces) {
+    int step = path->segmentCount;
+    BeamCorridor *c = step < BEAM_RETRACE_STEPS ? &state->steps[step] : NULL;
+    BeamHit hit = {remaining};
+    bool known = false;
+    if (guessing && step < state->stepCount &&
+        GuessHit(stage, pos, dir, c->kind, c->index, &hit)) {
+      Vector2 end = {pos.x + dir.x * hit.t, pos.y + dir.y * hit.t};
+      float moved = fmaxf(DistanceToSegment(pos, c->start, c->end),
+                          DistanceToSegment(end, c->start, c->end));
+      if (c->count >= 0 && moved < c->slack) {
+        // The new segment lies inside the corridor, so only obstacles near
+        // the old one can be in its way.
+        int rank = HitRank(stage, &hit);
+        known = true;
+        for (int i = 0; i < c->count && known; i++)
+          known = !ObstacleBeats(stage, c->ids[i], pos, dir, &hit, rank);
+      } else if (!StageBvhCloserHit(stage, pos, dir, &hit,
+                                    HitRank(stage, &hit))) {
+        // Out of the corridor, but nothing anywhere beats the guess: same
+        // object two calls running, so it is worth a corridor sized to how
+        // fast the segment is moving.
+        known = true;
+        float slack =
+            fminf(fmaxf(moved * 2.0f, RETRACE_MARGIN), RETRACE_MAX_MARGIN);
+        BuildCorridor(stage, c, pos, end, slack, drift, &hit);
+      }
+    }
+    if (!known) {
+      guessing = false;
+      hit = (BeamHit){remaining};
+      StageClosestHit(stage, pos, dir, &hit);
+      searches++;
+      if (c)
+        BuildCorridor(stage, c, pos,
+                      (Vector2){pos.x + dir.x * hit.t, pos.y + dir.y * hit.t},
+                      0.0f, drift, &hit);
+    }
+
+    BeamSegment *seg = PushBeamSegment(path);
+    if (!seg) {
+      path->end = BEAM_END_STUCK;
+      break;
+    }
+    seg->start = pos;
+    seg->startDist = traveled;
+
+    if (stage->hasGoal) {
+      float tGoal = 0.0f;
+      if (RayIntersectCircle(pos, dir, stage->goalPos, stage->goalRadius,
+                             &tGoal, NULL) &&
+          tGoal <= hit.t && tGoal <= remaining) {
+        seg->end = (Vector2){pos.x + dir.x * tGoal, pos.y + dir.y * tGoal};
+        seg->endDist = traveled + tGoal;
+        seg->normal = (Vector2){0.0f, 0.0f};
+        seg->hitKind = BEAM_HIT_GOAL;
+        seg->hitIndex = -1;
+        path->hitGoal = true;
+        path->end = BEAM_END_GOAL;
+        break;
+      }
+    }
+
+    Vector2 hitPos = {pos.x + dir.x * hit.t, pos.y + dir.y * hit.t};
+    remaining -= hit.t;
+    traveled += hit.t;
+    seg->end = hitPos;
+    seg->endDist = traveled;
+    seg->normal = hit.normal;
+    seg->hitKind = hit.kind;
+    seg->hitIndex = hit.index;
+
+    if (hit.kind == BEAM_HIT_NONE)
+      break;
+    if (hit.t <= 0.0001f) {
+      path->end = BEAM_END_STUCK;
+      break;
+    }
+
+    float dot = dir.x * hit.normal.x + dir.y * hit.normal.y;
+    dir.x = dir.x - 2.0f * dot * hit.normal.x;
+    dir.y = dir.y - 2.0f * dot * hit.normal.y;
+    pos = hitPos;
+    bounces++;
+    if (stage->stopLoops && BeamLoopRepeats(&loop, seg, dir)) {
+      path->end = BEAM_END_LOOP;
+      break;
+    }
+  }
+  if (path->end == BEAM_END_LENGTH && bounces > maxBounces)
+    path->end = BEAM_END_BOUNCES;
+  state->stepCount = path->segmentCount < BEAM_RETRACE_STEPS
+                         ? path->segmentCount
+                         : BEAM_RETRACE_STEPS;
+  return searches;
+}
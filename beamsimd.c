@@ -0,0 +1,553 @@
+#include "beamtrace.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BEAM_HAVE_X86 1
+#endif
+
+#define SOA_ALIGN 32
+#define SOA_LANES 8
+
+typedef int (*RectKernelFn)(const StageRectSoA *soa, Vector2 pos, Vector2 dir,
+                            float *tHit, Vector2 *normal);
+typedef int (*CircleKernelFn)(const StageCircleSoA *soa, Vector2 pos,
+                              Vector2 dir, float *tHit);
+
+static int RectsScalar(const StageRectSoA *soa, Vector2 pos, Vector2 dir,
+                       float *tHit, Vector2 *normal);
+static int CirclesScalar(const StageCircleSoA *soa, Vector2 pos, Vector2 dir,
+                         float *tHit);
+
+// The default kernel is chosen once, whichever thread first builds a stage;
+// SetBeamKernel only changes it from a single thread between traces.
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+static BeamKernel activeKernel = BEAM_KERNEL_SCALAR;
+static RectKernelFn rectKernel = RectsScalar;
+static CircleKernelFn circleKernel = CirclesScalar;
+
+static BeamKernel SelectKernel(BeamKernel kernel);
+
+static void ChooseDefaultKernel(void) { SelectKernel(BEAM_KERNEL_AVX2); }
+
+static float *AllocLanes(int count) {
+  return aligned_alloc(SOA_ALIGN, sizeof(float) * (size_t)count);
+}
+
+void UnloadStageRectSoA(StageData *stage) {
+  free(stage->rectSoA.xs);
+  free(stage->rectSoA.ys);
+  free(stage->rectSoA.x2s);
+  free(stage->rectSoA.y2s);
+  stage->rectSoA = (StageRectSoA){0};
+}
+
+void BuildStageRectSoA(StageData *stage) {
+  UnloadStageRectSoA(stage);
+  pthread_once(&kernelOnce, ChooseDefaultKernel);
+  int padded = (stage->rectCount + SOA_LANES - 1) / SOA_LANES * SOA_LANES;
+  if (padded == 0)
+    return;
+  StageRectSoA soa = {AllocLanes(padded), AllocLanes(padded),
+                      AllocLanes(padded), AllocLanes(padded),
+                      stage->rectCount, padded};
+  if (!soa.xs || !soa.ys || !soa.x2s || !soa.y2s) {
+    stage->rectSoA = soa;
+    UnloadStageRectSoA(stage);
+    return;
+  }
+  for (int i = 0; i < padded; i++) {
+    if (i < stage->rectCount) {
+      Rectangle r = stage->rects[i];
+      soa.xs[i] = r.x;
+      soa.ys[i] = r.y;
+      soa.x2s[i] = r.x + r.width;
+      soa.y2s[i] = r.y + r.height;
+    } else {
+      // Rects at +inf are rejected by every slab test.
+      soa.xs[i] = soa.ys[i] = soa.x2s[i] = soa.y2s[i] = INFINITY;
+    }
+  }
+  stage->rectSoA = soa;
+}
+
+void UnloadStageCircleSoA(StageData *stage) {
+  free(stage->circleSoA.xs);
+  free(stage->circleSoA.ys);
+  free(stage->circleSoA.r2s);
+  stage->circleSoA = (StageCircleSoA){0};
+}
+
+void BuildStageCircleSoA(StageData *stage) {
+  UnloadStageCircleSoA(stage);
+  pthread_once(&kernelOnce, ChooseDefaultKernel);
+  int padded = (stage->circleCount + SOA_LANES - 1) / SOA_LANES * SOA_LANES;
+  if (padded == 0)
+    return;
+  StageCircleSoA soa = {AllocLanes(padded), AllocLanes(padded),
+                        AllocLanes(padded), stage->circleCount, padded};
+  if (!soa.xs || !soa.ys || !soa.r2s) {
+    stage->circleSoA = soa;
+    UnloadStageCircleSoA(stage);
+    return;
+  }
+  for (int i = 0; i < padded; i++) {
+    if (i < stage->circleCount) {
+      float r = stage->circleRadius[i];
+      soa.xs[i] = stage->circlePos[i].x;
+      soa.ys[i] = stage->circlePos[i].y;
+      soa.r2s[i] = r * r;
+    } else {
+      // A zero-radius circle at +inf yields no real root for any ray.
+      soa.xs[i] = soa.ys[i] = INFINITY;
+      soa.r2s[i] = 0.0f;
+    }
+  }
+  stage->circleSoA = soa;
+}
+
+static int RectsScalar(const StageRectSoA *soa, Vector2 pos, Vector2 dir,
+                       float *tHit, Vector2 *normal) {
+  const bool parallelX = fabsf(dir.x) < 0.0001f;
+  const bool parallelY = fabsf(dir.y) < 0.0001f;
+  int best = -1;
+  for (int i = 0; i < soa->count; i++) {
+    float x1 = soa->xs[i], y1 = soa->ys[i];
+    float x2 = soa->x2s[i], y2 = soa->y2s[i];
+    if (pos.x > x1 && pos.x < x2 && pos.y > y1 && pos.y < y2)
+      continue;
+    float tmin = -INFINITY;
+    float tmax = INFINITY;
+    Vector2 n = {0.0f, 0.0f};
+    if (parallelX) {
+      if (pos.x < x1 || pos.x > x2)
+        continue;
+    } else {
+      float t1 = (x1 - pos.x) / dir.x;
+      float t2 = (x2 - pos.x) / dir.x;
+      tmin = t1 < t2 ? t1 : t2;
+      tmax = t1 < t2 ? t2 : t1;
+      n = t1 < t2 ? (Vector2){-1.0f, 0.0f} : (Vector2){1.0f, 0.0f};
+    }
+    if (parallelY) {
+      if (pos.y < y1 || pos.y > y2)
+        continue;
+    } else {
+      float t1 = (y1 - pos.y) / dir.y;
+      float t2 = (y2 - pos.y) / dir.y;
+      float entry = t1 < t2 ? t1 : t2;
+      float exit = t1 < t2 ? t2 : t1;
+      if (entry > tmin) {
+        tmin = entry;
+        n = t1 < t2 ? (Vector2){0.0f, -1.0f} : (Vector2){0.0f, 1.0f};
+      }
+      if (exit < tmax)
+        tmax = exit;
+    }
+    if (tmax < tmin || tmax < 0.0f || tmin < 0.0001f || !(tmin < *tHit))
+      continue;
+    *tHit = tmin;
+    *normal = n;
+    best = i;
+  }
+  return best;
+}
+
+static int CirclesScalar(const StageCircleSoA *soa, Vector2 pos, Vector2 dir,
+                         float *tHit) {
+  int best = -1;
+  for (int i = 0; i < soa->count; i++) {
+    float mx = pos.x - soa->xs[i];
+    float my = pos.y - soa->ys[i];
+    float b = mx * dir.x + my * dir.y;
+    float c = mx * mx + my * my - soa->r2s[i];
+    if (b > 0.0f && c > -0.0001f * soa->r2s[i])
+      continue;
+    float discr = b * b - c;
+    if (discr < 0.0f)
+      continue;
+    float t = -b - sqrtf(discr);
+    if (t < 0.0f)
+      t = 0.0f;
+    if (t < *tHit) {
+      *tHit = t;
+      best = i;
+    }
+  }
+  return best;
+}
+
+#ifdef BEAM_HAVE_X86
+// Lane-wise RayIntersectRect. The branches on dir are uniform across lanes,
+// the per-rect ones become masks; divisions and comparisons are the same
+// IEEE operations as the scalar kernel, so t and the entry normal are
+// bit-identical. Each lane keeps its own strict-less best so that ties go to
+// the lowest index once lanes are reduced.
+__attribute__((target("sse2"))) static int
+RectsSse2(const StageRectSoA *soa, Vector2 pos, Vector2 dir, float *tHit,
+          Vector2 *normal) {
+  const __m128 px = _mm_set1_ps(pos.x);
+  const __m128 py = _mm_set1_ps(pos.y);
+  const __m128 dx = _mm_set1_ps(dir.x);
+  const __m128 dy = _mm_set1_ps(dir.y);
+  const bool parallelX = fabsf(dir.x) < 0.0001f;
+  const bool parallelY = fabsf(dir.y) < 0.0001f;
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 minusOne = _mm_set1_ps(-1.0f);
+  const __m128 eps = _mm_set1_ps(0.0001f);
+
+  __m128 bestT = _mm_set1_ps(*tHit);
+  __m128 bestNx = zero;
+  __m128 bestNy = zero;
+  __m128i bestIdx = _mm_set1_epi32(-1);
+  __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i four = _mm_set1_epi32(4);
+
+  for (int i = 0; i < soa->count; i += 4) {
+    __m128 x1 = _mm_load_ps(soa->xs + i);
+    __m128 y1 = _mm_load_ps(soa->ys + i);
+    __m128 x2 = _mm_load_ps(soa->x2s + i);
+    __m128 y2 = _mm_load_ps(soa->y2s + i);
+
+    __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(px, x1),
+                                          _mm_cmplt_ps(px, x2)),
+                               _mm_and_ps(_mm_cmpgt_ps(py, y1),
+                                          _mm_cmplt_ps(py, y2)));
+    __m128 reject = inside;
+    __m128 tmin = _mm_set1_ps(-INFINITY);
+    __m128 tmax = _mm_set1_ps(INFINITY);
+    __m128 nx = zero;
+    __m128 ny = zero;
+
+    if (parallelX) {
+      reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(px, x1),
+                                           _mm_cmpgt_ps(px, x2)));
+    } else {
+      __m128 t1 = _mm_div_ps(_mm_sub_ps(x1, px), dx);
+      __m128 t2 = _mm_div_ps(_mm_sub_ps(x2, px), dx);
+      __m128 lt = _mm_cmplt_ps(t1, t2);
+      tmin = _mm_min_ps(t1, t2);
+      tmax = _mm_or_ps(_mm_and_ps(lt, t2), _mm_andnot_ps(lt, t1));
+      nx = _mm_or_ps(_mm_and_ps(lt, minusOne), _mm_andnot_ps(lt, one));
+    }
+
+    if (parallelY) {
+      reject = _mm_or_ps(reject, _mm_or_ps(_mm_cmplt_ps(py, y1),
+                                           _mm_cmpgt_ps(py, y2)));
+    } else {
+      __m128 t1 = _mm_div_ps(_mm_sub_ps(y1, py), dy);
+      __m128 t2 = _mm_div_ps(_mm_sub_ps(y2, py), dy);
+      __m128 lt = _mm_cmplt_ps(t1, t2);
+      __m128 entry = _mm_min_ps(t1, t2);
+      __m128 exit = _mm_or_ps(_mm_and_ps(lt, t2), _mm_andnot_ps(lt, t1));
+      __m128 later = _mm_cmpgt_ps(entry, tmin);
+      __m128 nyEntry =
+          _mm_or_ps(_mm_and_ps(lt, minusOne), _mm_andnot_ps(lt, one));
+      tmin = _mm_or_ps(_mm_and_ps(later, entry), _mm_andnot_ps(later, tmin));
+      nx = _mm_andnot_ps(later, nx);
+      ny = _mm_and_ps(later, nyEntry);
+      __m128 shorter = _mm_cmplt_ps(exit, tmax);
+      tmax = _mm_or_ps(_mm_and_ps(shorter, exit), _mm_andnot_ps(shorter, tmax));
+    }
+
+    reject = _mm_or_ps(reject, _mm_cmplt_ps(tmax, tmin));
+    reject = _mm_or_ps(reject, _mm_cmplt_ps(tmax, zero));
+    reject = _mm_or_ps(reject, _mm_cmplt_ps(tmin, eps));
+    __m128 take = _mm_andnot_ps(reject, _mm_cmplt_ps(tmin, bestT));
+    bestT = _mm_or_ps(_mm_and_ps(take, tmin), _mm_andnot_ps(take, bestT));
+    bestNx = _mm_or_ps(_mm_and_ps(take, nx), _mm_andnot_ps(take, bestNx));
+    bestNy = _mm_or_ps(_mm_and_ps(take, ny), _mm_andnot_ps(take, bestNy));
+    __m128i takeI = _mm_castps_si128(take);
+    bestIdx = _mm_or_si128(_mm_and_si128(takeI, idx),
+                           _mm_andnot_si128(takeI, bestIdx));
+    idx = _mm_add_epi32(idx, four);
+  }
+
+  float ts[4], nxs[4], nys[4];
+  int ids[4];
+  _mm_storeu_ps(ts, bestT);
+  _mm_storeu_ps(nxs, bestNx);
+  _mm_storeu_ps(nys, bestNy);
+  _mm_storeu_si128((__m128i *)ids, bestIdx);
+  int best = -1;
+  for (int l = 0; l < 4; l++) {
+    if (ids[l] < 0)
+      continue;
+    if (best < 0 || ts[l] < *tHit || (ts[l] == *tHit && ids[l] < best)) {
+      *tHit = ts[l];
+      *normal = (Vector2){nxs[l], nys[l]};
+      best = ids[l];
+    }
+  }
+  return best;
+}
+
+__attribute__((target("avx2"))) static int
+RectsAvx2(const StageRectSoA *soa, Vector2 pos, Vector2 dir, float *tHit,
+          Vector2 *normal) {
+  const __m256 px = _mm256_set1_ps(pos.x);
+  const __m256 py = _mm256_set1_ps(pos.y);
+  const __m256 dx = _mm256_set1_ps(dir.x);
+  const __m256 dy = _mm256_set1_ps(dir.y);
+  const bool parallelX = fabsf(dir.x) < 0.0001f;
+  const bool parallelY = fabsf(dir.y) < 0.0001f;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 minusOne = _mm256_set1_ps(-1.0f);
+  const __m256 eps = _mm256_set1_ps(0.0001f);
+
+  __m256 bestT = _mm256_set1_ps(*tHit);
+  __m256 bestNx = zero;
+  __m256 bestNy = zero;
+  __m256i bestIdx = _mm256_set1_epi32(-1);
+  __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i eight = _mm256_set1_epi32(8);
+
+  for (int i = 0; i < soa->count; i += 8) {
+    __m256 x1 = _mm256_load_ps(soa->xs + i);
+    __m256 y1 = _mm256_load_ps(soa->ys + i);
+    __m256 x2 = _mm256_load_ps(soa->x2s + i);
+    __m256 y2 = _mm256_load_ps(soa->y2s + i);
+
+    __m256 reject = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(px, x1, _CMP_GT_OQ),
+                      _mm256_cmp_ps(px, x2, _CMP_LT_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(py, y1, _CMP_GT_OQ),
+                      _mm256_cmp_ps(py, y2, _CMP_LT_OQ)));
+    __m256 tmin = _mm256_set1_ps(-INFINITY);
+    __m256 tmax = _mm256_set1_ps(INFINITY);
+    __m256 nx = zero;
+    __m256 ny = zero;
+
+    if (parallelX) {
+      reject = _mm256_or_ps(reject,
+                            _mm256_or_ps(_mm256_cmp_ps(px, x1, _CMP_LT_OQ),
+                                         _mm256_cmp_ps(px, x2, _CMP_GT_OQ)));
+    } else {
+      __m256 t1 = _mm256_div_ps(_mm256_sub_ps(x1, px), dx);
+      __m256 t2 = _mm256_div_ps(_mm256_sub_ps(x2, px), dx);
+      __m256 lt = _mm256_cmp_ps(t1, t2, _CMP_LT_OQ);
+      tmin = _mm256_min_ps(t1, t2);
+      tmax = _mm256_blendv_ps(t1, t2, lt);
+      nx = _mm256_blendv_ps(one, minusOne, lt);
+    }
+
+    if (parallelY) {
+      reject = _mm256_or_ps(reject,
+                            _mm256_or_ps(_mm256_cmp_ps(py, y1, _CMP_LT_OQ),
+                                         _mm256_cmp_ps(py, y2, _CMP_GT_OQ)));
+    } else {
+      __m256 t1 = _mm256_div_ps(_mm256_sub_ps(y1, py), dy);
+      __m256 t2 = _mm256_div_ps(_mm256_sub_ps(y2, py), dy);
+      __m256 lt = _mm256_cmp_ps(t1, t2, _CMP_LT_OQ);
+      __m256 entry = _mm256_min_ps(t1, t2);
+      __m256 exit = _mm256_blendv_ps(t1, t2, lt);
+      __m256 later = _mm256_cmp_ps(entry, tmin, _CMP_GT_OQ);
+      tmin = _mm256_blendv_ps(tmin, entry, later);
+      nx = _mm256_andnot_ps(later, nx);
+      ny = _mm256_and_ps(later, _mm256_blendv_ps(one, minusOne, lt));
+      tmax = _mm256_blendv_ps(tmax, exit, _mm256_cmp_ps(exit, tmax, _CMP_LT_OQ));
+    }
+
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(tmax, tmin, _CMP_LT_OQ));
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(tmax, zero, _CMP_LT_OQ));
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(tmin, eps, _CMP_LT_OQ));
+    __m256 take =
+        _mm256_andnot_ps(reject, _mm256_cmp_ps(tmin, bestT, _CMP_LT_OQ));
+    bestT = _mm256_blendv_ps(bestT, tmin, take);
+    bestNx = _mm256_blendv_ps(bestNx, nx, take);
+    bestNy = _mm256_blendv_ps(bestNy, ny, take);
+    bestIdx = _mm256_blendv_epi8(bestIdx, idx, _mm256_castps_si256(take));
+    idx = _mm256_add_epi32(idx, eight);
+  }
+
+  float ts[8], nxs[8], nys[8];
+  int ids[8];
+  _mm256_storeu_ps(ts, bestT);
+  _mm256_storeu_ps(nxs, bestNx);
+  _mm256_storeu_ps(nys, bestNy);
+  _mm256_storeu_si256((__m256i *)ids, bestIdx);
+  int best = -1;
+  for (int l = 0; l < 8; l++) {
+    if (ids[l] < 0)
+      continue;
+    if (best < 0 || ts[l] < *tHit || (ts[l] == *tHit && ids[l] < best)) {
+      *tHit = ts[l];
+      *normal = (Vector2){nxs[l], nys[l]};
+      best = ids[l];
+    }
+  }
+  return best;
+}
+
+// Lane-wise RayIntersectCircle without the normal: the same operations in
+// the same order, so t is bit-identical. The normal is computed once for the
+// winner by the caller.
+__attribute__((target("sse2"))) static int
+CirclesSse2(const StageCircleSoA *soa, Vector2 pos, Vector2 dir, float *tHit) {
+  const __m128 px = _mm_set1_ps(pos.x);
+  const __m128 py = _mm_set1_ps(pos.y);
+  const __m128 dx = _mm_set1_ps(dir.x);
+  const __m128 dy = _mm_set1_ps(dir.y);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 slack = _mm_set1_ps(-0.0001f);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+
+  __m128 bestT = _mm_set1_ps(*tHit);
+  __m128i bestIdx = _mm_set1_epi32(-1);
+  __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i four = _mm_set1_epi32(4);
+
+  for (int i = 0; i < soa->count; i += 4) {
+    __m128 mx = _mm_sub_ps(px, _mm_load_ps(soa->xs + i));
+    __m128 my = _mm_sub_ps(py, _mm_load_ps(soa->ys + i));
+    __m128 b = _mm_add_ps(_mm_mul_ps(mx, dx), _mm_mul_ps(my, dy));
+    __m128 r2 = _mm_load_ps(soa->r2s + i);
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(mx, mx), _mm_mul_ps(my, my)),
+                          r2);
+    __m128 discr = _mm_sub_ps(_mm_mul_ps(b, b), c);
+    __m128 reject = _mm_and_ps(_mm_cmpgt_ps(b, zero),
+                               _mm_cmpgt_ps(c, _mm_mul_ps(slack, r2)));
+    reject = _mm_or_ps(reject, _mm_cmplt_ps(discr, zero));
+    __m128 t = _mm_sub_ps(_mm_xor_ps(b, sign), _mm_sqrt_ps(discr));
+    __m128 neg = _mm_cmplt_ps(t, zero);
+    t = _mm_andnot_ps(neg, t);
+    __m128 take = _mm_andnot_ps(reject, _mm_cmplt_ps(t, bestT));
+    bestT = _mm_or_ps(_mm_and_ps(take, t), _mm_andnot_ps(take, bestT));
+    __m128i takeI = _mm_castps_si128(take);
+    bestIdx = _mm_or_si128(_mm_and_si128(takeI, idx),
+                           _mm_andnot_si128(takeI, bestIdx));
+    idx = _mm_add_epi32(idx, four);
+  }
+
+  float ts[4];
+  int ids[4];
+  _mm_storeu_ps(ts, bestT);
+  _mm_storeu_si128((__m128i *)ids, bestIdx);
+  int best = -1;
+  for (int l = 0; l < 4; l++) {
+    if (ids[l] < 0)
+      continue;
+    if (best < 0 || ts[l] < *tHit || (ts[l] == *tHit && ids[l] < best)) {
+      *tHit = ts[l];
+      best = ids[l];
+    }
+  }
+  return best;
+}
+
+__attribute__((target("avx2"))) static int
+CirclesAvx2(const StageCircleSoA *soa, Vector2 pos, Vector2 dir, float *tHit) {
+  const __m256 px = _mm256_set1_ps(pos.x);
+  const __m256 py = _mm256_set1_ps(pos.y);
+  const __m256 dx = _mm256_set1_ps(dir.x);
+  const __m256 dy = _mm256_set1_ps(dir.y);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 slack = _mm256_set1_ps(-0.0001f);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+
+  __m256 bestT = _mm256_set1_ps(*tHit);
+  __m256i bestIdx = _mm256_set1_epi32(-1);
+  __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i eight = _mm256_set1_epi32(8);
+
+  for (int i = 0; i < soa->count; i += 8) {
+    __m256 mx = _mm256_sub_ps(px, _mm256_load_ps(soa->xs + i));
+    __m256 my = _mm256_sub_ps(py, _mm256_load_ps(soa->ys + i));
+    __m256 b = _mm256_add_ps(_mm256_mul_ps(mx, dx), _mm256_mul_ps(my, dy));
+    __m256 r2 = _mm256_load_ps(soa->r2s + i);
+    __m256 c = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_mul_ps(mx, mx), _mm256_mul_ps(my, my)), r2);
+    __m256 discr = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+    __m256 reject = _mm256_and_ps(
+        _mm256_cmp_ps(b, zero, _CMP_GT_OQ),
+        _mm256_cmp_ps(c, _mm256_mul_ps(slack, r2), _CMP_GT_OQ));
+    reject = _mm256_or_ps(reject, _mm256_cmp_ps(discr, zero, _CMP_LT_OQ));
+    __m256 t = _mm256_sub_ps(_mm256_xor_ps(b, sign), _mm256_sqrt_ps(discr));
+    t = _mm256_andnot_ps(_mm256_cmp_ps(t, zero, _CMP_LT_OQ), t);
+    __m256 take =
+        _mm256_andnot_ps(reject, _mm256_cmp_ps(t, bestT, _CMP_LT_OQ));
+    bestT = _mm256_blendv_ps(bestT, t, take);
+    bestIdx = _mm256_blendv_epi8(bestIdx, idx, _mm256_castps_si256(take));
+    idx = _mm256_add_epi32(idx, eight);
+  }
+
+  float ts[8];
+  int ids[8];
+  _mm256_storeu_ps(ts, bestT);
+  _mm256_storeu_si256((__m256i *)ids, bestIdx);
+  int best = -1;
+  for (int l = 0; l < 8; l++) {
+    if (ids[l] < 0)
+      continue;
+    if (best < 0 || ts[l] < *tHit || (ts[l] == *tHit && ids[l] < best)) {
+      *tHit = ts[l];
+      best = ids[l];
+    }
+  }
+  return best;
+}
+#endif
+
+static BeamKernel SelectKernel(BeamKernel kernel) {
+#ifdef BEAM_HAVE_X86
+  __builtin_cpu_init();
+  if (kernel >= BEAM_KERNEL_AVX2 && __builtin_cpu_supports("avx2")) {
+    activeKernel = BEAM_KERNEL_AVX2;
+    rectKernel = RectsAvx2;
+    circleKernel = CirclesAvx2;
+  } else if (kernel >= BEAM_KERNEL_SSE2 && __builtin_cpu_supports("sse2")) {
+    activeKernel = BEAM_KERNEL_SSE2;
+    rectKernel = RectsSse2;
+    circleKernel = CirclesSse2;
+  } else {
+    activeKernel = BEAM_KERNEL_SCALAR;
+    rectKernel = RectsScalar;
+    circleKernel = CirclesScalar;
+  }
+#else
+  (void)kernel;
+  activeKernel = BEAM_KERNEL_SCALAR;
+  rectKernel = RectsScalar;
+  circleKernel = CirclesScalar;
+#endif
+  return activeKernel;
+}
+
+BeamKernel GetBeamKernel(void) {
+  pthread_once(&kernelOnce, ChooseDefaultKernel);
+  return activeKernel;
+}
+
+BeamKernel SetBeamKernel(BeamKernel kernel) {
+  pthread_once(&kernelOnce, ChooseDefaultKernel);
+  return SelectKernel(kernel);
+}
+
+int RayIntersectRectsSoA(const StageRectSoA *soa, Vector2 pos, Vector2 dir,
+                         float *tHit, Vector2 *normal) {
+  if (soa->count == 0)
+    return -1;
+  return rectKernel(soa, pos, dir, tHit, normal);
+}
+
+int RayIntersectCirclesSoA(const StageCircleSoA *soa, Vector2 pos, Vector2 dir,
+                           float *tHit, Vector2 *normal) {
+  if (soa->count == 0)
+    return -1;
+  int best = circleKernel(soa, pos, dir, tHit);
+  if (best >= 0 && normal) {
+    Vector2 hit = {pos.x + dir.x * *tHit, pos.y + dir.y * *tHit};
+    Vector2 n = {hit.x - soa->xs[best], hit.y - soa->ys[best]};
+    float len = sqrtf(n.x * n.x + n.y * n.y);
+    if (len > 0.0001f) {
+      n.x /= len;
+      n.y /= len;
+    }
+    *normal = n;
+  }
+  return best;
+}
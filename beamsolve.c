@@ -0,0 +1,231 @@
+#include "beamtrace.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct AngleSample {
+  float angle;
+  unsigned long long signature;
+  int goalBounces; // bounces to the goal, -1 if the goal is not reached
+} AngleSample;
+
+typedef struct SampleList {
+  AngleSample *items;
+  int count;
+  int capacity;
+  long long rays;
+  bool failed; // a sample could not be stored
+} SampleList;
+
+// Deepest bisection: from 2 pi down to adjacent floats near zero.
+#define REFINE_DEPTH 192
+
+typedef struct AdaptiveJob {
+  const StageData *stage;
+  int maxBounces;
+  float maxLength;
+  int intervals;
+  float drift; // how far a bounce may move before the gap is split anyway
+  SampleList *lists; // one per interval
+  BeamPath *paths;   // REFINE_DEPTH + 2 per pool worker
+} AdaptiveJob;
+
+static bool PushSample(SampleList *list, AngleSample sample) {
+  if (list->count == list->capacity) {
+    int capacity = list->capacity ? list->capacity * 2 : 16;
+    AngleSample *items =
+        realloc(list->items, sizeof(AngleSample) * (size_t)capacity);
+    if (!items)
+      return false;
+    list->items = items;
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = sample;
+  return true;
+}
+
+static float IntervalAngle(int i, int intervals) {
+  if (i == intervals)
+    return BEAM_PI;
+  return (float)(-M_PI + 2.0 * M_PI * (double)i / (double)intervals);
+}
+
+static AngleSample TraceSample(const AdaptiveJob *job, float angle,
+                               BeamPath *path, SampleList *list) {
+  TraceBeam(job->stage, job->stage->start, (Vector2){cosf(angle), sinf(angle)},
+            job->maxBounces, job->maxLength, path);
+  list->rays++;
+  return (AngleSample){angle, BeamPathSignature(path),
+                       path->hitGoal ? path->segmentCount - 1 : -1};
+}
+
+float StageSolveDrift(const StageData *stage) {
+  float drift = stage->goalRadius;
+  for (int i = 0; i < stage->rectCount; i++)
+    drift = fminf(drift, 0.5f * fminf(stage->rects[i].width,
+                                      stage->rects[i].height));
+  for (int i = 0; i < stage->circleCount; i++)
+    drift = fminf(drift, stage->circleRadius[i]);
+  return fmaxf(drift, BEAM_SOLVE_MIN_DRIFT);
+}
+
+// True if some bounce point of one path is more than drift from the same
+// bounce of the other: a beam between them may have crossed something.
+static bool PathsDrift(const BeamPath *a, const BeamPath *b, float drift) {
+  if (a->segmentCount != b->segmentCount)
+    return true;
+  for (int i = 0; i < a->segmentCount; i++) {
+    float dx = a->segments[i].end.x - b->segments[i].end.x;
+    float dy = a->segments[i].end.y - b->segments[i].end.y;
+    if (dx * dx + dy * dy > drift * drift)
+      return true;
+  }
+  return false;
+}
+
+// A wedged beam says nothing about where its neighbours go, so two of them
+// never count as close.
+bool BeamPathsClose(const BeamPath *a, const BeamPath *b, float width,
+                    float drift) {
+  if (width < BEAM_SOLVE_MIN_WIDTH)
+    return true;
+  return a->end != BEAM_END_STUCK && !PathsDrift(a, b, drift);
+}
+
+// True if no beam between samples a and b needs looking at.
+static bool SameRoute(const AdaptiveJob *job, AngleSample a,
+                      const BeamPath *pa, AngleSample b, const BeamPath *pb) {
+  return a.signature == b.signature &&
+         BeamPathsClose(pa, pb, b.angle - a.angle, job->drift);
+}
+
+// Emits the samples strictly inside (a, b) in angle order, bisecting down to
+// adjacent floats until every gap is SameRoute. pa and pb hold the
+// endpoints' paths; the paths from depth on are free. Returns false if a
+// sample could not be stored.
+static bool Refine(const AdaptiveJob *job, AngleSample a, const BeamPath *pa,
+                   AngleSample b, const BeamPath *pb, BeamPath *paths,
+                   int depth, SampleList *list) {
+  if (depth >= REFINE_DEPTH || SameRoute(job, a, pa, b, pb))
+    return true;
+  float mid = a.angle + (b.angle - a.angle) * 0.5f;
+  if (mid <= a.angle || mid >= b.angle)
+    return true;
+  BeamPath *pm = &paths[depth];
+  AngleSample m = TraceSample(job, mid, pm, list);
+  return Refine(job, a, pa, m, pm, paths, depth + 1, list) &&
+         PushSample(list, m) &&
+         Refine(job, m, pm, b, pb, paths, depth + 1, list);
+}
+
+static void RefineRange(void *ctx, int begin, int end, int worker) {
+  AdaptiveJob *job = ctx;
+  BeamPath *paths = &job->paths[worker * (REFINE_DEPTH + 2)];
+  BeamPath *pa = &paths[REFINE_DEPTH];
+  BeamPath *pb = &paths[REFINE_DEPTH + 1];
+  for (int i = begin; i < end; i++) {
+    SampleList *list = &job->lists[i];
+    AngleSample a =
+        TraceSample(job, IntervalAngle(i, job->intervals), pa, list);
+    AngleSample b =
+        TraceSample(job, IntervalAngle(i + 1, job->intervals), pb, list);
+    list->failed = !PushSample(list, a) ||
+                   !Refine(job, a, pa, b, pb, paths, 0, list) ||
+                   (i == job->intervals - 1 && !PushSample(list, b));
+  }
+}
+
+static bool PushWindow(BeamWindowList *out, BeamWindow window) {
+  if (out->count == out->capacity) {
+    int capacity = out->capacity ? out->capacity * 2 : 16;
+    BeamWindow *windows =
+        realloc(out->windows, sizeof(BeamWindow) * (size_t)capacity);
+    if (!windows)
+      return false;
+    out->windows = windows;
+    out->capacity = capacity;
+  }
+  out->windows[out->count++] = window;
+  return true;
+}
+
+void UnloadBeamWindows(BeamWindowList *list) {
+  free(list->windows);
+  *list = (BeamWindowList){0};
+}
+
+bool SolveStageAdaptive(const StageData *stage, int maxBounces, float maxLength,
+                        int initialSamples, BeamPool *pool,
+                        BeamWindowList *out) {
+  out->count = 0;
+  out->rays = 0;
+  if (!stage->hasGoal || initialSamples < 1)
+    return true;
+
+  int workers = pool ? GetBeamPoolThreads(pool) : 1;
+  int pathCount = workers * (REFINE_DEPTH + 2);
+  AdaptiveJob job = {stage,
+                     maxBounces,
+                     maxLength,
+                     initialSamples,
+                     StageSolveDrift(stage),
+                     calloc((size_t)initialSamples, sizeof(SampleList)),
+                     calloc((size_t)pathCount, sizeof(BeamPath))};
+  if (!job.lists || !job.paths) {
+    free(job.lists);
+    free(job.paths);
+    return false;
+  }
+  if (pool)
+    RunBeamPool(pool, initialSamples, 1, RefineRange, &job);
+  else
+    RefineRange(&job, 0, initialSamples, 0);
+
+  bool ok = true;
+  bool open = false;
+  BeamWindow current = {0};
+  for (int i = 0; i < initialSamples; i++) {
+    const SampleList *list = &job.lists[i];
+    out->rays += list->rays;
+    if (list->failed)
+      ok = false;
+    for (int k = 0; k < list->count; k++) {
+      const AngleSample *s = &list->items[k];
+      if (s->goalBounces < 0) {
+        if (open && !PushWindow(out, current))
+          ok = false;
+        open = false;
+        continue;
+      }
+      if (!open) {
+        current = (BeamWindow){s->angle, s->angle, s->goalBounces};
+        open = true;
+      }
+      current.end = s->angle;
+      if (s->goalBounces < current.bounces)
+        current.bounces = s->goalBounces;
+    }
+  }
+  if (open && !PushWindow(out, current))
+    ok = false;
+
+  // -pi and pi are the same direction: join a window touching both ends.
+  if (out->count > 1 && out->windows[0].start == -BEAM_PI &&
+      out->windows[out->count - 1].end == BEAM_PI) {
+    BeamWindow *last = &out->windows[out->count - 1];
+    last->end = out->windows[0].end + 2.0f * BEAM_PI;
+    if (out->windows[0].bounces < last->bounces)
+      last->bounces = out->windows[0].bounces;
+    memmove(out->windows, out->windows + 1,
+            sizeof(BeamWindow) * (size_t)(out->count - 1));
+    out->count--;
+  }
+
+  for (int i = 0; i < initialSamples; i++)
+    free(job.lists[i].items);
+  free(job.lists);
+  for (int i = 0; i < pathCount; i++)
+    UnloadBeamPath(&job.paths[i]);
+  free(job.paths);
+  return ok;
+}
@@ -0,0 +1,531 @@
+#include "beamtrace.h"
+#include "cJSON.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool RayIntersectCircle(Vector2 pos, Vector2 dir, Vector2 center, float radius,
+                        float *tHit, Vector2 *normal) {
+  Vector2 m = {pos.x - center.x, pos.y - center.y};
+  float b = m.x * dir.x + m.y * dir.y;
+  float c = m.x * m.x + m.y * m.y - radius * radius;
+  // Leaving the circle, including from a reflection point that rounded to
+  // just inside the surface, is not a hit.
+  if (b > 0.0f && c > -0.0001f * (radius * radius))
+    return false;
+  float discr = b * b - c;
+  if (discr < 0.0f)
+    return false;
+  float t = -b - sqrtf(discr);
+  if (t < 0.0f)
+    t = 0.0f;
+  if (tHit)
+    *tHit = t;
+  if (normal) {
+    Vector2 hit = {pos.x + dir.x * t, pos.y + dir.y * t};
+    Vector2 n = {hit.x - center.x, hit.y - center.y};
+    float len = sqrtf(n.x * n.x + n.y * n.y);
+    if (len > 0.0001f) {
+      n.x /= len;
+      n.y /= len;
+    }
+    *normal = n;
+  }
+  return true;
+}
+
+bool RayIntersectRect(Vector2 pos, Vector2 dir, Rectangle rect, float *tHit,
+                      Vector2 *normal) {
+  if (pos.x > rect.x && pos.x < rect.x + rect.width && pos.y > rect.y &&
+      pos.y < rect.y + rect.height)
+    return false;
+
+  float tmin = -INFINITY;
+  float tmax = INFINITY;
+  Vector2 n = {0.0f, 0.0f};
+
+  if (fabsf(dir.x) < 0.0001f) {
+    if (pos.x < rect.x || pos.x > rect.x + rect.width)
+      return false;
+  } else {
+    float tx1 = (rect.x - pos.x) / dir.x;
+    float tx2 = (rect.x + rect.width - pos.x) / dir.x;
+    float tEntry = tx1 < tx2 ? tx1 : tx2;
+    float tExit = tx1 < tx2 ? tx2 : tx1;
+    Vector2 nEntry = tx1 < tx2 ? (Vector2){-1.0f, 0.0f}
+                               : (Vector2){1.0f, 0.0f};
+    if (tEntry > tmin) {
+      tmin = tEntry;
+      n = nEntry;
+    }
+    if (tExit < tmax)
+      tmax = tExit;
+  }
+
+  if (fabsf(dir.y) < 0.0001f) {
+    if (pos.y < rect.y || pos.y > rect.y + rect.height)
+      return false;
+  } else {
+    float ty1 = (rect.y - pos.y) / dir.y;
+    float ty2 = (rect.y + rect.height - pos.y) / dir.y;
+    float tEntry = ty1 < ty2 ? ty1 : ty2;
+    float tExit = ty1 < ty2 ? ty2 : ty1;
+    Vector2 nEntry = ty1 < ty2 ? (Vector2){0.0f, -1.0f}
+                               : (Vector2){0.0f, 1.0f};
+    if (tEntry > tmin) {
+      tmin = tEntry;
+      n = nEntry;
+    }
+    if (tExit < tmax)
+      tmax = tExit;
+  }
+
+  if (tmax < tmin || tmax < 0.0f)
+    return false;
+  if (tmin < 0.0001f)
+    return false;
+
+  if (tHit)
+    *tHit = tmin;
+  if (normal)
+    *normal = n;
+  return true;
+}
+
+bool RayIntersectWalls(Vector2 pos, Vector2 dir, float xMin, float xMax,
+                       float yMin, float yMax, float *tHit, Vector2 *normal) {
+  float bestT = INFINITY;
+  Vector2 bestN = {0.0f, 0.0f};
+  bool hit = false;
+
+  if (dir.x > 0.0001f) {
+    float t = (xMax - pos.x) / dir.x;
+    float y = pos.y + dir.y * t;
+    if (t > 0.0001f && y >= yMin && y <= yMax && t < bestT) {
+      bestT = t;
+      bestN = (Vector2){-1.0f, 0.0f};
+      hit = true;
+    }
+  } else if (dir.x < -0.0001f) {
+    float t = (xMin - pos.x) / dir.x;
+    float y = pos.y + dir.y * t;
+    if (t > 0.0001f && y >= yMin && y <= yMax && t < bestT) {
+      bestT = t;
+      bestN = (Vector2){1.0f, 0.0f};
+      hit = true;
+    }
+  }
+
+  if (dir.y > 0.0001f) {
+    float t = (yMax - pos.y) / dir.y;
+    float x = pos.x + dir.x * t;
+    if (t > 0.0001f && x >= xMin && x <= xMax && t < bestT) {
+      bestT = t;
+      bestN = (Vector2){0.0f, -1.0f};
+      hit = true;
+    }
+  } else if (dir.y < -0.0001f) {
+    float t = (yMin - pos.y) / dir.y;
+    float x = pos.x + dir.x * t;
+    if (t > 0.0001f && x >= xMin && x <= xMax && t < bestT) {
+      bestT = t;
+      bestN = (Vector2){0.0f, 1.0f};
+      hit = true;
+    }
+  }
+
+  if (!hit)
+    return false;
+  if (tHit)
+    *tHit = bestT;
+  if (normal)
+    *normal = bestN;
+  return true;
+}
+
+static void ClosestObstacleBrute(const StageData *stage, Vector2 pos,
+                                 Vector2 dir, BeamHit *hit) {
+  if (stage->stats)
+    stage->stats->obstacleTests += stage->rectCount + stage->circleCount;
+  for (int i = 0; i < stage->rectCount; i++) {
+    float tRect = 0.0f;
+    Vector2 nRect = {0.0f, 0.0f};
+    if (RayIntersectRect(pos, dir, stage->rects[i], &tRect, &nRect) &&
+        tRect < hit->t) {
+      hit->t = tRect;
+      hit->normal = nRect;
+      hit->kind = BEAM_HIT_RECT;
+      hit->index = i;
+    }
+  }
+
+  for (int i = 0; i < stage->circleCount; i++) {
+    float tCircle = 0.0f;
+    Vector2 nCircle = {0.0f, 0.0f};
+    if (RayIntersectCircle(pos, dir, stage->circlePos[i],
+                           stage->circleRadius[i], &tCircle, &nCircle) &&
+        tCircle < hit->t) {
+      hit->t = tCircle;
+      hit->normal = nCircle;
+      hit->kind = BEAM_HIT_CIRCLE;
+      hit->index = i;
+    }
+  }
+}
+
+static void ClosestObstacleSimd(const StageData *stage, Vector2 pos,
+                                Vector2 dir, BeamHit *hit) {
+  if (stage->stats)
+    stage->stats->obstacleTests += stage->rectCount + stage->circleCount;
+  Vector2 nRect = {0.0f, 0.0f};
+  int rect = RayIntersectRectsSoA(&stage->rectSoA, pos, dir, &hit->t, &nRect);
+  if (rect >= 0) {
+    hit->normal = nRect;
+    hit->kind = BEAM_HIT_RECT;
+    hit->index = rect;
+  }
+
+  Vector2 nCircle = {0.0f, 0.0f};
+  int circle =
+      RayIntersectCirclesSoA(&stage->circleSoA, pos, dir, &hit->t, &nCircle);
+  if (circle >= 0) {
+    hit->normal = nCircle;
+    hit->kind = BEAM_HIT_CIRCLE;
+    hit->index = circle;
+  }
+}
+
+void StageClosestHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                     BeamHit *hit) {
+  hit->normal = (Vector2){0.0f, 0.0f};
+  hit->kind = BEAM_HIT_NONE;
+  hit->index = -1;
+  if (stage->stats)
+    stage->stats->searches++;
+
+  const Rectangle field = stage->field;
+  float tWall = 0.0f;
+  Vector2 nWall = {0.0f, 0.0f};
+  if (RayIntersectWalls(pos, dir, field.x, field.x + field.width, field.y,
+                        field.y + field.height, &tWall, &nWall) &&
+      tWall < hit->t) {
+    hit->t = tWall;
+    hit->normal = nWall;
+    hit->kind = BEAM_HIT_WALL;
+  }
+
+  switch (stage->accel) {
+  case STAGE_ACCEL_BVH:
+    if (stage->bvh.nodeCount > 0) {
+      StageBvhClosestHit(stage, pos, dir, hit);
+      break;
+    }
+    ClosestObstacleBrute(stage, pos, dir, hit);
+    break;
+  case STAGE_ACCEL_SIMD:
+    ClosestObstacleSimd(stage, pos, dir, hit);
+    break;
+  case STAGE_ACCEL_GRID:
+    if (stage->grid.cellStart && StageGridClosestHit(stage, pos, dir, hit))
+      break;
+    ClosestObstacleBrute(stage, pos, dir, hit);
+    break;
+  case STAGE_ACCEL_PLUGIN:
+    if (stage->pluginHit) {
+      if (stage->stats)
+        stage->stats->obstacleTests += stage->rectCount + stage->circleCount;
+      stage->pluginHit(pos, dir, hit);
+      break;
+    }
+    ClosestObstacleBrute(stage, pos, dir, hit);
+    break;
+  default:
+    ClosestObstacleBrute(stage, pos, dir, hit);
+    break;
+  }
+}
+
+BeamSegment *PushBeamSegment(BeamPath *path) {
+  if (path->segmentCount == path->segmentCapacity) {
+    int capacity = path->segmentCapacity ? path->segmentCapacity * 2 : 16;
+    BeamSegment *segments =
+        realloc(path->segments, sizeof(BeamSegment) * (size_t)capacity);
+    if (!segments)
+      return NULL;
+    path->segments = segments;
+    path->segmentCapacity = capacity;
+  }
+  return &path->segments[path->segmentCount++];
+}
+
+void UnloadBeamPath(BeamPath *path) {
+  free(path->segments);
+  *path = (BeamPath){0};
+}
+
+void ResetBeamLoop(BeamLoop *loop) {
+  *loop = (BeamLoop){.kind = BEAM_HIT_NONE, .index = -1, .power = 1};
+}
+
+bool BeamLoopRepeats(BeamLoop *loop, const BeamSegment *seg, Vector2 dir) {
+  const float dirEpsilon = BEAM_LOOP_EPSILON * 0.001f;
+  if (seg->hitKind == loop->kind && seg->hitIndex == loop->index &&
+      fabsf(seg->end.x - loop->pos.x) <= BEAM_LOOP_EPSILON &&
+      fabsf(seg->end.y - loop->pos.y) <= BEAM_LOOP_EPSILON &&
+      fabsf(dir.x - loop->dir.x) <= dirEpsilon &&
+      fabsf(dir.y - loop->dir.y) <= dirEpsilon)
+    return true;
+  if (++loop->steps == loop->power) {
+    loop->pos = seg->end;
+    loop->dir = dir;
+    loop->kind = seg->hitKind;
+    loop->index = seg->hitIndex;
+    loop->power *= 2;
+    loop->steps = 0;
+  }
+  return false;
+}
+
+void TraceBeam(const StageData *stage, Vector2 origin, Vector2 dir,
+               int maxBounces, float maxLength, BeamPath *path) {
+  path->segmentCount = 0;
+  path->hitGoal = false;
+  path->end = BEAM_END_LENGTH;
+  float dirLen = sqrtf(dir.x * dir.x + dir.y * dir.y);
+  if (dirLen <= 0.0001f)
+    return;
+  dir.x /= dirLen;
+  dir.y /= dirLen;
+
+  Vector2 pos = origin;
+  float remaining = maxLength;
+  float traveled = 0.0f;
+  int bounces = 0;
+  BeamLoop loop;
+  ResetBeamLoop(&loop);
+  while (remaining > 0.0f && bounces <= maxBounces) {
+    BeamHit hit = {remaining};
+    StageClosestHit(stage, pos, dir, &hit);
+
+    BeamSegment *seg = PushBeamSegment(path);
+    if (!seg) {
+      path->end = BEAM_END_STUCK;
+      return;
+    }
+    seg->start = pos;
+    seg->startDist = traveled;
+
+    if (stage->hasGoal) {
+      float tGoal = 0.0f;
+      if (RayIntersectCircle(pos, dir, stage->goalPos, stage->goalRadius,
+                             &tGoal, NULL) &&
+          tGoal <= hit.t && tGoal <= remaining) {
+        seg->end = (Vector2){pos.x + dir.x * tGoal, pos.y + dir.y * tGoal};
+        seg->endDist = traveled + tGoal;
+        seg->normal = (Vector2){0.0f, 0.0f};
+        seg->hitKind = BEAM_HIT_GOAL;
+        seg->hitIndex = -1;
+        path->hitGoal = true;
+        path->end = BEAM_END_GOAL;
+        return;
+      }
+    }
+
+    Vector2 hitPos = {pos.x + dir.x * hit.t, pos.y + dir.y * hit.t};
+    remaining -= hit.t;
+    traveled += hit.t;
+    seg->end = hitPos;
+    seg->endDist = traveled;
+    seg->normal = hit.normal;
+    seg->hitKind = hit.kind;
+    seg->hitIndex = hit.index;
+
+    if (hit.kind == BEAM_HIT_NONE)
+      return;
+    if (hit.t <= 0.0001f) {
+      path->end = BEAM_END_STUCK;
+      return;
+    }
+
+    float dot = dir.x * hit.normal.x + dir.y * hit.normal.y;
+    dir.x = dir.x - 2.0f * dot * hit.normal.x;
+    dir.y = dir.y - 2.0f * dot * hit.normal.y;
+    pos = hitPos;
+    bounces++;
+    if (stage->stopLoops && BeamLoopRepeats(&loop, seg, dir)) {
+      path->end = BEAM_END_LOOP;
+      return;
+    }
+  }
+  if (bounces > maxBounces)
+    path->end = BEAM_END_BOUNCES;
+}
+
+unsigned long long BeamPathSignature(const BeamPath *path) {
+  unsigned long long hash = 1469598103934665603ULL;
+  for (int i = 0; i < path->segmentCount; i++) {
+    unsigned int key = (unsigned int)path->segments[i].hitKind << 24 ^
+                       (unsigned int)(path->segments[i].hitIndex + 1);
+    for (int b = 0; b < 4; b++) {
+      hash ^= (key >> (b * 8)) & 0xffu;
+      hash *= 1099511628211ULL;
+    }
+  }
+  hash ^= (unsigned int)path->end;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+static bool ReadFloat(cJSON *obj, const char *key, float *outValue) {
+  cJSON *item = cJSON_GetObjectItemCaseSensitive(obj, key);
+  if (!cJSON_IsNumber(item))
+    return false;
+  *outValue = (float)item->valuedouble;
+  return true;
+}
+
+void ResetStage(StageData *stage) {
+  UnloadStagePlugin(stage);
+  UnloadStageBvh(stage);
+  UnloadStageGrid(stage);
+  UnloadStageRectSoA(stage);
+  UnloadStageCircleSoA(stage);
+  free(stage->arena);
+  stage->arena = NULL;
+  stage->rects = NULL;
+  stage->circlePos = NULL;
+  stage->circleRadius = NULL;
+  stage->rectCapacity = 0;
+  stage->circleCapacity = 0;
+  stage->rectCount = 0;
+  stage->circleCount = 0;
+  stage->goalPos = (Vector2){0.0f, 0.0f};
+  stage->goalRadius = 0.0f;
+  stage->hasGoal = false;
+  stage->field = (Rectangle){
+      (float)STAGE_WALL_THICKNESS, (float)STAGE_WALL_THICKNESS,
+      (float)(STAGE_SCREEN_WIDTH - STAGE_WALL_THICKNESS * 2),
+      (float)(STAGE_SCREEN_HEIGHT - STAGE_WALL_THICKNESS * 2)};
+  stage->start = (Vector2){(float)STAGE_SCREEN_WIDTH / 2.0f,
+                           (float)STAGE_SCREEN_HEIGHT / 2.0f};
+  stage->maxBounces = BEAM_DEFAULT_MAX_BOUNCES;
+  stage->accel = STAGE_ACCEL_BVH;
+}
+
+bool ReserveStageObstacles(StageData *stage, int rects, int circles) {
+  if (rects < 0 || circles < 0)
+    return false;
+  size_t rectBytes = sizeof(Rectangle) * (size_t)rects;
+  size_t posBytes = sizeof(Vector2) * (size_t)circles;
+  size_t radiusBytes = sizeof(float) * (size_t)circles;
+  char *arena = malloc(rectBytes + posBytes + radiusBytes + 1);
+  if (!arena)
+    return false;
+  free(stage->arena);
+  stage->arena = arena;
+  stage->rects = (Rectangle *)arena;
+  stage->circlePos = (Vector2 *)(arena + rectBytes);
+  stage->circleRadius = (float *)(arena + rectBytes + posBytes);
+  stage->rectCapacity = rects;
+  stage->circleCapacity = circles;
+  stage->rectCount = 0;
+  stage->circleCount = 0;
+  return true;
+}
+
+void PrepareStage(StageData *stage) {
+  BuildStageBvh(stage);
+  BuildStageGrid(stage, 0, 0);
+  BuildStageRectSoA(stage);
+  BuildStageCircleSoA(stage);
+}
+
+void UnloadStage(StageData *stage) { ResetStage(stage); }
+
+static char *ReadTextFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+  char *text = NULL;
+  if (fseek(file, 0, SEEK_END) == 0) {
+    long size = ftell(file);
+    if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+      text = malloc((size_t)size + 1);
+      if (text) {
+        size_t read = fread(text, 1, (size_t)size, file);
+        text[read] = '\0';
+      }
+    }
+  }
+  fclose(file);
+  return text;
+}
+
+bool LoadStage(const char *path, StageData *stage) {
+  ResetStage(stage);
+  char *text = ReadTextFile(path);
+  if (!text)
+    return false;
+
+  cJSON *root = cJSON_Parse(text);
+  if (!root) {
+    free(text);
+    return false;
+  }
+
+  cJSON *rects = cJSON_GetObjectItemCaseSensitive(root, "rects");
+  cJSON *circles = cJSON_GetObjectItemCaseSensitive(root, "circles");
+  int rectCount = cJSON_IsArray(rects) ? cJSON_GetArraySize(rects) : 0;
+  int circleCount = cJSON_IsArray(circles) ? cJSON_GetArraySize(circles) : 0;
+  if (!ReserveStageObstacles(stage, rectCount, circleCount)) {
+    cJSON_Delete(root);
+    free(text);
+    return false;
+  }
+
+  if (cJSON_IsArray(rects)) {
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, rects) {
+      float x, y, w, h;
+      if (!ReadFloat(item, "x", &x) || !ReadFloat(item, "y", &y) ||
+          !ReadFloat(item, "w", &w) || !ReadFloat(item, "h", &h))
+        continue;
+      stage->rects[stage->rectCount++] = (Rectangle){x, y, w, h};
+    }
+  }
+
+  if (cJSON_IsArray(circles)) {
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, circles) {
+      float x, y, r;
+      if (!ReadFloat(item, "x", &x) || !ReadFloat(item, "y", &y) ||
+          !ReadFloat(item, "r", &r))
+        continue;
+      stage->circlePos[stage->circleCount] = (Vector2){x, y};
+      stage->circleRadius[stage->circleCount] = r;
+      stage->circleCount++;
+    }
+  }
+
+  cJSON *goal = cJSON_GetObjectItemCaseSensitive(root, "goal");
+  if (cJSON_IsObject(goal)) {
+    float x, y, r;
+    if (ReadFloat(goal, "x", &x) && ReadFloat(goal, "y", &y) &&
+        ReadFloat(goal, "r", &r)) {
+      stage->goalPos = (Vector2){x, y};
+      stage->goalRadius = r;
+      stage->hasGoal = true;
+    }
+  }
+
+  float maxBounces;
+  if (ReadFloat(root, "maxBounces", &maxBounces))
+    stage->maxBounces = maxBounces < 0.0f               ? 0
+                        : maxBounces > BEAM_MAX_BOUNCES ? BEAM_MAX_BOUNCES
+                                                        : (int)maxBounces;
+
+  cJSON_Delete(root);
+  free(text);
+  PrepareStage(stage);
+  return true;
+}
@@ -0,0 +1,483 @@
+#ifndef BEAMTRACE_H
+#define BEAMTRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Geometry types are layout-compatible with raylib's. Include raylib.h before
+// this header when both are used so its definitions win.
+#if !defined(RAYLIB_H) && !defined(RL_VECTOR2_TYPE)
+typedef struct Vector2 {
+  float x;
+  float y;
+} Vector2;
+#define RL_VECTOR2_TYPE
+#endif
+
+#if !defined(RAYLIB_H) && !defined(RL_RECTANGLE_TYPE)
+typedef struct Rectangle {
+  float x;
+  float y;
+  float width;
+  float height;
+} Rectangle;
+#define RL_RECTANGLE_TYPE
+#endif
+
+#define STAGE_SCREEN_WIDTH 1200
+#define STAGE_SCREEN_HEIGHT 900
+#define STAGE_WALL_THICKNESS 40
+
+#define BEAM_PI 3.14159265358979323846f
+#define BEAM_DEFAULT_MAX_BOUNCES 6
+#define BEAM_MAX_BOUNCES 65535
+#define BEAM_DEFAULT_LENGTH 10000.0f
+// Two bounces leaving the same object from points this close, in the same
+// direction to within BEAM_LOOP_EPSILON * 0.001, count as one state.
+#define BEAM_LOOP_EPSILON 0.001f
+
+#define BEAM_PACKET_MAX 16
+
+enum { BEAM_HIT_NONE, BEAM_HIT_WALL, BEAM_HIT_RECT, BEAM_HIT_CIRCLE, BEAM_HIT_GOAL };
+
+// Why a trace stopped.
+enum {
+  BEAM_END_LENGTH,  // maxLength used up
+  BEAM_END_BOUNCES, // maxBounces reflections made
+  BEAM_END_GOAL,
+  BEAM_END_LOOP,    // the path repeats itself from here on (stopLoops only)
+  BEAM_END_STUCK,   // wedged in a corner, or out of memory for segments
+};
+
+typedef enum StageAccel {
+  STAGE_ACCEL_BRUTE, // linear scan over every obstacle, the reference path
+  STAGE_ACCEL_BVH,
+  STAGE_ACCEL_GRID, // uniform grid walked with a 2D DDA, for dense stages
+  STAGE_ACCEL_SIMD, // linear scan using the vectorized kernels
+  STAGE_ACCEL_PLUGIN, // code generated for this stage, see LoadStagePlugin
+} StageAccel;
+
+typedef enum BeamKernel {
+  BEAM_KERNEL_SCALAR,
+  BEAM_KERNEL_SSE2,
+  BEAM_KERNEL_AVX2,
+} BeamKernel;
+
+typedef struct StageBvhNode {
+  float minX, minY, maxX, maxY;
+  int first; // left child for inner nodes (right is first + 1), prim slot for leaves
+  int count; // primitives in a leaf, 0 for inner nodes
+} StageBvhNode;
+
+// Obstacle ids in prims follow the brute-force scan order: rects are
+// 0..rectCount-1, circles follow at rectCount + i.
+typedef struct StageBvh {
+  StageBvhNode *nodes;
+  int nodeCount;
+  int *prims;
+  int primCount;
+} StageBvh;
+
+// Uniform grid over the playfield. Cell (cx, cy) lists the obstacle ids (same
+// numbering as StageBvh) in items[cellStart[i]..cellStart[i + 1]) where
+// i = cy * cols + cx.
+typedef struct StageGrid {
+  float minX, minY;
+  float cellW, cellH;
+  int cols, rows;
+  int *cellStart;
+  int *items;
+} StageGrid;
+
+// Rects as aligned float lanes, padded with never-hit entries to a multiple
+// of 8. x2s/y2s hold x + width and y + height.
+typedef struct StageRectSoA {
+  float *xs;
+  float *ys;
+  float *x2s;
+  float *y2s;
+  int count;
+  int padded;
+} StageRectSoA;
+
+// Circles as aligned lanes with squared radii, padded like StageRectSoA.
+typedef struct StageCircleSoA {
+  float *xs;
+  float *ys;
+  float *r2s;
+  int count;
+  int padded;
+} StageCircleSoA;
+
+// Work counters for benchmarking. While StageData.stats points at one, every
+// closest-hit search on the stage adds to it. The updates are not atomic:
+// leave stats NULL when tracing from several threads.
+typedef struct BeamStats {
+  long long searches;      // closest-hit searches, one per path segment
+  long long obstacleTests; // ray-vs-rect and ray-vs-circle tests
+  long long nodeTests;     // BVH node boxes tested, or grid cells visited
+} BeamStats;
+
+struct BeamHit;
+// Closest-obstacle search compiled for one stage; walls are not included.
+typedef void (*StageObstacleFn)(Vector2 pos, Vector2 dir, struct BeamHit *hit);
+
+// Obstacle arrays live in one arena allocation owned by the stage, sized by
+// ReserveStageObstacles.
+typedef struct StageData {
+  int rectCount;
+  Rectangle *rects;
+  int circleCount;
+  Vector2 *circlePos;
+  float *circleRadius;
+  int rectCapacity;
+  int circleCapacity;
+  void *arena;
+  Vector2 goalPos;
+  float goalRadius;
+  bool hasGoal;
+  Rectangle field; // wall-bounded playfield the beam reflects inside
+  Vector2 start;   // where the player fires from
+  int maxBounces;  // bounce budget, "maxBounces" in the stage file
+  // End traces with BEAM_END_LOOP once the path repeats. Off by default, so
+  // the game draws every bounce; headless solvers that only need the outcome
+  // turn it on. Kept by ResetStage and LoadStage.
+  bool stopLoops;
+  StageAccel accel;
+  StageBvh bvh;
+  StageGrid grid;
+  StageRectSoA rectSoA;
+  StageCircleSoA circleSoA;
+  void *plugin; // dlopen handle, released by ResetStage
+  StageObstacleFn pluginHit;
+  BeamStats *stats; // optional, kept by ResetStage and LoadStage
+} StageData;
+
+typedef struct BeamSegment {
+  Vector2 start;
+  Vector2 end;
+  Vector2 normal; // surface normal at end, zero when nothing was hit
+  float startDist;
+  float endDist;
+  int hitKind;
+  int hitIndex;
+} BeamSegment;
+
+typedef struct BeamHit {
+  float t;
+  Vector2 normal;
+  int kind;
+  int index;
+} BeamHit;
+
+// segments grows as needed and is reused by later traces into the same path.
+// Zero-initialize a path before its first trace and free it with
+// UnloadBeamPath.
+typedef struct BeamPath {
+  int segmentCount;
+  int segmentCapacity;
+  BeamSegment *segments;
+  bool hitGoal;
+  int end; // BEAM_END_*
+} BeamPath;
+
+// Cycle check over the states a beam leaves its bounces in. The state is
+// compared with one saved at doubling intervals (Brent's method), so a
+// periodic path is caught within a few periods using constant memory.
+typedef struct BeamLoop {
+  Vector2 pos;
+  Vector2 dir;
+  int kind;
+  int index;
+  int power;
+  int steps;
+} BeamLoop;
+
+bool RayIntersectCircle(Vector2 pos, Vector2 dir, Vector2 center, float radius,
+                        float *tHit, Vector2 *normal);
+bool RayIntersectRect(Vector2 pos, Vector2 dir, Rectangle rect, float *tHit,
+                      Vector2 *normal);
+bool RayIntersectWalls(Vector2 pos, Vector2 dir, float xMin, float xMax,
+                       float yMin, float yMax, float *tHit, Vector2 *normal);
+
+// Closest rect strictly nearer than *tHit under RayIntersectRect's rules, or
+// -1. Ties go to the lowest index, as in a scalar scan.
+int RayIntersectRectsSoA(const StageRectSoA *soa, Vector2 pos, Vector2 dir,
+                         float *tHit, Vector2 *normal);
+// Closest circle strictly nearer than *tHit under RayIntersectCircle's rules,
+// or -1. Only t is computed per circle; the normal (if requested) is computed
+// once for the winner.
+int RayIntersectCirclesSoA(const StageCircleSoA *soa, Vector2 pos, Vector2 dir,
+                           float *tHit, Vector2 *normal);
+// The widest kernel the CPU supports is picked once, on first stage load,
+// even when stages are built on several threads at a time. Asking for a
+// kernel the CPU lacks falls back to the next narrower one; the kernel
+// actually selected is returned. SetBeamKernel is not synchronized with
+// tracing: call it only while no other thread is tracing, such as in main
+// before any pool starts.
+BeamKernel SetBeamKernel(BeamKernel kernel);
+BeamKernel GetBeamKernel(void);
+
+// Finds the closest wall or obstacle along the ray. hit->t holds the search
+// limit on entry; on return hit describes the winner (kind BEAM_HIT_NONE if
+// nothing is closer than the limit). Every acceleration mode resolves ties
+// exactly like the brute-force scan: walls, then rects, then circles, each in
+// index order.
+void StageClosestHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                     BeamHit *hit);
+
+// Follows a beam from origin through up to maxBounces reflections or until
+// maxLength has been travelled, stopping early once the path is found to
+// repeat if stage->stopLoops is set. dir does not need to be normalized.
+void TraceBeam(const StageData *stage, Vector2 origin, Vector2 dir,
+               int maxBounces, float maxLength, BeamPath *path);
+// Appends a segment, growing the path; NULL if memory runs out.
+BeamSegment *PushBeamSegment(BeamPath *path);
+void UnloadBeamPath(BeamPath *path);
+void ResetBeamLoop(BeamLoop *loop);
+// Records the bounce that ended seg and sent the beam off along dir. True if
+// that state was seen before.
+bool BeamLoopRepeats(BeamLoop *loop, const BeamSegment *seg, Vector2 dir);
+// Traces up to BEAM_PACKET_MAX beams from one origin together, sharing BVH
+// traversal and obstacle loads across lanes; lanes that diverge are masked.
+// paths[i] is identical to TraceBeam's result for dirs[i]. Packets of 4, 8
+// or 16 nearly parallel directions benefit most.
+void TraceBeamPacket(const StageData *stage, Vector2 origin,
+                     const Vector2 *dirs, int count, int maxBounces,
+                     float maxLength, BeamPath *paths);
+
+void BuildStageBvh(StageData *stage);
+void UnloadStageBvh(StageData *stage);
+void StageBvhClosestHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                        BeamHit *hit);
+// True if some obstacle is nearer than hit->t, or equally near with a scan
+// rank below rank. Returns at the first one found.
+bool StageBvhCloserHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                       const BeamHit *hit, int rank);
+// Ids of the obstacles whose (padded) bounds come within margin of segment
+// a-b. Returns how many were stored, or capacity + 1 if there are more.
+int StageBvhSegmentQuery(const StageData *stage, Vector2 a, Vector2 b,
+                         float margin, int *ids, int capacity);
+
+void BuildStageRectSoA(StageData *stage);
+void UnloadStageRectSoA(StageData *stage);
+void BuildStageCircleSoA(StageData *stage);
+void UnloadStageCircleSoA(StageData *stage);
+
+// Picks the cell size from obstacle count and extent; cols/rows of 0 ask for
+// that automatic resolution.
+void BuildStageGrid(StageData *stage, int cols, int rows);
+void UnloadStageGrid(StageData *stage);
+// Returns false, leaving hit untouched, if pos lies outside the grid.
+bool StageGridClosestHit(const StageData *stage, Vector2 pos, Vector2 dir,
+                         BeamHit *hit);
+
+// StageData must be zero-initialized before its first ResetStage/LoadStage.
+// ReserveStageObstacles replaces the obstacle arrays with empty ones holding
+// up to rects/circles entries. PrepareStage rebuilds acceleration structures
+// after obstacles change; LoadStage calls it itself. beambench's load cases
+// time LoadStage on synthetic stage files.
+void ResetStage(StageData *stage);
+bool ReserveStageObstacles(StageData *stage, int rects, int circles);
+void PrepareStage(StageData *stage);
+bool LoadStage(const char *path, StageData *stage);
+void UnloadStage(StageData *stage);
+
+#define BEAM_CORRIDOR_IDS 64
+
+// What RetraceBeam remembers about one step of the last path: the segment,
+// the object it ended on and the obstacles near it.
+typedef struct BeamCorridor {
+  Vector2 start;
+  Vector2 end;
+  float slack; // how far the endpoints may move while ids stays complete
+  int kind;
+  int index;
+  int count; // -1 if there is no list
+  int ids[BEAM_CORRIDOR_IDS];
+} BeamCorridor;
+
+#define BEAM_RETRACE_STEPS 64
+
+typedef struct BeamRetrace {
+  BeamCorridor steps[BEAM_RETRACE_STEPS];
+  int stepCount;
+} BeamRetrace;
+
+// TraceBeam for a ray that moves a little between calls, such as the aim
+// while it rotates. Each bounce first tries the object hit at that step last
+// time; if the new segment stays within the old one's corridor only the
+// obstacles listed there are checked for anything closer. Outside it, the
+// guess is confirmed with StageBvhCloserHit, which stops at the first
+// obstacle in front of it. Only a guess that fails gets a full search, as
+// does every step after it and every step past BEAM_RETRACE_STEPS. The
+// result is identical to TraceBeam's.
+// Zero-initialize state, and call ResetBeamRetrace whenever the stage
+// changes. Returns the number of full searches made.
+int RetraceBeam(const StageData *stage, Vector2 origin, Vector2 dir,
+                int maxBounces, float maxLength, BeamRetrace *state,
+                BeamPath *path);
+void ResetBeamRetrace(BeamRetrace *state);
+
+// Hash of the hit sequence (object kind and index per segment, including a
+// final goal or miss) and of how the path ended. Rays with equal signatures
+// took the same route.
+unsigned long long BeamPathSignature(const BeamPath *path);
+
+// Fixed set of worker threads for data-parallel loops. RunBeamPool splits
+// [0, count) into chunks handed out dynamically to the workers and the
+// calling thread; worker is in [0, GetBeamPoolThreads()) so callers can keep
+// per-thread scratch. threads <= 0 uses every online CPU.
+typedef void (*BeamJobFn)(void *ctx, int begin, int end, int worker);
+typedef struct BeamPool BeamPool;
+BeamPool *CreateBeamPool(int threads);
+void DestroyBeamPool(BeamPool *pool);
+int GetBeamPoolThreads(const BeamPool *pool);
+void RunBeamPool(BeamPool *pool, int count, int chunk, BeamJobFn fn,
+                 void *ctx);
+
+typedef struct BeamWindow {
+  float start; // first angle that reaches the goal
+  float end;   // last one; exceeds pi for a window that wraps around
+  int bounces; // fewest bounces needed inside the window
+} BeamWindow;
+
+typedef struct BeamWindowList {
+  BeamWindow *windows;
+  int count;
+  int capacity;
+  long long rays; // traces spent finding them
+} BeamWindowList;
+
+// Narrowest gap between two angles with equal paths that SolveStageAdaptive
+// still splits, in radians, and the least drift it splits on, in pixels.
+#define BEAM_SOLVE_MIN_WIDTH 5e-7f
+#define BEAM_SOLVE_MIN_DRIFT 1.0f
+
+// Finds every firing angle from stage->start that reaches the goal. The
+// circle is cut into initialSamples intervals. An interval whose endpoints'
+// path signatures differ is split down to adjacent floats, so window edges
+// are exact to float precision. One whose signatures agree is still split
+// while some bounce point moves further between its endpoints than the goal
+// radius or the smallest obstacle (at least BEAM_SOLVE_MIN_DRIFT), or while
+// both beams end wedged, down to BEAM_SOLVE_MIN_WIDTH, so windows opening
+// and closing between two samples are found too. Chaotic stages can take
+// millions of rays. pool may be NULL. Returns false if it runs out of
+// memory, leaving out incomplete.
+bool SolveStageAdaptive(const StageData *stage, int maxBounces, float maxLength,
+                        int initialSamples, BeamPool *pool,
+                        BeamWindowList *out);
+void UnloadBeamWindows(BeamWindowList *list);
+// Smallest feature a beam could sweep right across between two traces
+// without either of them touching it: the goal, or an obstacle it might
+// glance off into the goal. At least BEAM_SOLVE_MIN_DRIFT.
+float StageSolveDrift(const StageData *stage);
+// For two paths with equal BeamPathSignature fired width radians apart:
+// true if every beam between them must take the same route, because they
+// are closer than BEAM_SOLVE_MIN_WIDTH or no bounce point moves further
+// than drift. The solvers split anything else.
+bool BeamPathsClose(const BeamPath *a, const BeamPath *b, float width,
+                    float drift);
+
+// Outcome of one firing angle from stage->start.
+typedef struct BeamOutcome {
+  int firstIndex;          // index of the first object hit, -1 for none
+  unsigned char firstKind; // BEAM_HIT_* of the first object hit
+  unsigned char hitGoal;
+  unsigned short bounces; // reflections before the beam stopped
+} BeamOutcome;
+
+// Trace outcomes over size evenly spaced angles starting at -pi (the same
+// grid as solve's sweep). entries is either heap memory or a read-only
+// mapping of the cache file.
+typedef struct BeamLut {
+  const BeamOutcome *entries;
+  int size;
+  int maxBounces;
+  float maxLength;
+  bool stopLoops; // traced with stage->stopLoops, recorded in the cache
+  unsigned long long stageHash;
+  bool cached; // entries came from the cache file
+  void *mapping;
+  size_t mappingSize;
+  BeamOutcome *owned;
+} BeamLut;
+
+// Hash of everything that affects a trace: obstacles, goal, field and start.
+unsigned long long StageContentHash(const StageData *stage);
+float BeamLutAngle(int i, int size);
+// Maps the cache file "<stagePath>.<size>.lut" when its header matches the
+// stage hash and trace parameters; otherwise traces every angle (on pool if
+// not NULL) and rewrites the cache. stagePath may be NULL to skip the cache.
+bool LoadBeamLut(const char *stagePath, const StageData *stage, int size,
+                 int maxBounces, float maxLength, BeamPool *pool,
+                 BeamLut *lut);
+void UnloadBeamLut(BeamLut *lut);
+// Outcome at the nearest table angle.
+BeamOutcome LookupBeamLut(const BeamLut *lut, float angle);
+
+#define BEAM_HEAT_UNREACHED 0xffff
+
+// Where beams fired from one point travel. coverage[y * width + x] is the
+// number of times the pixel was crossed divided by the ray count, and
+// minBounces the fewest bounces any beam had made when it got there
+// (BEAM_HEAT_UNREACHED if none did). Pixels are one unit square from (0, 0).
+typedef struct BeamHeatmap {
+  int width;
+  int height;
+  float *coverage;
+  unsigned short *minBounces;
+  long long rays;
+  long long goalRays;
+} BeamHeatmap;
+
+// Traces rays evenly spaced angles (the BeamLutAngle spacing) from origin,
+// on pool if not NULL, and rasterizes every segment into map.
+bool ComputeBeamHeatmap(const StageData *stage, Vector2 origin, int rays,
+                        int maxBounces, float maxLength, int width, int height,
+                        BeamPool *pool, BeamHeatmap *map);
+void UnloadBeamHeatmap(BeamHeatmap *map);
+// Writes 8-bit PGM images: coverage on a log scale, and bounces with the
+// directly lit area brightest. Either path may be NULL.
+bool ExportBeamHeatmap(const BeamHeatmap *map, const char *coveragePath,
+                       const char *bouncesPath);
+
+// SolveStageAdaptive from forwardSamples, plus windows too narrow for it
+// found by tracing backwards: reverseSamples beams leave the goal centre,
+// the routes they take past the start are kept in a hash table, and where
+// neighbouring reverse beams on one route pass either side of the start,
+// the one through it is bisected for and fired back from the start. How
+// wide a route is does not depend on the goal radius, so needle-thin
+// windows cost no more to find than wide ones. Windows whose beams cannot
+// reach the goal centre are left to the forward pass. pool may be NULL.
+// Returns false if it runs out of memory, leaving out incomplete.
+bool SolveStageBidirectional(const StageData *stage, int maxBounces,
+                             float maxLength, int forwardSamples,
+                             int reverseSamples, BeamPool *pool,
+                             BeamWindowList *out);
+
+// Writes C source for a shared object holding stage's closest-obstacle
+// search, every obstacle unrolled with its coordinates as constants. Build
+// it with -O2 -fPIC -shared -ffp-contract=off; the results are bit-identical
+// to STAGE_ACCEL_BRUTE. LoadStagePlugin opens one and checks it was built
+// from this stage (StageContentHash); accel STAGE_ACCEL_PLUGIN then uses it,
+// and falls back to the brute-force scan while none is loaded.
+bool ExportStageSource(const StageData *stage, const char *path);
+bool LoadStagePlugin(StageData *stage, const char *path);
+void UnloadStagePlugin(StageData *stage);
+
+
+// Stage traced by a beam of the given radius instead of a thin ray: out gets
+// the obstacles grown by radius (rects rounded, circles enlarged), the goal
+// grown by it and the walls moved in by it, so the beam's centre line is
+// traced against out at the cost of a thin ray. Each rect becomes rects 2i
+// and 2i + 1 of out, circles keep their index, and the corners of rect i are
+// circles circleCount + 4i.. + 3. out is reset first (zero-initialize it
+// before first use); a plugin is not carried over.
+bool InflateStage(const StageData *stage, float radius, StageData *out);
+// Maps a hit kind and index on InflateStage(stage, radius) back to the
+// obstacle of stage it belongs to.
+void InflatedHitSource(const StageData *stage, float radius, int *kind,
+                       int *index);
+
+#endif
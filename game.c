@@ -1,32 +1,57 @@
 #include "raylib.h"
-#include "cJSON.h"
+#include "beamtrace.h"
+#include "rlgl.h"
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
-#define MAX_STAGE_RECTS 32
-#define MAX_STAGE_CIRCLES 32
-
-typedef struct StageData {
-  int rectCount;
-  Rectangle rects[MAX_STAGE_RECTS];
-  int circleCount;
-  Vector2 circlePos[MAX_STAGE_CIRCLES];
-  float circleRadius[MAX_STAGE_CIRCLES];
-  Vector2 goalPos;
-  float goalRadius;
-  bool hasGoal;
-} StageData;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 typedef struct Ripple {
   Vector2 pos;
   float age;
 } Ripple;
 
-typedef struct Particle {
+#define RIPPLE_TABLE_SEGMENTS 128
+
+typedef struct BatchVertex {
   Vector2 pos;
-  Vector2 vel;
-  float age;
-  float life;
-} Particle;
+  Color color;
+} BatchVertex;
+
+// Colored triangles collected over a frame and submitted together by
+// DrawTriangleBatch.
+typedef struct TriangleBatch {
+  BatchVertex *vertices;
+  int count;
+  int capacity;
+} TriangleBatch;
+
+// Every ring drawn this frame. unit holds cos/sin at RIPPLE_TABLE_SEGMENTS
+// steps around the circle; smaller rings take every 2nd, 4th... entry.
+typedef struct RippleBatch {
+  TriangleBatch triangles;
+  Vector2 unit[RIPPLE_TABLE_SEGMENTS + 1];
+  bool unitReady;
+} RippleBatch;
+
+// Live particles are packed into [0, count) of each lane; a dead one is
+// replaced by the last. Lanes are 16-byte aligned and capacity is a multiple
+// of 4 so updates run whole SSE vectors.
+typedef struct ParticlePool {
+  float *posX;
+  float *posY;
+  float *velX;
+  float *velY;
+  float *age;
+  float *life;
+  int count;
+  int capacity;
+  int maxCapacity;
+  void *arena;
+} ParticlePool;
 
 typedef struct Star {
   Vector2 pos;
@@ -42,700 +67,941 @@ static void AddRipple(Ripple *ripples, int maxRipples, int *nextIndex,
   *nextIndex = (*nextIndex + 1) % maxRipples;
 }
 
-static void AddParticles(Particle *particles, int maxParticles, int count,
-                         Vector2 pos) {
-  for (int i = 0; i < count; i++) {
-    int idx = -1;
-    for (int j = 0; j < maxParticles; j++) {
-      if (particles[j].age < 0.0f) {
-        idx = j;
-        break;
-      }
-    }
-    if (idx < 0)
-      break;
-    float ang = (float)GetRandomValue(0, 359) * DEG2RAD;
-    float spd = (float)GetRandomValue(80, 220);
-    particles[idx].pos = pos;
-    particles[idx].vel = (Vector2){cosf(ang) * spd, sinf(ang) * spd};
-    particles[idx].age = 0.0f;
-    particles[idx].life = 0.35f + (float)GetRandomValue(0, 20) / 100.0f;
+// Appends room for count vertices and returns it, or NULL if memory runs out.
+static BatchVertex *PushTriangleVertices(TriangleBatch *batch, int count) {
+  int needed = batch->count + count;
+  if (needed > batch->capacity) {
+    int capacity = batch->capacity ? batch->capacity : 1024;
+    while (capacity < needed)
+      capacity *= 2;
+    BatchVertex *vertices =
+        realloc(batch->vertices, sizeof(BatchVertex) * (size_t)capacity);
+    if (!vertices)
+      return NULL;
+    batch->vertices = vertices;
+    batch->capacity = capacity;
   }
+  BatchVertex *v = batch->vertices + batch->count;
+  batch->count = needed;
+  return v;
 }
 
-static bool RayIntersectCircle(Vector2 pos, Vector2 dir, Vector2 center,
-                               float radius, float *tHit, Vector2 *normal) {
-  Vector2 m = {pos.x - center.x, pos.y - center.y};
-  float b = m.x * dir.x + m.y * dir.y;
-  float c = m.x * m.x + m.y * m.y - radius * radius;
-  if (c > 0.0f && b > 0.0f)
-    return false;
-  float discr = b * b - c;
-  if (discr < 0.0f)
-    return false;
-  float t = -b - sqrtf(discr);
-  if (t < 0.0f)
-    t = 0.0f;
-  if (tHit)
-    *tHit = t;
-  if (normal) {
-    Vector2 hit = {pos.x + dir.x * t, pos.y + dir.y * t};
-    Vector2 n = {hit.x - center.x, hit.y - center.y};
-    float len = sqrtf(n.x * n.x + n.y * n.y);
-    if (len > 0.0001f) {
-      n.x /= len;
-      n.y /= len;
+// rlgl flushes its own batch when it fills up, so the triangles are fed to
+// it in pieces it can always hold in one go.
+static void DrawTriangleBatch(TriangleBatch *batch) {
+  const int chunk = 3 * 1024;
+  for (int first = 0; first < batch->count; first += chunk) {
+    int count = batch->count - first < chunk ? batch->count - first : chunk;
+    rlCheckRenderBatchLimit(count);
+    rlBegin(RL_TRIANGLES);
+    for (int i = first; i < first + count; i++) {
+      const BatchVertex *v = &batch->vertices[i];
+      rlColor4ub(v->color.r, v->color.g, v->color.b, v->color.a);
+      rlVertex2f(v->pos.x, v->pos.y);
     }
-    *normal = n;
+    rlEnd();
   }
-  return true;
+  batch->count = 0;
 }
 
-static bool RayIntersectRect(Vector2 pos, Vector2 dir, Rectangle rect,
-                             float *tHit, Vector2 *normal) {
-  if (pos.x > rect.x && pos.x < rect.x + rect.width && pos.y > rect.y &&
-      pos.y < rect.y + rect.height)
-    return false;
+static void UnloadTriangleBatch(TriangleBatch *batch) {
+  free(batch->vertices);
+  *batch = (TriangleBatch){0};
+}
 
-  float tmin = -INFINITY;
-  float tmax = INFINITY;
-  Vector2 n = {0.0f, 0.0f};
-
-  if (fabsf(dir.x) < 0.0001f) {
-    if (pos.x < rect.x || pos.x > rect.x + rect.width)
-      return false;
-  } else {
-    float tx1 = (rect.x - pos.x) / dir.x;
-    float tx2 = (rect.x + rect.width - pos.x) / dir.x;
-    float tEntry = tx1 < tx2 ? tx1 : tx2;
-    float tExit = tx1 < tx2 ? tx2 : tx1;
-    Vector2 nEntry = tx1 < tx2 ? (Vector2){-1.0f, 0.0f}
-                               : (Vector2){1.0f, 0.0f};
-    if (tEntry > tmin) {
-      tmin = tEntry;
-      n = nEntry;
-    }
-    if (tExit < tmax)
-      tmax = tExit;
-  }
-
-  if (fabsf(dir.y) < 0.0001f) {
-    if (pos.y < rect.y || pos.y > rect.y + rect.height)
-      return false;
-  } else {
-    float ty1 = (rect.y - pos.y) / dir.y;
-    float ty2 = (rect.y + rect.height - pos.y) / dir.y;
-    float tEntry = ty1 < ty2 ? ty1 : ty2;
-    float tExit = ty1 < ty2 ? ty2 : ty1;
-    Vector2 nEntry = ty1 < ty2 ? (Vector2){0.0f, -1.0f}
-                               : (Vector2){0.0f, 1.0f};
-    if (tEntry > tmin) {
-      tmin = tEntry;
-      n = nEntry;
+// Adds a ring with about one segment per 3 px of its outer circumference.
+static void PushRippleRing(RippleBatch *batch, Vector2 center, float inner,
+                           float outer, Color color) {
+  if (!batch->unitReady) {
+    for (int k = 0; k <= RIPPLE_TABLE_SEGMENTS; k++) {
+      float angle = 2.0f * PI * (float)k / (float)RIPPLE_TABLE_SEGMENTS;
+      batch->unit[k] = (Vector2){cosf(angle), sinf(angle)};
     }
-    if (tExit < tmax)
-      tmax = tExit;
+    batch->unitReady = true;
   }
+  int segments = 8;
+  while (segments < RIPPLE_TABLE_SEGMENTS &&
+         (float)segments * 3.0f < 2.0f * PI * outer)
+    segments *= 2;
+  int step = RIPPLE_TABLE_SEGMENTS / segments;
+
+  BatchVertex *v = PushTriangleVertices(&batch->triangles, segments * 6);
+  if (!v)
+    return;
+  for (int k = 0; k < RIPPLE_TABLE_SEGMENTS; k += step) {
+    Vector2 a = batch->unit[k];
+    Vector2 b = batch->unit[k + step];
+    Vector2 innerA = {center.x + a.x * inner, center.y + a.y * inner};
+    Vector2 innerB = {center.x + b.x * inner, center.y + b.y * inner};
+    Vector2 outerA = {center.x + a.x * outer, center.y + a.y * outer};
+    Vector2 outerB = {center.x + b.x * outer, center.y + b.y * outer};
+    // Same winding as DrawRing.
+    *v++ = (BatchVertex){outerA, color};
+    *v++ = (BatchVertex){innerB, color};
+    *v++ = (BatchVertex){innerA, color};
+    *v++ = (BatchVertex){innerB, color};
+    *v++ = (BatchVertex){outerA, color};
+    *v++ = (BatchVertex){outerB, color};
+  }
+}
 
-  if (tmax < tmin || tmax < 0.0f)
-    return false;
-  if (tmin < 0.0001f)
-    return false;
-
-  if (tHit)
-    *tHit = tmin;
-  if (normal)
-    *normal = n;
-  return true;
+// Writes a triangle in DrawRing's winding, which culling keeps, whichever
+// way round its corners were given.
+static void PutTriangle(BatchVertex *v, BatchVertex a, BatchVertex b,
+                        BatchVertex c) {
+  float cross = (b.pos.x - a.pos.x) * (c.pos.y - a.pos.y) -
+                (b.pos.y - a.pos.y) * (c.pos.x - a.pos.x);
+  v[0] = a;
+  v[1] = cross < 0.0f ? c : b;
+  v[2] = cross < 0.0f ? b : c;
 }
 
-static bool RayIntersectWalls(Vector2 pos, Vector2 dir, float xMin, float xMax,
-                              float yMin, float yMax, float *tHit,
-                              Vector2 *normal) {
-  float bestT = INFINITY;
-  Vector2 bestN = {0.0f, 0.0f};
-  bool hit = false;
-
-  if (dir.x > 0.0001f) {
-    float t = (xMax - pos.x) / dir.x;
-    float y = pos.y + dir.y * t;
-    if (t > 0.0001f && y >= yMin && y <= yMax && t < bestT) {
-      bestT = t;
-      bestN = (Vector2){-1.0f, 0.0f};
-      hit = true;
+// Adds the beam's polyline up to progress as one strip of quads, width
+// 2 * halfWidth, mitered at each bounce. The hue runs along the path the way
+// the single beam colour used to follow the beam's head.
+static void PushBeamStrip(TriangleBatch *batch, const BeamPath *path,
+                          float progress, float halfWidth, float time) {
+  if (path->segmentCount == 0 || path->segments[0].startDist >= progress)
+    return;
+  int last = 0;
+  while (last + 1 < path->segmentCount &&
+         path->segments[last].endDist <= progress &&
+         path->segments[last + 1].startDist < progress)
+    last++;
+
+  // Strip cross-section at each point: the segment start of every segment,
+  // then the (possibly clipped) end of the last one.
+  Vector2 prevLeft = {0}, prevRight = {0};
+  Color prevColor = {0};
+  Vector2 prevDir = {0.0f, 0.0f};
+  int points = 0;
+  for (int i = 0; i <= last + 1; i++) {
+    const BeamSegment *seg = &path->segments[i <= last ? i : last];
+    Vector2 point = seg->start;
+    float dist = seg->startDist;
+    if (i > last) {
+      point = seg->end;
+      dist = seg->endDist;
+      if (seg->endDist > progress) {
+        float f = (progress - seg->startDist) / (seg->endDist - seg->startDist);
+        point = (Vector2){seg->start.x + (seg->end.x - seg->start.x) * f,
+                          seg->start.y + (seg->end.y - seg->start.y) * f};
+        dist = progress;
+      }
     }
-  } else if (dir.x < -0.0001f) {
-    float t = (xMin - pos.x) / dir.x;
-    float y = pos.y + dir.y * t;
-    if (t > 0.0001f && y >= yMin && y <= yMax && t < bestT) {
-      bestT = t;
-      bestN = (Vector2){1.0f, 0.0f};
-      hit = true;
+    Vector2 dir = prevDir;
+    if (i <= last) {
+      float dx = seg->end.x - seg->start.x;
+      float dy = seg->end.y - seg->start.y;
+      float len = sqrtf(dx * dx + dy * dy);
+      if (len <= 0.0001f)
+        continue;
+      dir = (Vector2){dx / len, dy / len};
     }
-  }
-
-  if (dir.y > 0.0001f) {
-    float t = (yMax - pos.y) / dir.y;
-    float x = pos.x + dir.x * t;
-    if (t > 0.0001f && x >= xMin && x <= xMax && t < bestT) {
-      bestT = t;
-      bestN = (Vector2){0.0f, -1.0f};
-      hit = true;
+    if (points == 0)
+      prevDir = dir;
+
+    // The miter bisects the two segment normals; a bounce that sends the
+    // beam almost straight back would need a spike, so it is capped.
+    Vector2 n0 = {-prevDir.y, prevDir.x};
+    Vector2 n1 = {-dir.y, dir.x};
+    Vector2 miter = {n0.x + n1.x, n0.y + n1.y};
+    float miterLen = sqrtf(miter.x * miter.x + miter.y * miter.y);
+    float scale = halfWidth;
+    if (miterLen > 0.0001f) {
+      miter.x /= miterLen;
+      miter.y /= miterLen;
+      float cosHalf = miter.x * n1.x + miter.y * n1.y;
+      scale = cosHalf > 0.25f ? halfWidth / cosHalf : halfWidth * 4.0f;
+    } else {
+      miter = n1;
     }
-  } else if (dir.y < -0.0001f) {
-    float t = (yMin - pos.y) / dir.y;
-    float x = pos.x + dir.x * t;
-    if (t > 0.0001f && x >= xMin && x <= xMax && t < bestT) {
-      bestT = t;
-      bestN = (Vector2){0.0f, 1.0f};
-      hit = true;
+    Vector2 left = {point.x + miter.x * scale, point.y + miter.y * scale};
+    Vector2 right = {point.x - miter.x * scale, point.y - miter.y * scale};
+    Color color =
+        ColorFromHSV(fmodf(time * 180.0f + dist * 0.05f, 360.0f), 0.75f, 1.0f);
+    color.a = 200;
+
+    if (points++ > 0) {
+      BatchVertex *v = PushTriangleVertices(batch, 6);
+      if (!v)
+        return;
+      // Sharp bounces can fold the capped miter over, flipping a triangle.
+      PutTriangle(v, (BatchVertex){prevLeft, prevColor},
+                  (BatchVertex){prevRight, prevColor},
+                  (BatchVertex){left, color});
+      PutTriangle(v + 3, (BatchVertex){prevRight, prevColor},
+                  (BatchVertex){right, color}, (BatchVertex){left, color});
     }
+    prevLeft = left;
+    prevRight = right;
+    prevColor = color;
+    prevDir = dir;
   }
-
-  if (!hit)
-    return false;
-  if (tHit)
-    *tHit = bestT;
-  if (normal)
-    *normal = bestN;
-  return true;
 }
 
-static bool ReadFloat(cJSON *obj, const char *key, float *outValue) {
-  cJSON *item = cJSON_GetObjectItemCaseSensitive(obj, key);
-  if (!cJSON_IsNumber(item))
+static bool GrowParticles(ParticlePool *pool) {
+  int capacity = pool->capacity ? pool->capacity * 2 : 256;
+  if (capacity > pool->maxCapacity)
+    capacity = pool->maxCapacity & ~3;
+  if (capacity <= pool->capacity)
+    return false;
+  size_t lane = sizeof(float) * (size_t)capacity;
+  char *arena = aligned_alloc(16, lane * 6);
+  if (!arena)
     return false;
-  *outValue = (float)item->valuedouble;
+  memset(arena, 0, lane * 6);
+  float **lanes[6] = {&pool->posX, &pool->posY, &pool->velX,
+                      &pool->velY, &pool->age,  &pool->life};
+  for (int k = 0; k < 6; k++) {
+    float *next = (float *)(arena + lane * (size_t)k);
+    if (pool->count > 0)
+      memcpy(next, *lanes[k], sizeof(float) * (size_t)pool->count);
+    *lanes[k] = next;
+  }
+  free(pool->arena);
+  pool->arena = arena;
+  pool->capacity = capacity;
   return true;
 }
 
-static void ResetStage(StageData *stage) {
-  stage->rectCount = 0;
-  stage->circleCount = 0;
-  stage->goalPos = (Vector2){0.0f, 0.0f};
-  stage->goalRadius = 0.0f;
-  stage->hasGoal = false;
+static void UnloadParticles(ParticlePool *pool) {
+  free(pool->arena);
+  *pool = (ParticlePool){.maxCapacity = pool->maxCapacity};
 }
 
-static bool LoadStage(const char *path, StageData *stage) {
-  ResetStage(stage);
-  char *text = LoadFileText(path);
-  if (!text)
-    return false;
-
-  cJSON *root = cJSON_Parse(text);
-  if (!root) {
-    UnloadFileText(text);
-    return false;
+static void AddParticles(ParticlePool *pool, int count, Vector2 pos) {
+  for (int i = 0; i < count; i++) {
+    if (pool->count == pool->capacity && !GrowParticles(pool))
+      break;
+    int idx = pool->count++;
+    float ang = (float)GetRandomValue(0, 359) * DEG2RAD;
+    float spd = (float)GetRandomValue(80, 220);
+    pool->posX[idx] = pos.x;
+    pool->posY[idx] = pos.y;
+    pool->velX[idx] = cosf(ang) * spd;
+    pool->velY[idx] = sinf(ang) * spd;
+    pool->age[idx] = 0.0f;
+    pool->life[idx] = 0.35f + (float)GetRandomValue(0, 20) / 100.0f;
   }
+}
 
-  cJSON *rects = cJSON_GetObjectItemCaseSensitive(root, "rects");
-  if (cJSON_IsArray(rects)) {
-    cJSON *item = NULL;
-    cJSON_ArrayForEach(item, rects) {
-      if (stage->rectCount >= MAX_STAGE_RECTS)
-        break;
-      float x, y, w, h;
-      if (!ReadFloat(item, "x", &x) || !ReadFloat(item, "y", &y) ||
-          !ReadFloat(item, "w", &w) || !ReadFloat(item, "h", &h))
-        continue;
-      stage->rects[stage->rectCount++] = (Rectangle){x, y, w, h};
-    }
+// Ages, drags and moves every particle, then drops the expired ones. The
+// first pass also runs over the padding past count, which is harmless.
+// Velocity keeps 0.96 of itself per 1/60 s whatever dt is.
+static void UpdateParticles(ParticlePool *pool, float dt) {
+  const float drag = powf(0.96f, dt * 60.0f);
+  int n = (pool->count + 3) & ~3;
+  int i = 0;
+#if defined(__SSE2__)
+  __m128 vdt = _mm_set1_ps(dt);
+  __m128 vdrag = _mm_set1_ps(drag);
+  for (; i < n; i += 4) {
+    __m128 vx = _mm_mul_ps(_mm_load_ps(pool->velX + i), vdrag);
+    __m128 vy = _mm_mul_ps(_mm_load_ps(pool->velY + i), vdrag);
+    _mm_store_ps(pool->velX + i, vx);
+    _mm_store_ps(pool->velY + i, vy);
+    _mm_store_ps(pool->posX + i,
+                 _mm_add_ps(_mm_load_ps(pool->posX + i), _mm_mul_ps(vx, vdt)));
+    _mm_store_ps(pool->posY + i,
+                 _mm_add_ps(_mm_load_ps(pool->posY + i), _mm_mul_ps(vy, vdt)));
+    _mm_store_ps(pool->age + i, _mm_add_ps(_mm_load_ps(pool->age + i), vdt));
   }
-
-  cJSON *circles = cJSON_GetObjectItemCaseSensitive(root, "circles");
-  if (cJSON_IsArray(circles)) {
-    cJSON *item = NULL;
-    cJSON_ArrayForEach(item, circles) {
-      if (stage->circleCount >= MAX_STAGE_CIRCLES)
-        break;
-      float x, y, r;
-      if (!ReadFloat(item, "x", &x) || !ReadFloat(item, "y", &y) ||
-          !ReadFloat(item, "r", &r))
-        continue;
-      stage->circlePos[stage->circleCount] = (Vector2){x, y};
-      stage->circleRadius[stage->circleCount] = r;
-      stage->circleCount++;
-    }
+#endif
+  for (; i < n; i++) {
+    pool->velX[i] *= drag;
+    pool->velY[i] *= drag;
+    pool->posX[i] += pool->velX[i] * dt;
+    pool->posY[i] += pool->velY[i] * dt;
+    pool->age[i] += dt;
   }
 
-  cJSON *goal = cJSON_GetObjectItemCaseSensitive(root, "goal");
-  if (cJSON_IsObject(goal)) {
-    float x, y, r;
-    if (ReadFloat(goal, "x", &x) && ReadFloat(goal, "y", &y) &&
-        ReadFloat(goal, "r", &r)) {
-      stage->goalPos = (Vector2){x, y};
-      stage->goalRadius = r;
-      stage->hasGoal = true;
+  for (i = 0; i < pool->count;) {
+    if (pool->age[i] < pool->life[i]) {
+      i++;
+      continue;
     }
+    int last = --pool->count;
+    pool->posX[i] = pool->posX[last];
+    pool->posY[i] = pool->posY[last];
+    pool->velX[i] = pool->velX[last];
+    pool->velY[i] = pool->velY[last];
+    pool->age[i] = pool->age[last];
+    pool->life[i] = pool->life[last];
   }
-
-  cJSON_Delete(root);
-  UnloadFileText(text);
-  return true;
 }
 
-int main(void) {
-  const int screenWidth = 1200;
-  const int screenHeight = 900;
-
-  InitWindow(screenWidth, screenHeight, "Ray Puzzle");
-  InitAudioDevice();
-  SetTargetFPS(60);
-
-  const char *title = "ray puzzle";
-  const int titleFontSize = 80;
+// Walls and obstacles, which only change when a stage is loaded.
+static void DrawStageLayer(const StageData *stage, int screenWidth,
+                           int screenHeight, int wallThickness) {
+  ClearBackground(WHITE);
+  Color wallColor = (Color){90, 110, 140, 255};
+  DrawRectangle(0, 0, screenWidth, wallThickness, wallColor); // top
+  DrawRectangle(0, screenHeight - wallThickness, screenWidth, wallThickness,
+                wallColor);                                    // bottom
+  DrawRectangle(0, 0, wallThickness, screenHeight, wallColor); // left
+  DrawRectangle(screenWidth - wallThickness, 0, wallThickness, screenHeight,
+                wallColor); // right
+
+  Color rectColor = (Color){130, 130, 150, 255};
+  for (int i = 0; i < stage->rectCount; i++) {
+    DrawRectangleRec(stage->rects[i], rectColor);
+  }
+  Color circleColor = (Color){120, 160, 190, 255};
+  for (int i = 0; i < stage->circleCount; i++) {
+    DrawCircleV(stage->circlePos[i], stage->circleRadius[i], circleColor);
+  }
+}
 
+#define MAX_RIPPLES 256
+#define MAX_STARS 24
+// Simulation steps per second, independent of the display rate.
+#define GAME_UPDATE_RATE 120
+#define GAME_UPDATE_DT (1.0f / (float)GAME_UPDATE_RATE)
+
+static const float playerRadius = 35.0f;
+static const float arrowLength = 55.0f;
+static const float arrowWidth = 14.0f;
+static const float rotationStep = PI / 24.0f; // 7.5 degrees per click
+static const float rotationSpeed = PI / 2.0f; // 90 degrees per second held
+static const float defaultGoalRadius = 30.0f;
+static const float beamDuration = 0.4f;
+static const float beamLength = BEAM_DEFAULT_LENGTH;
+static const float beamSpeed = 1200.0f;
+static const float beamRadius = 3.0f; // half the drawn width
+static const int aimTableSize = 65536;
+static const float rippleDuration = 0.5f;
+static const float rippleMinRadius = 6.0f;
+static const float rippleMaxRadius = 28.0f;
+static const float hueSpeed = 100.0f; // degrees per second for hue shift
+static const float transitionDuration = 0.6f; // seconds
+static const char *stagePath = "stages/stage1.json";
+
+// Input sampled once per displayed frame. The pressed flags are edges: they
+// stay set until an Update step has seen them, so none are lost on frames
+// that run no step.
+typedef struct GameInput {
+  Vector2 mouse;
+  bool mouseDown;
+  bool mousePressed;
+  bool toggleHint;
+  bool toggleThick;
+} GameInput;
+
+// Everything Update advances. prev* hold the values from before the latest
+// step so Draw can interpolate between the two.
+typedef struct GameState {
+  GameInput input;
+  // Sounds Update asked for since the frame loop last played them.
+  int clickSounds;
+  int wallHitSounds;
+  Rectangle startButton;
+  Rectangle leftRotateBtn;
+  Rectangle rightRotateBtn;
+  Rectangle fireBtn;
+  Vector2 playerPos;
+  bool inGame;
+  bool transitioning;
+  bool fadeOut;
+  float transitionAlpha;
+  StageData stage;
+  StageData thickStage; // stage grown by beamRadius
+  int stageVersion;     // bumped on every load
+  bool thickBeam;
+  // Aim hints for the thin and the thick beam, both built with the stage.
+  BeamLut aimTable;
+  BeamLut thickAimTable;
+  bool showHint;
+  bool goalCleared;
+  float facingAngle;
+  float prevFacingAngle;
+  float beamTimer;
+  bool beamShown; // the beam was live during the latest step
+  float beamProgress;
+  float prevBeamProgress;
+  Vector2 beamDir;
+  BeamPath beamPath;
+  BeamRetrace beamRetrace;
+  Vector2 beamPathDir;
+  bool beamPathValid;
+  // Where the aim leads, retraced every step while a rotate button is held.
+  BeamPath aimPath;
+  BeamRetrace aimRetrace;
+  bool aimPreview;
+  Ripple ripples[MAX_RIPPLES];
+  int rippleNext;
+  ParticlePool particles;
+  Star stars[MAX_STARS];
+  float starSpawnTimer;
+} GameState;
+
+// Sounds are loaded and played by the frame loop, never inside Update.
+typedef struct GameAudio {
+  Sound click;
+  Sound wallHit;
+} GameAudio;
+
+// Draw's own buffers, kept between frames.
+typedef struct GameRenderer {
+  RenderTexture2D stageLayer;
+  int stageVersion; // of the stage in stageLayer, 0 for none
+  RippleBatch ripples;
+  TriangleBatch beam;
+} GameRenderer;
+
+static void InitGame(GameState *game) {
   const int buttonWidth = 200;
   const int buttonHeight = 60;
-  Rectangle startButton = {(float)(screenWidth - buttonWidth) / 2,
-                           (float)screenHeight - buttonHeight - 60,
-                           (float)buttonWidth, (float)buttonHeight};
-  const int wallThickness = 40;
-  const float playerRadius = 35.0f;
-  const Vector2 playerPos = {(float)screenWidth / 2.0f,
-                             (float)screenHeight / 2.0f};
-  float facingAngle = -PI / 2.0f; // up
-  const float arrowLength = 55.0f;
-  const float arrowWidth = 14.0f;
-  const float rotationStep = PI / 24.0f; // 7.5 degrees per click
-  const float rotationSpeed = PI / 2.0f; // 90 degrees per second while held
-  StageData stage = {0};
-  bool stageLoaded = false;
-  Vector2 defaultGoalPos = {(float)screenWidth * 0.75f,
-                            (float)screenHeight * 0.35f};
-  const float defaultGoalRadius = 30.0f;
-
   const int rotateBtnW = 90;
   const int rotateBtnH = 60;
   const int rotateBtnPad = 20;
   const int fireBtnW = 110;
   const int fireBtnH = 60;
-  Rectangle leftRotateBtn = {
+  const int screenWidth = STAGE_SCREEN_WIDTH;
+  const int screenHeight = STAGE_SCREEN_HEIGHT;
+  game->startButton = (Rectangle){(float)(screenWidth - buttonWidth) / 2,
+                                  (float)screenHeight - buttonHeight - 60,
+                                  (float)buttonWidth, (float)buttonHeight};
+  game->leftRotateBtn = (Rectangle){
       (float)(screenWidth - rotateBtnPad * 2 - rotateBtnW * 2),
       (float)(screenHeight - rotateBtnH - rotateBtnPad), (float)rotateBtnW,
       (float)rotateBtnH};
-  Rectangle rightRotateBtn = {(float)(screenWidth - rotateBtnPad - rotateBtnW),
-                              (float)(screenHeight - rotateBtnH - rotateBtnPad),
-                              (float)rotateBtnW, (float)rotateBtnH};
-  Rectangle fireBtn = {
+  game->rightRotateBtn =
+      (Rectangle){(float)(screenWidth - rotateBtnPad - rotateBtnW),
+                  (float)(screenHeight - rotateBtnH - rotateBtnPad),
+                  (float)rotateBtnW, (float)rotateBtnH};
+  game->fireBtn = (Rectangle){
       (float)(screenWidth - rotateBtnPad * 3 - rotateBtnW * 2 - fireBtnW),
       (float)(screenHeight - fireBtnH - rotateBtnPad), (float)fireBtnW,
       (float)fireBtnH};
-  float beamTimer = 0.0f;
-  const float beamDuration = 0.4f;
-  const float beamLength = 10000.0f;
-  float beamProgress = 0.0f;
-  const float beamSpeed = 1200.0f;
-  Vector2 beamDir = {1.0f, 0.0f};
-  bool goalCleared = false;
-  const float rippleDuration = 0.5f;
-  const float rippleMinRadius = 6.0f;
-  const float rippleMaxRadius = 28.0f;
-  const int maxRipples = 16;
-  Ripple ripples[16];
-  int rippleNext = 0;
-  const int maxParticles = 64;
-  Particle particles[64];
-  const int maxStars = 24;
-  Star stars[24];
-  float starSpawnTimer = 0.0f;
-
-  Sound clickSound = LoadSound("決定ボタンを押す2.mp3");
-  Sound wallHitSound = LoadSound("カーソル移動12.mp3");
-  const float hueSpeed = 100.0f;         // degrees per second for hue shift
-  const float transitionDuration = 0.6f; // seconds
-  bool inGame = false;
-  bool transitioning = false;
-  bool fadeOut = true;
-  float transitionAlpha = 0.0f;
-
-  for (int i = 0; i < maxRipples; i++) {
-    ripples[i].age = -1.0f;
-  }
-  for (int i = 0; i < maxParticles; i++) {
-    particles[i].age = -1.0f;
-  }
-  for (int i = 0; i < maxStars; i++) {
-    stars[i].life = -1.0f;
+  game->playerPos =
+      (Vector2){(float)screenWidth / 2.0f, (float)screenHeight / 2.0f};
+  game->facingAngle = -PI / 2.0f; // up
+  game->prevFacingAngle = game->facingAngle;
+  game->fadeOut = true;
+  game->beamDir = (Vector2){1.0f, 0.0f};
+  game->particles.maxCapacity = 65536;
+  for (int i = 0; i < MAX_RIPPLES; i++) {
+    game->ripples[i].age = -1.0f;
+  }
+  for (int i = 0; i < MAX_STARS; i++) {
+    game->stars[i].life = -1.0f;
   }
+}
 
-  while (!WindowShouldClose()) {
-    Vector2 mouse = GetMousePosition();
-    bool hovered =
-        !inGame && !transitioning && CheckCollisionPointRec(mouse, startButton);
-    bool pressed = hovered && IsMouseButtonDown(MOUSE_LEFT_BUTTON);
-    if (!inGame && !transitioning && hovered &&
-        IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
-      PlaySound(clickSound);
-      transitioning = true;
-      fadeOut = true;
-      transitionAlpha = 0.0f;
-      goalCleared = false;
-      stageLoaded = false;
-    }
+static void UnloadGame(GameState *game) {
+  UnloadParticles(&game->particles);
+  UnloadBeamLut(&game->thickAimTable);
+  UnloadBeamLut(&game->aimTable);
+  UnloadBeamPath(&game->beamPath);
+  UnloadBeamPath(&game->aimPath);
+  UnloadStage(&game->thickStage);
+  UnloadStage(&game->stage);
+}
+
+static void LoadGameAudio(GameAudio *audio) {
+  audio->click = LoadSound("決定ボタンを押す2.mp3");
+  audio->wallHit = LoadSound("カーソル移動12.mp3");
+}
 
-    float dt = GetFrameTime();
-    if (transitioning) {
-      float delta = dt / transitionDuration;
-      if (fadeOut) {
-        transitionAlpha += delta;
-        if (transitionAlpha >= 1.0f) {
-          transitionAlpha = 1.0f;
-          fadeOut = false;
-          inGame = true;
-        }
-      } else {
-        transitionAlpha -= delta;
-        if (transitionAlpha <= 0.0f) {
-          transitionAlpha = 0.0f;
-          transitioning = false;
-        }
+static void UnloadGameAudio(GameAudio *audio) {
+  UnloadSound(audio->wallHit);
+  UnloadSound(audio->click);
+}
+
+// Plays each sound the steps since the last frame asked for once.
+static void PlayGameSounds(GameState *game, const GameAudio *audio) {
+  if (game->clickSounds > 0)
+    PlaySound(audio->click);
+  if (game->wallHitSounds > 0)
+    PlaySound(audio->wallHit);
+  game->clickSounds = 0;
+  game->wallHitSounds = 0;
+}
+
+static void PollInput(GameInput *input) {
+  input->mouse = GetMousePosition();
+  input->mouseDown = IsMouseButtonDown(MOUSE_LEFT_BUTTON);
+  input->mousePressed |= IsMouseButtonPressed(MOUSE_LEFT_BUTTON);
+  input->toggleHint |= IsKeyPressed(KEY_H);
+  input->toggleThick |= IsKeyPressed(KEY_T);
+}
+
+// Reads the stage and builds both aim tables on pool. Called before the
+// game loop starts, so no step waits on the file or 65536 traces.
+static void LoadGameStage(GameState *game, BeamPool *pool) {
+  StageData *stage = &game->stage;
+  bool fromFile = LoadStage(stagePath, stage);
+  if (!fromFile)
+    ResetStage(stage);
+  if (!stage->hasGoal) {
+    stage->goalPos = (Vector2){(float)STAGE_SCREEN_WIDTH * 0.75f,
+                               (float)STAGE_SCREEN_HEIGHT * 0.35f};
+    stage->goalRadius = defaultGoalRadius;
+    stage->hasGoal = true;
+  }
+  bool thick = InflateStage(stage, beamRadius, &game->thickStage);
+  if (!thick)
+    game->thickBeam = false;
+  // Only the thin-ray table is cached next to the stage file.
+  LoadBeamLut(fromFile ? stagePath : NULL, stage, aimTableSize,
+              stage->maxBounces, beamLength, pool, &game->aimTable);
+  if (thick)
+    LoadBeamLut(NULL, &game->thickStage, aimTableSize, stage->maxBounces,
+                beamLength, pool, &game->thickAimTable);
+  else
+    UnloadBeamLut(&game->thickAimTable);
+  game->stageVersion++;
+  game->goalCleared = false;
+  game->beamPathValid = false;
+  ResetBeamRetrace(&game->beamRetrace);
+  ResetBeamRetrace(&game->aimRetrace);
+}
+
+static void UpdateStars(GameState *game, float dt) {
+  game->starSpawnTimer -= dt;
+  if (game->starSpawnTimer <= 0.0f) {
+    for (int i = 0; i < MAX_STARS; i++) {
+      Star *star = &game->stars[i];
+      if (star->life < 0.0f) {
+        float startX = (float)GetRandomValue(0, STAGE_SCREEN_WIDTH);
+        float startY = (float)GetRandomValue(0, STAGE_SCREEN_HEIGHT / 2);
+        float speed = (float)GetRandomValue(300, 520);
+        float angle = (float)GetRandomValue(225, 255) * DEG2RAD;
+        star->pos = (Vector2){startX, startY};
+        star->vel = (Vector2){cosf(angle) * speed, sinf(angle) * speed};
+        star->life = 0.0f;
+        star->maxLife = 1.0f + (float)GetRandomValue(0, 60) / 100.0f;
+        break;
       }
     }
+    game->starSpawnTimer = 0.35f + (float)GetRandomValue(0, 40) / 100.0f;
+  }
 
-    if (inGame && !stageLoaded) {
-      bool loaded = LoadStage("stages/stage1.json", &stage);
-      if (!loaded)
-        ResetStage(&stage);
-      if (!stage.hasGoal) {
-        stage.goalPos = defaultGoalPos;
-        stage.goalRadius = defaultGoalRadius;
-        stage.hasGoal = true;
-      }
-      goalCleared = false;
-      stageLoaded = true;
+  for (int i = 0; i < MAX_STARS; i++) {
+    Star *star = &game->stars[i];
+    if (star->life < 0.0f)
+      continue;
+    star->life += dt;
+    if (star->life >= star->maxLife) {
+      star->life = -1.0f;
+      continue;
     }
+    star->pos.x += star->vel.x * dt;
+    star->pos.y += star->vel.y * dt;
+  }
+}
 
-    float t = (float)GetTime();
-    float hueTop = fmodf(t * hueSpeed, 360.0f);
-    float hueBottom = fmodf(t * hueSpeed + 60.0f, 360.0f);
-    Color topLeft = ColorFromHSV(hueTop, 0.45f, 0.35f);
-    Color topRight = ColorFromHSV(hueTop + 10.0f, 0.5f, 0.4f);
-    Color bottomLeft = ColorFromHSV(hueBottom, 0.5f, 0.55f);
-    Color bottomRight = ColorFromHSV(hueBottom + 15.0f, 0.55f, 0.6f);
-
-    BeginDrawing();
-    ClearBackground((Color){18, 18, 28, 255});
-
-    if (!inGame) {
-      starSpawnTimer -= dt;
-      if (starSpawnTimer <= 0.0f) {
-        for (int i = 0; i < maxStars; i++) {
-          if (stars[i].life < 0.0f) {
-            float startX = (float)GetRandomValue(0, screenWidth);
-            float startY = (float)GetRandomValue(0, screenHeight / 2);
-            float speed = (float)GetRandomValue(300, 520);
-            float angle = (float)GetRandomValue(225, 255) * DEG2RAD;
-            stars[i].pos = (Vector2){startX, startY};
-            stars[i].vel = (Vector2){cosf(angle) * speed, sinf(angle) * speed};
-            stars[i].life = 0.0f;
-            stars[i].maxLife = 1.0f + (float)GetRandomValue(0, 60) / 100.0f;
-            break;
-          }
-        }
-        starSpawnTimer = 0.35f + (float)GetRandomValue(0, 40) / 100.0f;
-      }
+static void UpdatePlay(GameState *game, float dt) {
+  const GameInput *in = &game->input;
+  bool leftHovered = CheckCollisionPointRec(in->mouse, game->leftRotateBtn);
+  bool rightHovered = CheckCollisionPointRec(in->mouse, game->rightRotateBtn);
+  bool fireHovered = CheckCollisionPointRec(in->mouse, game->fireBtn);
+  if (in->mousePressed) {
+    if (leftHovered)
+      game->facingAngle -= rotationStep;
+    if (rightHovered)
+      game->facingAngle += rotationStep;
+    if (fireHovered) {
+      game->beamTimer = beamDuration;
+      game->beamProgress = 0.0f;
+      game->prevBeamProgress = 0.0f;
+      game->beamDir =
+          (Vector2){cosf(game->facingAngle), sinf(game->facingAngle)};
+      game->goalCleared = false;
+    }
+  }
+  if (in->mouseDown && leftHovered)
+    game->facingAngle -= rotationSpeed * dt;
+  if (in->mouseDown && rightHovered)
+    game->facingAngle += rotationSpeed * dt;
+  if (in->mouseDown && fireHovered) {
+    if (game->beamTimer <= 0.0f) {
+      game->beamProgress = 0.0f;
+      game->prevBeamProgress = 0.0f;
+    }
+    game->beamTimer = beamDuration;
+    game->beamDir = (Vector2){cosf(game->facingAngle), sinf(game->facingAngle)};
+    game->goalCleared = false;
+  }
+  if (game->facingAngle > PI)
+    game->facingAngle -= 2.0f * PI;
+  if (game->facingAngle < -PI)
+    game->facingAngle += 2.0f * PI;
+  if (in->toggleHint)
+    game->showHint = !game->showHint;
+
+  const StageData *traced = game->thickBeam ? &game->thickStage : &game->stage;
+  game->aimPreview = in->mouseDown && (leftHovered || rightHovered);
+  if (game->aimPreview)
+    RetraceBeam(traced, game->playerPos,
+                (Vector2){cosf(game->facingAngle), sinf(game->facingAngle)},
+                game->stage.maxBounces, beamLength, &game->aimRetrace,
+                &game->aimPath);
+
+  game->beamShown = game->beamTimer > 0.0f;
+  if (game->beamShown) {
+    game->beamTimer -= dt;
+    float prevProgress = game->beamProgress;
+    game->beamProgress += beamSpeed * dt;
+    if (game->beamProgress > beamLength)
+      game->beamProgress = beamLength;
+    if (!game->beamPathValid || game->beamPathDir.x != game->beamDir.x ||
+        game->beamPathDir.y != game->beamDir.y) {
+      RetraceBeam(traced, game->playerPos, game->beamDir,
+                  game->stage.maxBounces, beamLength, &game->beamRetrace,
+                  &game->beamPath);
+      game->beamPathDir = game->beamDir;
+      game->beamPathValid = true;
+    }
 
-      DrawRectangleGradientEx(
-          (Rectangle){0, 0, (float)screenWidth, (float)screenHeight}, topLeft,
-          topRight, bottomRight, bottomLeft);
-
-      for (int i = 0; i < maxStars; i++) {
-        if (stars[i].life < 0.0f)
-          continue;
-        stars[i].life += dt;
-        if (stars[i].life >= stars[i].maxLife) {
-          stars[i].life = -1.0f;
-          continue;
-        }
-        Vector2 prev = stars[i].pos;
-        stars[i].pos.x += stars[i].vel.x * dt;
-        stars[i].pos.y += stars[i].vel.y * dt;
-        float t = stars[i].life / stars[i].maxLife;
-        unsigned char alpha = (unsigned char)(200 * (1.0f - t));
-        DrawLineEx(prev, stars[i].pos, 2.0f, (Color){255, 240, 200, alpha});
+    for (int i = 0; i < game->beamPath.segmentCount; i++) {
+      const BeamSegment *seg = &game->beamPath.segments[i];
+      if (seg->startDist >= game->beamProgress ||
+          seg->endDist > game->beamProgress)
+        break;
+      if (seg->hitKind == BEAM_HIT_GOAL) {
+        game->goalCleared = true;
+      } else if (seg->hitKind != BEAM_HIT_NONE &&
+                 seg->endDist - seg->startDist > 0.0001f &&
+                 seg->endDist > prevProgress) {
+        AddRipple(game->ripples, MAX_RIPPLES, &game->rippleNext, seg->end);
+        AddParticles(&game->particles, 8, seg->end);
+        game->wallHitSounds++;
       }
+    }
+  }
 
-      int titleWidth = MeasureText(title, titleFontSize);
-      DrawText(title, (screenWidth - titleWidth) / 2, 50, titleFontSize, WHITE);
-
-      Color buttonColor =
-          hovered ? (Color){70, 160, 255, 255} : (Color){50, 130, 220, 255};
-      if (pressed)
-        buttonColor = (Color){30, 100, 200, 255};
-
-      DrawRectangleRounded(startButton, 0.2f, 8, buttonColor);
-      DrawRectangleRoundedLines(startButton, 0.2f, 8, 2,
-                                (Color){10, 20, 30, 255});
-
-      const char *startText = "START";
-      int startTextSize = 28;
-      int startTextWidth = MeasureText(startText, startTextSize);
-      DrawText(startText,
-               (int)(startButton.x + (buttonWidth - startTextWidth) / 2),
-               (int)(startButton.y + (buttonHeight - startTextSize) / 2),
-               startTextSize, WHITE);
-    } else {
-      ClearBackground(WHITE);
-      Color wallColor = (Color){90, 110, 140, 255};
-      DrawRectangle(0, 0, screenWidth, wallThickness, wallColor); // top
-      DrawRectangle(0, screenHeight - wallThickness, screenWidth, wallThickness,
-                    wallColor);                                    // bottom
-      DrawRectangle(0, 0, wallThickness, screenHeight, wallColor); // left
-      DrawRectangle(screenWidth - wallThickness, 0, wallThickness, screenHeight,
-                    wallColor); // right
-
-      Color rectColor = (Color){130, 130, 150, 255};
-      for (int i = 0; i < stage.rectCount; i++) {
-        DrawRectangleRec(stage.rects[i], rectColor);
-      }
-      Color circleColor = (Color){120, 160, 190, 255};
-      for (int i = 0; i < stage.circleCount; i++) {
-        DrawCircleV(stage.circlePos[i], stage.circleRadius[i], circleColor);
-      }
+  for (int i = 0; i < MAX_RIPPLES; i++) {
+    Ripple *ripple = &game->ripples[i];
+    if (ripple->age < 0.0f)
+      continue;
+    ripple->age += dt;
+    if (ripple->age >= rippleDuration)
+      ripple->age = -1.0f;
+  }
+  UpdateParticles(&game->particles, dt);
+}
 
-      bool leftHovered = CheckCollisionPointRec(mouse, leftRotateBtn);
-      bool rightHovered = CheckCollisionPointRec(mouse, rightRotateBtn);
-      bool leftHeld = leftHovered && IsMouseButtonDown(MOUSE_LEFT_BUTTON);
-      bool rightHeld = rightHovered && IsMouseButtonDown(MOUSE_LEFT_BUTTON);
-      bool fireHovered = CheckCollisionPointRec(mouse, fireBtn);
-      bool fireHeld = fireHovered && IsMouseButtonDown(MOUSE_LEFT_BUTTON);
-      if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
-        if (leftHovered)
-          facingAngle -= rotationStep;
-        if (rightHovered)
-          facingAngle += rotationStep;
-        if (fireHovered) {
-          beamTimer = beamDuration;
-          beamProgress = 0.0f;
-          Vector2 dir = {cosf(facingAngle), sinf(facingAngle)};
-          beamDir = dir;
-          goalCleared = false;
-        }
-      }
-      if (leftHeld)
-        facingAngle -= rotationSpeed * dt;
-      if (rightHeld)
-        facingAngle += rotationSpeed * dt;
-      if (fireHeld) {
-        if (beamTimer <= 0.0f)
-          beamProgress = 0.0f;
-        beamTimer = beamDuration;
-        beamDir = (Vector2){cosf(facingAngle), sinf(facingAngle)};
-        goalCleared = false;
+// Advances the game by one fixed step. Uses no frame timing, reads no files,
+// plays and draws nothing, so it can also be run without a display, faster
+// than real time.
+static void Update(GameState *game, float dt) {
+  GameInput *in = &game->input;
+  game->prevFacingAngle = game->facingAngle;
+  game->prevBeamProgress = game->beamProgress;
+
+  bool hovered = !game->inGame && !game->transitioning &&
+                 CheckCollisionPointRec(in->mouse, game->startButton);
+  if (hovered && in->mousePressed) {
+    game->clickSounds++;
+    game->transitioning = true;
+    game->fadeOut = true;
+    game->transitionAlpha = 0.0f;
+    game->goalCleared = false;
+  }
+
+  if (game->transitioning) {
+    float delta = dt / transitionDuration;
+    if (game->fadeOut) {
+      game->transitionAlpha += delta;
+      if (game->transitionAlpha >= 1.0f) {
+        game->transitionAlpha = 1.0f;
+        game->fadeOut = false;
+        game->inGame = true;
       }
-      if (facingAngle > PI)
-        facingAngle -= 2.0f * PI;
-      if (facingAngle < -PI)
-        facingAngle += 2.0f * PI;
-
-      Vector2 facingDir = {cosf(facingAngle), sinf(facingAngle)};
-      Vector2 tip = {playerPos.x + facingDir.x * arrowLength,
-                     playerPos.y + facingDir.y * arrowLength};
-      Vector2 perp = {-facingDir.y, facingDir.x};
-      Vector2 left = {tip.x + perp.x * (arrowWidth / 2.0f),
-                      tip.y + perp.y * (arrowWidth / 2.0f)};
-      Vector2 right = {tip.x - perp.x * (arrowWidth / 2.0f),
-                       tip.y - perp.y * (arrowWidth / 2.0f)};
-
-      DrawCircleV(playerPos, playerRadius, (Color){220, 220, 255, 255});
-      DrawLineEx(playerPos, tip, 4.0f, (Color){40, 60, 120, 255});
-      DrawTriangle(tip, left, right, (Color){240, 140, 80, 255});
-      if (stage.hasGoal) {
-        Color goalColor =
-            goalCleared ? (Color){60, 180, 90, 255} : (Color){40, 140, 80, 255};
-        DrawCircleV(stage.goalPos, stage.goalRadius, goalColor);
-        if (goalCleared) {
-          DrawText("CLEAR!", (int)(stage.goalPos.x - 50),
-                   (int)(stage.goalPos.y - 10), 28, BLACK);
-        }
+    } else {
+      game->transitionAlpha -= delta;
+      if (game->transitionAlpha <= 0.0f) {
+        game->transitionAlpha = 0.0f;
+        game->transitioning = false;
       }
+    }
+  }
 
-      if (beamTimer > 0.0f) {
-        beamTimer -= dt;
-        float prevProgress = beamProgress;
-        beamProgress += beamSpeed * dt;
-        if (beamProgress > beamLength)
-          beamProgress = beamLength;
-        float beamHue =
-            fmodf((float)GetTime() * 180.0f + beamProgress * 0.05f, 360.0f);
-        Color beamColor = ColorFromHSV(beamHue, 0.75f, 1.0f);
-        beamColor.a = 200;
-        Vector2 dir = beamDir;
-        float dirLen = sqrtf(dir.x * dir.x + dir.y * dir.y);
-        if (dirLen > 0.0001f) {
-          dir.x /= dirLen;
-          dir.y /= dirLen;
-          Vector2 pos = playerPos;
-          float remaining = beamProgress;
-          float traveled = 0.0f;
-          const float xMin = (float)wallThickness;
-          const float xMax = (float)(screenWidth - wallThickness);
-          const float yMin = (float)wallThickness;
-          const float yMax = (float)(screenHeight - wallThickness);
-          int bounces = 0;
-          const int maxBounces = 6;
-          while (remaining > 0.0f && bounces <= maxBounces) {
-            float bestT = remaining;
-            Vector2 bestNormal = {0.0f, 0.0f};
-            bool hitReflect = false;
-
-            float tWall = 0.0f;
-            Vector2 nWall = {0.0f, 0.0f};
-            if (RayIntersectWalls(pos, dir, xMin, xMax, yMin, yMax, &tWall,
-                                  &nWall) &&
-                tWall < bestT) {
-              bestT = tWall;
-              bestNormal = nWall;
-              hitReflect = true;
-            }
-
-            for (int i = 0; i < stage.rectCount; i++) {
-              float tRect = 0.0f;
-              Vector2 nRect = {0.0f, 0.0f};
-              if (RayIntersectRect(pos, dir, stage.rects[i], &tRect, &nRect) &&
-                  tRect < bestT) {
-                bestT = tRect;
-                bestNormal = nRect;
-                hitReflect = true;
-              }
-            }
-
-            for (int i = 0; i < stage.circleCount; i++) {
-              float tCircle = 0.0f;
-              Vector2 nCircle = {0.0f, 0.0f};
-              if (RayIntersectCircle(pos, dir, stage.circlePos[i],
-                                     stage.circleRadius[i], &tCircle,
-                                     &nCircle) &&
-                  tCircle < bestT) {
-                bestT = tCircle;
-                bestNormal = nCircle;
-                hitReflect = true;
-              }
-            }
-
-            if (!goalCleared && stage.hasGoal) {
-              float tGoal = 0.0f;
-              if (RayIntersectCircle(pos, dir, stage.goalPos, stage.goalRadius,
-                                     &tGoal, NULL) &&
-                  tGoal <= bestT && tGoal <= remaining) {
-                Vector2 goalHit = {pos.x + dir.x * tGoal,
-                                   pos.y + dir.y * tGoal};
-                DrawLineEx(pos, goalHit, 6.0f, beamColor);
-                goalCleared = true;
-                remaining = 0.0f;
-                break;
-              }
-            }
-
-            Vector2 hitPos = {pos.x + dir.x * bestT, pos.y + dir.y * bestT};
-            DrawLineEx(pos, hitPos, 6.0f, beamColor);
-
-            remaining -= bestT;
-            traveled += bestT;
-
-            if (!hitReflect || bestT <= 0.0001f)
-              break;
-
-            float hitDist = traveled;
-            if (hitDist > prevProgress && hitDist <= beamProgress) {
-              AddRipple(ripples, maxRipples, &rippleNext, hitPos);
-              AddParticles(particles, maxParticles, 8, hitPos);
-              PlaySound(wallHitSound);
-            }
-
-            float dot = dir.x * bestNormal.x + dir.y * bestNormal.y;
-            dir.x = dir.x - 2.0f * dot * bestNormal.x;
-            dir.y = dir.y - 2.0f * dot * bestNormal.y;
-            pos = hitPos;
-            bounces++;
-          }
-        }
-      }
+  if (game->inGame && in->toggleThick) {
+    // Collide as a circle of beamRadius instead of a thin ray.
+    game->thickBeam = !game->thickBeam && game->thickStage.arena;
+    game->beamPathValid = false;
+    ResetBeamRetrace(&game->beamRetrace);
+    ResetBeamRetrace(&game->aimRetrace);
+  }
 
-      for (int i = 0; i < maxRipples; i++) {
-        if (ripples[i].age < 0.0f)
-          continue;
-        ripples[i].age += dt;
-        float t = ripples[i].age / rippleDuration;
-        if (t >= 1.0f) {
-          ripples[i].age = -1.0f;
-          continue;
-        }
-        float radius =
-            rippleMinRadius + (rippleMaxRadius - rippleMinRadius) * t;
-        float inner = radius > 2.0f ? radius - 2.0f : 1.0f;
-        float outer = radius + 2.0f;
-        unsigned char alpha = (unsigned char)(180 * (1.0f - t));
-        Color rippleColor = (Color){80, 150, 220, alpha};
-        DrawRing(ripples[i].pos, inner, outer, 0.0f, 360.0f, 48, rippleColor);
-      }
+  if (!game->inGame)
+    UpdateStars(game, dt);
+  else
+    UpdatePlay(game, dt);
 
-      for (int i = 0; i < maxParticles; i++) {
-        if (particles[i].age < 0.0f)
-          continue;
-        particles[i].age += dt;
-        if (particles[i].age >= particles[i].life) {
-          particles[i].age = -1.0f;
-          continue;
-        }
-        particles[i].vel.x *= 0.96f;
-        particles[i].vel.y *= 0.96f;
-        particles[i].pos.x += particles[i].vel.x * dt;
-        particles[i].pos.y += particles[i].vel.y * dt;
-        float t = particles[i].age / particles[i].life;
-        unsigned char alpha = (unsigned char)(200 * (1.0f - t));
-        DrawCircleV(particles[i].pos, 2.5f, (Color){255, 170, 90, alpha});
-      }
+  in->mousePressed = false;
+  in->toggleHint = false;
+  in->toggleThick = false;
+}
 
-      Color btnBase = (Color){60, 70, 100, 255};
-      Color btnHover = (Color){80, 100, 140, 255};
-      Color fireColor =
-          fireHovered ? (Color){200, 80, 80, 255} : (Color){160, 60, 60, 255};
-      DrawRectangleRounded(fireBtn, 0.2f, 6, fireColor);
-      DrawRectangleRoundedLines(fireBtn, 0.2f, 6, 2, (Color){30, 20, 20, 255});
-      const char *fireTxt = "FIRE";
-      int fireFont = 24;
-      DrawText(
-          fireTxt,
-          (int)(fireBtn.x + (fireBtnW - MeasureText(fireTxt, fireFont)) / 2),
-          (int)(fireBtn.y + (fireBtnH - fireFont) / 2), fireFont, WHITE);
-
-      DrawRectangleRounded(leftRotateBtn, 0.2f, 6,
-                           leftHovered ? btnHover : btnBase);
-      DrawRectangleRoundedLines(leftRotateBtn, 0.2f, 6, 2,
-                                (Color){20, 20, 30, 255});
-      DrawRectangleRounded(rightRotateBtn, 0.2f, 6,
-                           rightHovered ? btnHover : btnBase);
-      DrawRectangleRoundedLines(rightRotateBtn, 0.2f, 6, 2,
-                                (Color){20, 20, 30, 255});
-      const char *leftTxt = "<";
-      const char *rightTxt = ">";
-      int rotFont = 28;
-      DrawText(leftTxt,
-               (int)(leftRotateBtn.x +
-                     (rotateBtnW - MeasureText(leftTxt, rotFont)) / 2),
-               (int)(leftRotateBtn.y + (rotateBtnH - rotFont) / 2), rotFont,
-               WHITE);
-      DrawText(rightTxt,
-               (int)(rightRotateBtn.x +
-                     (rotateBtnW - MeasureText(rightTxt, rotFont)) / 2),
-               (int)(rightRotateBtn.y + (rotateBtnH - rotFont) / 2), rotFont,
-               WHITE);
+static void DrawTitle(const GameState *game, float alpha) {
+  const int screenWidth = STAGE_SCREEN_WIDTH;
+  const int screenHeight = STAGE_SCREEN_HEIGHT;
+  float t = (float)GetTime();
+  float hueTop = fmodf(t * hueSpeed, 360.0f);
+  float hueBottom = fmodf(t * hueSpeed + 60.0f, 360.0f);
+  Color topLeft = ColorFromHSV(hueTop, 0.45f, 0.35f);
+  Color topRight = ColorFromHSV(hueTop + 10.0f, 0.5f, 0.4f);
+  Color bottomLeft = ColorFromHSV(hueBottom, 0.5f, 0.55f);
+  Color bottomRight = ColorFromHSV(hueBottom + 15.0f, 0.55f, 0.6f);
+  DrawRectangleGradientEx(
+      (Rectangle){0, 0, (float)screenWidth, (float)screenHeight}, topLeft,
+      topRight, bottomRight, bottomLeft);
+
+  // Positions are moved back along the velocity to where they were alpha of
+  // the way through the latest step; the streak is 1/60 s long.
+  float back = (1.0f - alpha) * GAME_UPDATE_DT;
+  for (int i = 0; i < MAX_STARS; i++) {
+    const Star *star = &game->stars[i];
+    if (star->life < 0.0f)
+      continue;
+    Vector2 pos = {star->pos.x - star->vel.x * back,
+                   star->pos.y - star->vel.y * back};
+    Vector2 prev = {pos.x - star->vel.x / 60.0f, pos.y - star->vel.y / 60.0f};
+    float t = (star->life - back) / star->maxLife;
+    if (t < 0.0f)
+      t = 0.0f;
+    unsigned char a = (unsigned char)(200 * (1.0f - t));
+    DrawLineEx(prev, pos, 2.0f, (Color){255, 240, 200, a});
+  }
+
+  const char *title = "ray puzzle";
+  const int titleFontSize = 80;
+  int titleWidth = MeasureText(title, titleFontSize);
+  DrawText(title, (screenWidth - titleWidth) / 2, 50, titleFontSize, WHITE);
+
+  Rectangle startButton = game->startButton;
+  bool hovered = !game->transitioning &&
+                 CheckCollisionPointRec(game->input.mouse, startButton);
+  bool pressed = hovered && game->input.mouseDown;
+  Color buttonColor =
+      hovered ? (Color){70, 160, 255, 255} : (Color){50, 130, 220, 255};
+  if (pressed)
+    buttonColor = (Color){30, 100, 200, 255};
+
+  DrawRectangleRounded(startButton, 0.2f, 8, buttonColor);
+  DrawRectangleRoundedLines(startButton, 0.2f, 8, 2, (Color){10, 20, 30, 255});
+
+  const char *startText = "START";
+  int startTextSize = 28;
+  int startTextWidth = MeasureText(startText, startTextSize);
+  DrawText(startText,
+           (int)(startButton.x + (startButton.width - startTextWidth) / 2),
+           (int)(startButton.y + (startButton.height - startTextSize) / 2),
+           startTextSize, WHITE);
+}
+
+static void DrawPlay(const GameState *game, float alpha,
+                     GameRenderer *renderer) {
+  const int screenWidth = STAGE_SCREEN_WIDTH;
+  const int screenHeight = STAGE_SCREEN_HEIGHT;
+  const StageData *stage = &game->stage;
+  // Render textures are stored bottom-up, hence the negative height.
+  RenderTexture2D layer = renderer->stageLayer;
+  if (layer.id != 0)
+    DrawTextureRec(layer.texture,
+                   (Rectangle){0, 0, (float)layer.texture.width,
+                               -(float)layer.texture.height},
+                   (Vector2){0, 0}, WHITE);
+  else
+    DrawStageLayer(stage, screenWidth, screenHeight, STAGE_WALL_THICKNESS);
+
+  float turn = game->facingAngle - game->prevFacingAngle;
+  if (turn > PI)
+    turn -= 2.0f * PI;
+  if (turn < -PI)
+    turn += 2.0f * PI;
+  float facingAngle = game->prevFacingAngle + turn * alpha;
+  const BeamLut *aimTable =
+      game->thickBeam ? &game->thickAimTable : &game->aimTable;
+  bool aimOnGoal =
+      game->showHint && LookupBeamLut(aimTable, facingAngle).hitGoal;
+
+  Vector2 playerPos = game->playerPos;
+  Vector2 facingDir = {cosf(facingAngle), sinf(facingAngle)};
+  Vector2 tip = {playerPos.x + facingDir.x * arrowLength,
+                 playerPos.y + facingDir.y * arrowLength};
+  Vector2 perp = {-facingDir.y, facingDir.x};
+  Vector2 left = {tip.x + perp.x * (arrowWidth / 2.0f),
+                  tip.y + perp.y * (arrowWidth / 2.0f)};
+  Vector2 right = {tip.x - perp.x * (arrowWidth / 2.0f),
+                   tip.y - perp.y * (arrowWidth / 2.0f)};
+
+  if (game->aimPreview) {
+    for (int i = 0; i < game->aimPath.segmentCount; i++) {
+      const BeamSegment *seg = &game->aimPath.segments[i];
+      DrawLineEx(seg->start, seg->end, 1.5f, (Color){255, 255, 255, 90});
+    }
+  }
+
+  DrawCircleV(playerPos, playerRadius, (Color){220, 220, 255, 255});
+  DrawLineEx(playerPos, tip, 4.0f, (Color){40, 60, 120, 255});
+  DrawTriangle(tip, left, right,
+               aimOnGoal ? (Color){60, 180, 90, 255}
+                         : (Color){240, 140, 80, 255});
+  if (stage->hasGoal) {
+    Color goalColor = game->goalCleared ? (Color){60, 180, 90, 255}
+                                        : (Color){40, 140, 80, 255};
+    DrawCircleV(stage->goalPos, stage->goalRadius, goalColor);
+    if (game->goalCleared) {
+      DrawText("CLEAR!", (int)(stage->goalPos.x - 50),
+               (int)(stage->goalPos.y - 10), 28, BLACK);
     }
+  }
+
+  if (game->beamShown && game->beamPathValid) {
+    float progress = game->prevBeamProgress +
+                     (game->beamProgress - game->prevBeamProgress) * alpha;
+    PushBeamStrip(&renderer->beam, &game->beamPath, progress, beamRadius,
+                  (float)GetTime());
+    DrawTriangleBatch(&renderer->beam);
+  }
 
-    if (transitioning || fadeOut) {
-      unsigned char alpha =
-          (unsigned char)(255 * (transitionAlpha < 0 ? 0 : transitionAlpha));
-      DrawRectangle(0, 0, screenWidth, screenHeight, (Color){0, 0, 0, alpha});
+  float back = (1.0f - alpha) * GAME_UPDATE_DT;
+  for (int i = 0; i < MAX_RIPPLES; i++) {
+    const Ripple *ripple = &game->ripples[i];
+    if (ripple->age < 0.0f)
+      continue;
+    float t = (ripple->age > back ? ripple->age - back : 0.0f) / rippleDuration;
+    float radius = rippleMinRadius + (rippleMaxRadius - rippleMinRadius) * t;
+    float inner = radius > 2.0f ? radius - 2.0f : 1.0f;
+    float outer = radius + 2.0f;
+    unsigned char a = (unsigned char)(180 * (1.0f - t));
+    Color rippleColor = (Color){80, 150, 220, a};
+    PushRippleRing(&renderer->ripples, ripple->pos, inner, outer, rippleColor);
+  }
+  DrawTriangleBatch(&renderer->ripples.triangles);
+
+  const ParticlePool *particles = &game->particles;
+  for (int i = 0; i < particles->count; i++) {
+    float age = particles->age[i] > back ? particles->age[i] - back : 0.0f;
+    float t = age / particles->life[i];
+    unsigned char a = (unsigned char)(200 * (1.0f - t));
+    Vector2 pos = {particles->posX[i] - particles->velX[i] * back,
+                   particles->posY[i] - particles->velY[i] * back};
+    DrawCircleV(pos, 2.5f, (Color){255, 170, 90, a});
+  }
+
+  Vector2 mouse = game->input.mouse;
+  Rectangle fireBtn = game->fireBtn;
+  Rectangle leftRotateBtn = game->leftRotateBtn;
+  Rectangle rightRotateBtn = game->rightRotateBtn;
+  Color btnBase = (Color){60, 70, 100, 255};
+  Color btnHover = (Color){80, 100, 140, 255};
+  Color fireColor = CheckCollisionPointRec(mouse, fireBtn)
+                        ? (Color){200, 80, 80, 255}
+                        : (Color){160, 60, 60, 255};
+  DrawRectangleRounded(fireBtn, 0.2f, 6, fireColor);
+  DrawRectangleRoundedLines(fireBtn, 0.2f, 6, 2, (Color){30, 20, 20, 255});
+  const char *fireTxt = "FIRE";
+  int fireFont = 24;
+  DrawText(fireTxt,
+           (int)(fireBtn.x +
+                 (fireBtn.width - (float)MeasureText(fireTxt, fireFont)) / 2),
+           (int)(fireBtn.y + (fireBtn.height - (float)fireFont) / 2), fireFont,
+           WHITE);
+
+  DrawRectangleRounded(leftRotateBtn, 0.2f, 6,
+                       CheckCollisionPointRec(mouse, leftRotateBtn) ? btnHover
+                                                                    : btnBase);
+  DrawRectangleRoundedLines(leftRotateBtn, 0.2f, 6, 2,
+                            (Color){20, 20, 30, 255});
+  DrawRectangleRounded(rightRotateBtn, 0.2f, 6,
+                       CheckCollisionPointRec(mouse, rightRotateBtn) ? btnHover
+                                                                     : btnBase);
+  DrawRectangleRoundedLines(rightRotateBtn, 0.2f, 6, 2,
+                            (Color){20, 20, 30, 255});
+  const char *leftTxt = "<";
+  const char *rightTxt = ">";
+  int rotFont = 28;
+  DrawText(leftTxt,
+           (int)(leftRotateBtn.x +
+                 (leftRotateBtn.width - (float)MeasureText(leftTxt, rotFont)) /
+                     2),
+           (int)(leftRotateBtn.y + (leftRotateBtn.height - (float)rotFont) / 2),
+           rotFont, WHITE);
+  DrawText(rightTxt,
+           (int)(rightRotateBtn.x + (rightRotateBtn.width -
+                                     (float)MeasureText(rightTxt, rotFont)) /
+                                        2),
+           (int)(rightRotateBtn.y + (rightRotateBtn.height - (float)rotFont) /
+                                        2),
+           rotFont, WHITE);
+}
+
+// Renders the state alpha of the way from the step before the latest one to
+// the latest, so motion stays smooth whatever the display rate.
+static void Draw(const GameState *game, float alpha, GameRenderer *renderer) {
+  if (renderer->stageVersion != game->stageVersion) {
+    if (renderer->stageLayer.id == 0)
+      renderer->stageLayer =
+          LoadRenderTexture(STAGE_SCREEN_WIDTH, STAGE_SCREEN_HEIGHT);
+    if (renderer->stageLayer.id != 0) {
+      BeginTextureMode(renderer->stageLayer);
+      DrawStageLayer(&game->stage, STAGE_SCREEN_WIDTH, STAGE_SCREEN_HEIGHT,
+                     STAGE_WALL_THICKNESS);
+      EndTextureMode();
     }
+    renderer->stageVersion = game->stageVersion;
+  }
+
+  BeginDrawing();
+  ClearBackground((Color){18, 18, 28, 255});
+  if (!game->inGame)
+    DrawTitle(game, alpha);
+  else
+    DrawPlay(game, alpha, renderer);
+
+  if (game->transitioning || game->fadeOut) {
+    float fade = game->transitionAlpha < 0 ? 0 : game->transitionAlpha;
+    DrawRectangle(0, 0, STAGE_SCREEN_WIDTH, STAGE_SCREEN_HEIGHT,
+                  (Color){0, 0, 0, (unsigned char)(255 * fade)});
+  }
+  EndDrawing();
+}
 
-    EndDrawing();
+static void UnloadRenderer(GameRenderer *renderer) {
+  if (renderer->stageLayer.id != 0)
+    UnloadRenderTexture(renderer->stageLayer);
+  UnloadTriangleBatch(&renderer->ripples.triangles);
+  UnloadTriangleBatch(&renderer->beam);
+}
+
+int main(void) {
+  InitWindow(STAGE_SCREEN_WIDTH, STAGE_SCREEN_HEIGHT, "Ray Puzzle");
+  InitAudioDevice();
+  SetTargetFPS(60);
+
+  static GameState game;
+  GameRenderer renderer = {0};
+  GameAudio audio = {0};
+  InitGame(&game);
+  LoadGameAudio(&audio);
+  BeamPool *pool = CreateBeamPool(0);
+  LoadGameStage(&game, pool);
+  DestroyBeamPool(pool);
+
+  // Display frames feed real time into the accumulator and the simulation
+  // catches up in fixed steps; a long stall is not replayed in full.
+  float accumulator = 0.0f;
+  while (!WindowShouldClose()) {
+    PollInput(&game.input);
+    float frameTime = GetFrameTime();
+    accumulator += frameTime < 0.25f ? frameTime : 0.25f;
+    while (accumulator >= GAME_UPDATE_DT) {
+      Update(&game, GAME_UPDATE_DT);
+      accumulator -= GAME_UPDATE_DT;
+    }
+    PlayGameSounds(&game, &audio);
+    Draw(&game, accumulator / GAME_UPDATE_DT, &renderer);
   }
 
-  UnloadSound(wallHitSound);
-  UnloadSound(clickSound);
+  UnloadRenderer(&renderer);
+  UnloadGame(&game);
+  UnloadGameAudio(&audio);
   CloseAudioDevice();
   CloseWindow();
   return 0;
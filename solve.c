@@ -0,0 +1,456 @@
+#include "beamtrace.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum SolveMode {
+  SOLVE_SWEEP,
+  SOLVE_ADAPTIVE,
+  SOLVE_TABLE,
+  SOLVE_HEATMAP,
+  SOLVE_BIDIR,
+} SolveMode;
+
+typedef struct SolveOptions {
+  SolveMode mode;
+  int rays;    // sweep resolution, or initial samples in adaptive mode
+  int threads;
+  int maxBounces; // -1 to use each stage's own budget
+  float maxLength;
+  float radius; // beam radius, 0 for a thin ray
+  StageAccel accel;
+  const char *outPrefix; // heatmap images, next to the stage if NULL
+} SolveOptions;
+
+typedef struct SweepJob {
+  const StageData *stage;
+  const SolveOptions *options;
+  int maxBounces;
+  int *segments; // path segment count when the goal is hit, else 0
+} SweepJob;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static float SweepAngle(int i, int rays) {
+  return (float)(-M_PI + 2.0 * M_PI * (double)i / (double)rays);
+}
+
+static void SweepRange(void *ctx, int begin, int end, int worker) {
+  (void)worker;
+  SweepJob *job = ctx;
+  BeamPath paths[BEAM_PACKET_MAX] = {0};
+  Vector2 dirs[BEAM_PACKET_MAX];
+  for (int i = begin; i < end; i += BEAM_PACKET_MAX) {
+    int count = end - i < BEAM_PACKET_MAX ? end - i : BEAM_PACKET_MAX;
+    for (int l = 0; l < count; l++) {
+      float angle = SweepAngle(i + l, job->options->rays);
+      dirs[l] = (Vector2){cosf(angle), sinf(angle)};
+    }
+    // Packets traverse the BVH; other modes are traced ray by ray so -a
+    // still compares them.
+    if (job->stage->accel == STAGE_ACCEL_BVH) {
+      TraceBeamPacket(job->stage, job->stage->start, dirs, count,
+                      job->maxBounces, job->options->maxLength, paths);
+    } else {
+      for (int l = 0; l < count; l++)
+        TraceBeam(job->stage, job->stage->start, dirs[l], job->maxBounces,
+                  job->options->maxLength, &paths[l]);
+    }
+    for (int l = 0; l < count; l++)
+      job->segments[i + l] = paths[l].hitGoal ? paths[l].segmentCount : 0;
+  }
+  for (int l = 0; l < BEAM_PACKET_MAX; l++)
+    UnloadBeamPath(&paths[l]);
+}
+
+static bool PushSweepWindow(BeamWindowList *out, const SolveOptions *options,
+                            int first, int count, int segments) {
+  if (out->count == out->capacity) {
+    int capacity = out->capacity ? out->capacity * 2 : 16;
+    BeamWindow *windows =
+        realloc(out->windows, sizeof(BeamWindow) * (size_t)capacity);
+    if (!windows)
+      return false;
+    out->windows = windows;
+    out->capacity = capacity;
+  }
+  float start = SweepAngle(first, options->rays);
+  float end = SweepAngle(first + count - 1, options->rays);
+  if (first + count > options->rays)
+    end = SweepAngle(first + count - 1 - options->rays, options->rays) +
+          2.0f * BEAM_PI;
+  out->windows[out->count++] = (BeamWindow){start, end, segments - 1};
+  return true;
+}
+
+// Collects every run of consecutive goal-hitting rays, joining the run that
+// wraps from +pi back to -pi. Returns false if out could not hold them.
+static bool CollectSweepWindows(const SolveOptions *options,
+                                const int *segments,
+                                BeamWindowList *out) {
+  int rays = options->rays;
+  out->count = 0;
+  out->rays = rays;
+  int offset = 0;
+  if (segments[0] && segments[rays - 1]) {
+    while (offset < rays && segments[offset])
+      offset++;
+    if (offset == rays)
+      return PushSweepWindow(out, options, 0, rays, 1);
+  }
+
+  for (int k = 0; k < rays;) {
+    int i = (offset + k) % rays;
+    if (!segments[i]) {
+      k++;
+      continue;
+    }
+    int count = 0;
+    int best = segments[i];
+    while (k < rays && segments[(offset + k) % rays]) {
+      int s = segments[(offset + k) % rays];
+      if (s < best)
+        best = s;
+      count++;
+      k++;
+    }
+    if (!PushSweepWindow(out, options, i, count, best))
+      return false;
+  }
+  return true;
+}
+
+static void PrintWindows(const BeamWindowList *list) {
+  for (int i = 0; i < list->count; i++) {
+    const BeamWindow *w = &list->windows[i];
+    printf("  [%+.7f, %+.7f] rad  [%+9.4f, %+9.4f] deg  width %.6f deg  "
+           "bounces %d\n",
+           w->start, w->end, w->start * 180.0f / BEAM_PI,
+           w->end * 180.0f / BEAM_PI, (w->end - w->start) * 180.0f / BEAM_PI,
+           w->bounces);
+  }
+  printf("  %d window%s\n", list->count, list->count == 1 ? "" : "s");
+}
+
+static void PrintHeatmapStats(const StageData *stage, const BeamHeatmap *map,
+                              int maxBounces) {
+  printf("  goal hit by %.3f%% of rays\n",
+         100.0 * (double)map->goalRays / (double)map->rays);
+
+  // Statistics cover the pixels inside the field.
+  int x0 = (int)fmaxf(stage->field.x, 0.0f);
+  int y0 = (int)fmaxf(stage->field.y, 0.0f);
+  int x1 = (int)fminf(stage->field.x + stage->field.width, (float)map->width);
+  int y1 = (int)fminf(stage->field.y + stage->field.height, (float)map->height);
+  int histogramSize = maxBounces + 1 < 16 ? maxBounces + 1 : 16;
+  long long histogram[16] = {0};
+  long long total = 0;
+  long long reached = 0;
+  double sum = 0.0;
+  float peak = 0.0f;
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < x1; x++) {
+      int i = y * map->width + x;
+      total++;
+      if (map->minBounces[i] == BEAM_HEAT_UNREACHED)
+        continue;
+      reached++;
+      int b = map->minBounces[i];
+      histogram[b < histogramSize - 1 ? b : histogramSize - 1]++;
+      sum += map->coverage[i];
+      peak = fmaxf(peak, map->coverage[i]);
+    }
+  }
+  if (total == 0)
+    return;
+  printf("  reached %.2f%% of the field\n", 100.0 * (double)reached / total);
+  long long cumulative = 0;
+  for (int b = 0; b < histogramSize; b++) {
+    cumulative += histogram[b];
+    printf("    %s%2d bounce%s: %6.2f%%  (total %6.2f%%)\n",
+           b == histogramSize - 1 && b < maxBounces ? ">=" : "  ", b,
+           b == 1 ? " " : "s", 100.0 * (double)histogram[b] / total,
+           100.0 * (double)cumulative / total);
+  }
+  if (reached > 0)
+    printf("  passes per reached pixel and ray: mean %.4g, max %.4g\n",
+           sum / (double)reached, peak);
+}
+
+static bool WriteHeatmap(const char *prefix, const BeamHeatmap *map) {
+  size_t length = strlen(prefix) + 16;
+  char *coveragePath = malloc(length);
+  char *bouncesPath = malloc(length);
+  bool ok = coveragePath && bouncesPath;
+  if (ok) {
+    snprintf(coveragePath, length, "%s.heat.pgm", prefix);
+    snprintf(bouncesPath, length, "%s.bounces.pgm", prefix);
+    ok = ExportBeamHeatmap(map, coveragePath, bouncesPath);
+    if (ok)
+      printf("  wrote %s and %s\n", coveragePath, bouncesPath);
+  }
+  free(coveragePath);
+  free(bouncesPath);
+  return ok;
+}
+
+static bool ParseAccel(const char *name, StageAccel *accel) {
+  static const char *names[] = {"brute", "bvh", "grid", "simd", "plugin"};
+  static const StageAccel modes[] = {STAGE_ACCEL_BRUTE, STAGE_ACCEL_BVH,
+                                     STAGE_ACCEL_GRID, STAGE_ACCEL_SIMD,
+                                     STAGE_ACCEL_PLUGIN};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i]) == 0) {
+      *accel = modes[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+// The plugin beamcc builds by default, <stage path>.so.
+static bool LoadStagePluginFor(const char *path, StageData *stage) {
+  size_t length = strlen(path) + 4;
+  char *plugin = malloc(length);
+  if (!plugin)
+    return false;
+  snprintf(plugin, length, "%s.so", path);
+  bool ok = LoadStagePlugin(stage, plugin);
+  free(plugin);
+  return ok;
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-m sweep|adaptive|table|heatmap|bidir] [-n rays] "
+          "[-j threads]\n"
+          "       [-b maxBounces] [-a brute|bvh|grid|simd|plugin] [-r radius] "
+          "[-o prefix]\n"
+          "       stage.json...\n"
+          "Prints the firing-angle windows from the stage start that reach "
+          "the goal.\n"
+          "  sweep     trace -n evenly spaced angles (default 1000000)\n"
+          "  adaptive  bisect between -n initial samples (default 4096) "
+          "wherever the\n"
+          "            path changes or drifts, locating window edges to float "
+          "precision\n"
+          "  table     build or load the cached -n entry outcome table\n"
+          "  heatmap   trace -n angles and map where the beams go: writes "
+          "<prefix>.heat.pgm\n"
+          "            and <prefix>.bounces.pgm (prefix defaults to the stage "
+          "path)\n"
+          "  bidir     adaptive from 4096 samples, plus -n beams traced back "
+          "from the\n"
+          "            goal (default 65536) to find needle-thin windows\n"
+          "-b overrides each stage's own bounce budget. -a plugin loads "
+          "<stage>.so built\n"
+          "by beamcc. -r traces a beam of that radius rather than a thin ray, "
+          "and cannot\n"
+          "be combined with -a plugin.\n"
+          "Exits with 1 if any stage has no solution, 2 on errors.\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  SolveOptions options = {SOLVE_SWEEP, 0, 0, -1, BEAM_DEFAULT_LENGTH, 0.0f,
+                          STAGE_ACCEL_BVH, NULL};
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-'; argi++) {
+    const char *arg = argv[argi];
+    const char *value = argi + 1 < argc ? argv[argi + 1] : NULL;
+    if (strcmp(arg, "-h") == 0) {
+      Usage(argv[0]);
+      return 0;
+    }
+    if (!value) {
+      Usage(argv[0]);
+      return 2;
+    }
+    if (strcmp(arg, "-m") == 0) {
+      if (strcmp(value, "sweep") == 0) {
+        options.mode = SOLVE_SWEEP;
+      } else if (strcmp(value, "adaptive") == 0) {
+        options.mode = SOLVE_ADAPTIVE;
+      } else if (strcmp(value, "table") == 0) {
+        options.mode = SOLVE_TABLE;
+      } else if (strcmp(value, "heatmap") == 0) {
+        options.mode = SOLVE_HEATMAP;
+      } else if (strcmp(value, "bidir") == 0) {
+        options.mode = SOLVE_BIDIR;
+      } else {
+        Usage(argv[0]);
+        return 2;
+      }
+    } else if (strcmp(arg, "-n") == 0) {
+      options.rays = atoi(value);
+    } else if (strcmp(arg, "-j") == 0) {
+      options.threads = atoi(value);
+    } else if (strcmp(arg, "-b") == 0) {
+      options.maxBounces = atoi(value);
+    } else if (strcmp(arg, "-r") == 0) {
+      options.radius = (float)atof(value);
+    } else if (strcmp(arg, "-o") == 0) {
+      options.outPrefix = value;
+    } else if (strcmp(arg, "-a") == 0) {
+      if (!ParseAccel(value, &options.accel)) {
+        Usage(argv[0]);
+        return 2;
+      }
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+    argi++;
+  }
+  if (options.rays == 0)
+    options.rays = options.mode == SOLVE_ADAPTIVE ? 4096
+                   : options.mode == SOLVE_BIDIR  ? 65536
+                                                  : 1000000;
+  if (argi >= argc || options.rays < 2 || options.maxBounces < -1 ||
+      options.maxBounces > BEAM_MAX_BOUNCES || !(options.radius >= 0.0f)) {
+    Usage(argv[0]);
+    return 2;
+  }
+  // beamcc compiles the stage as written; a thick beam traces the stage
+  // grown by its radius, which no plugin was built from.
+  if (options.accel == STAGE_ACCEL_PLUGIN && options.radius > 0.0f) {
+    fprintf(stderr, "-a plugin cannot be combined with -r: plugins are built "
+                    "for thin rays only\n");
+    return 2;
+  }
+
+  BeamPool *pool = CreateBeamPool(options.threads);
+  bool needSegments =
+      options.mode == SOLVE_SWEEP || options.mode == SOLVE_TABLE;
+  int *segments =
+      needSegments ? malloc(sizeof(int) * (size_t)options.rays) : NULL;
+  if (!pool || (needSegments && !segments)) {
+    fprintf(stderr, "out of memory\n");
+    return 2;
+  }
+
+  int status = 0;
+  StageData base = {0};
+  StageData inflated = {0};
+  BeamWindowList windows = {0};
+  BeamLut table = {0};
+  BeamHeatmap heatmap = {0};
+  for (; argi < argc; argi++) {
+    const char *path = argv[argi];
+    if (!LoadStage(path, &base)) {
+      fprintf(stderr, "%s: failed to load stage\n", path);
+      status = 2;
+      continue;
+    }
+    base.accel = options.accel;
+    StageData *stage = &base;
+    if (options.radius > 0.0f) {
+      if (!InflateStage(&base, options.radius, &inflated)) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        status = 2;
+        continue;
+      }
+      stage = &inflated;
+    }
+    if (options.accel == STAGE_ACCEL_PLUGIN &&
+        !LoadStagePluginFor(path, stage)) {
+      fprintf(stderr, "%s: no plugin built from this stage; run beamcc\n",
+              path);
+      status = 2;
+      continue;
+    }
+    int maxBounces =
+        options.maxBounces >= 0 ? options.maxBounces : stage->maxBounces;
+    if (options.mode == SOLVE_HEATMAP) {
+      double start = Now();
+      if (!ComputeBeamHeatmap(stage, stage->start, options.rays, maxBounces,
+                              options.maxLength, STAGE_SCREEN_WIDTH,
+                              STAGE_SCREEN_HEIGHT, pool, &heatmap)) {
+        fprintf(stderr, "%s: failed to build heatmap\n", path);
+        status = 2;
+        continue;
+      }
+      double elapsed = Now() - start;
+      printf("%s: heatmap of %d rays on %d threads in %.3f s (%.1f Mrays/s)\n",
+             path, options.rays, GetBeamPoolThreads(pool), elapsed,
+             (double)options.rays / elapsed * 1e-6);
+      PrintHeatmapStats(stage, &heatmap, maxBounces);
+      if (!WriteHeatmap(options.outPrefix ? options.outPrefix : path,
+                        &heatmap)) {
+        fprintf(stderr, "%s: failed to write heatmap images\n", path);
+        status = 2;
+      }
+      continue;
+    }
+    if (!stage->hasGoal) {
+      printf("%s: no goal\n", path);
+      if (status == 0)
+        status = 1;
+      continue;
+    }
+
+    // Only the outcome matters to the solvers, so periodic paths can stop at
+    // their first repeat. The table keeps full traces: its cache file is the
+    // one the game maps.
+    stage->stopLoops = options.mode != SOLVE_TABLE;
+    double start = Now();
+    bool solved;
+    if (options.mode == SOLVE_SWEEP) {
+      SweepJob job = {stage, &options, maxBounces, segments};
+      RunBeamPool(pool, options.rays, 4096, SweepRange, &job);
+      solved = CollectSweepWindows(&options, segments, &windows);
+    } else if (options.mode == SOLVE_ADAPTIVE) {
+      solved = SolveStageAdaptive(stage, maxBounces, options.maxLength,
+                                  options.rays, pool, &windows);
+    } else if (options.mode == SOLVE_BIDIR) {
+      solved = SolveStageBidirectional(stage, maxBounces, options.maxLength,
+                                       4096, options.rays, pool, &windows);
+    } else {
+      // The cache file belongs to the stage as written, not a thick beam.
+      const char *cachePath = options.radius > 0.0f ? NULL : path;
+      if (!LoadBeamLut(cachePath, stage, options.rays, maxBounces,
+                       options.maxLength, pool, &table)) {
+        fprintf(stderr, "%s: failed to build outcome table\n", path);
+        status = 2;
+        continue;
+      }
+      for (int i = 0; i < options.rays; i++)
+        segments[i] =
+            table.entries[i].hitGoal ? table.entries[i].bounces + 1 : 0;
+      solved = CollectSweepWindows(&options, segments, &windows);
+      if (table.cached)
+        windows.rays = 0;
+    }
+    double elapsed = Now() - start;
+    if (!solved) {
+      fprintf(stderr, "%s: out of memory while solving\n", path);
+      status = 2;
+      continue;
+    }
+
+    if (options.mode == SOLVE_TABLE && table.cached)
+      printf("%s: cached table in %.3f s\n", path, elapsed);
+    else
+      printf("%s: %lld rays on %d threads in %.3f s (%.1f Mrays/s)\n", path,
+             windows.rays, GetBeamPoolThreads(pool), elapsed,
+             (double)windows.rays / elapsed * 1e-6);
+    PrintWindows(&windows);
+    if (windows.count == 0 && status == 0)
+      status = 1;
+  }
+
+  UnloadStage(&base);
+  UnloadStage(&inflated);
+  UnloadBeamWindows(&windows);
+  UnloadBeamLut(&table);
+  UnloadBeamHeatmap(&heatmap);
+  free(segments);
+  DestroyBeamPool(pool);
+  return status;
+}